@@ -19,10 +19,15 @@
 */
 #include <stdio.h>
 #include <string.h>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
 
 #include "framework/zdray.h"
 #include "framework/templates.h"
 #include "framework/tarray.h"
+#include "framework/parallel.h"
 #include "blockmapbuilder/blockmapbuilder.h"
 
 #undef BLOCK_TEST
@@ -172,11 +177,8 @@ notest:
 
 void FBlockmapBuilder::BuildBlockmap ()
 {
-	TArray<uint16_t> *BlockLists, *block, *endblock;
 	uint16_t adder;
-	int bmapwidth, bmapheight;
 	int minx, maxx, miny, maxy;
-	uint16_t line;
 
 	if (Level.NumVertices <= 0)
 		return;
@@ -200,243 +202,287 @@ void FBlockmapBuilder::BuildBlockmap ()
 	minx &= ~7;
 	miny &= ~7;
 */
-	bmapwidth =	 ((maxx - minx) >> BLOCKBITS) + 1;
-	bmapheight = ((maxy - miny) >> BLOCKBITS) + 1;
+	MinX = minx;
+	MinY = miny;
+	BMapWidth =	 ((maxx - minx) >> BLOCKBITS) + 1;
+	BMapHeight = ((maxy - miny) >> BLOCKBITS) + 1;
 
 	adder = uint16_t(minx);			BlockMap.Push (adder);
 	adder = uint16_t(miny);			BlockMap.Push (adder);
-	adder = uint16_t(bmapwidth);	BlockMap.Push (adder);
-	adder = uint16_t(bmapheight);	BlockMap.Push (adder);
+	adder = uint16_t(BMapWidth);	BlockMap.Push (adder);
+	adder = uint16_t(BMapHeight);	BlockMap.Push (adder);
 
-	BlockLists = new TArray<uint16_t>[bmapwidth * bmapheight];
+	const int numBlocks = BMapWidth * BMapHeight;
+	const int numLines = Level.NumLines();
 
-	for (line = 0; line < Level.NumLines(); ++line)
+	// Each thread rasterizes a contiguous range of lines, so concatenating
+	// the threads' output for a block keeps its lines in ascending order.
+	int numThreads = std::max(std::min(GetNumThreads(), numLines / 1024), 1);
+
+	auto runThreads = [&](const std::function<void(int, int, int)> &work)
+	{
+		ParallelFor(numThreads, [&](size_t t)
+		{
+			int start = int((int64_t)numLines * t / numThreads);
+			int end = int((int64_t)numLines * (t + 1) / numThreads);
+			work((int)t, start, end);
+		});
+	};
+
+	// Pass 1: count how many lines each thread puts in every block.
+	std::vector<unsigned int> counts((size_t)numThreads * numBlocks, 0);
+	runThreads([&](int t, int start, int end)
 	{
-		int x1 = Level.Vertices[Level.Lines[line].v1].x >> FRACBITS;
-		int y1 = Level.Vertices[Level.Lines[line].v1].y >> FRACBITS;
-		int x2 = Level.Vertices[Level.Lines[line].v2].x >> FRACBITS;
-		int y2 = Level.Vertices[Level.Lines[line].v2].y >> FRACBITS;
-		int dx = x2 - x1;
-		int dy = y2 - y1;
-		int bx = (x1 - minx) >> BLOCKBITS;
-		int by = (y1 - miny) >> BLOCKBITS;
-		int bx2 = (x2 - minx) >> BLOCKBITS;
-		int by2 = (y2 - miny) >> BLOCKBITS;
-
-		block = &BlockLists[bx + by * bmapwidth];
-		endblock = &BlockLists[bx2 + by2 * bmapwidth];
-
-		if (block == endblock)	// Single block
+		unsigned int *threadCounts = &counts[(size_t)t * numBlocks];
+		for (int line = start; line < end; ++line)
 		{
-			block->Push (line);
+			RasterizeLine (line, [&](int block) { threadCounts[block]++; });
 		}
-		else if (by == by2)		// Horizontal line
+	});
+
+	// Turn the counts into row starts and per-thread write positions.
+	BlockStarts.Resize (numBlocks + 1);
+	unsigned int total = 0;
+	for (int i = 0; i < numBlocks; ++i)
+	{
+		BlockStarts[i] = total;
+		for (int t = 0; t < numThreads; ++t)
 		{
-			if (bx > bx2)
-			{
-				std::swap (block, endblock);
-			}
-			do
-			{
-				block->Push (line);
-				block += 1;
-			} while (block <= endblock);
+			unsigned int count = counts[(size_t)t * numBlocks + i];
+			counts[(size_t)t * numBlocks + i] = total;
+			total += count;
 		}
-		else if (bx == bx2)	// Vertical line
+	}
+	BlockStarts[numBlocks] = total;
+
+	// Pass 2: fill in the lines.
+	BlockLines.Resize (total);
+	runThreads([&](int t, int start, int end)
+	{
+		unsigned int *threadPos = &counts[(size_t)t * numBlocks];
+		uint16_t *lines = BlockLines.Data();
+		for (int line = start; line < end; ++line)
 		{
-			if (by > by2)
+			RasterizeLine (line, [&](int block) { lines[threadPos[block]++] = uint16_t(line); });
+		}
+	});
+
+	BlockMap.Reserve (numBlocks);
+	CreatePackedBlockmap ();
+
+	BlockStarts.Clear ();
+	BlockStarts.ShrinkToFit ();
+	BlockLines.Clear ();
+	BlockLines.ShrinkToFit ();
+}
+
+// Calls addToBlock once for every block the line passes through.
+template<typename Func>
+void FBlockmapBuilder::RasterizeLine (int line, Func &&addToBlock)
+{
+	int minx = MinX, miny = MinY;
+	int bmapwidth = BMapWidth;
+	int x1 = Level.Vertices[Level.Lines[line].v1].x >> FRACBITS;
+	int y1 = Level.Vertices[Level.Lines[line].v1].y >> FRACBITS;
+	int x2 = Level.Vertices[Level.Lines[line].v2].x >> FRACBITS;
+	int y2 = Level.Vertices[Level.Lines[line].v2].y >> FRACBITS;
+	int dx = x2 - x1;
+	int dy = y2 - y1;
+	int bx = (x1 - minx) >> BLOCKBITS;
+	int by = (y1 - miny) >> BLOCKBITS;
+	int bx2 = (x2 - minx) >> BLOCKBITS;
+	int by2 = (y2 - miny) >> BLOCKBITS;
+
+	int block = bx + by * bmapwidth;
+	int endblock = bx2 + by2 * bmapwidth;
+
+	if (block == endblock)	// Single block
+	{
+		addToBlock (block);
+	}
+	else if (by == by2)		// Horizontal line
+	{
+		if (bx > bx2)
+		{
+			std::swap (block, endblock);
+		}
+		do
+		{
+			addToBlock (block);
+			block += 1;
+		} while (block <= endblock);
+	}
+	else if (bx == bx2)	// Vertical line
+	{
+		if (by > by2)
+		{
+			std::swap (block, endblock);
+		}
+		do
+		{
+			addToBlock (block);
+			block += bmapwidth;
+		} while (block <= endblock);
+	}
+	else				// Diagonal line
+	{
+		int xchange = (dx < 0) ? -1 : 1;
+		int ychange = (dy < 0) ? -1 : 1;
+		int ymove = ychange * bmapwidth;
+		int adx = abs (dx);
+		int ady = abs (dy);
+
+		if (adx == ady)		// 45 degrees
+		{
+			int xb = (x1 - minx) & (BLOCKSIZE-1);
+			int yb = (y1 - miny) & (BLOCKSIZE-1);
+			if (dx < 0)
 			{
-				std::swap (block, endblock);
+				xb = BLOCKSIZE-xb;
 			}
-			do
+			if (dy < 0)
 			{
-				block->Push (line);
-				block += bmapwidth;
-			} while (block <= endblock);
+				yb = BLOCKSIZE-yb;
+			}
+			if (xb < yb)
+				adx--;
 		}
-		else				// Diagonal line
+		if (adx >= ady)		// X-major
 		{
-			int xchange = (dx < 0) ? -1 : 1;
-			int ychange = (dy < 0) ? -1 : 1;
-			int ymove = ychange * bmapwidth;
-			int adx = abs (dx);
-			int ady = abs (dy);
-
-			if (adx == ady)		// 45 degrees
+			int yadd = dy < 0 ? -1 : BLOCKSIZE;
+			do
 			{
-				int xb = (x1 - minx) & (BLOCKSIZE-1);
-				int yb = (y1 - miny) & (BLOCKSIZE-1);
-				if (dx < 0)
-				{
-					xb = BLOCKSIZE-xb;
-				}
-				if (dy < 0)
+				int stop = (Scale ((by << BLOCKBITS) + yadd - (y1 - miny), dx, dy) + (x1 - minx)) >> BLOCKBITS;
+				while (bx != stop)
 				{
-					yb = BLOCKSIZE-yb;
+					addToBlock (block);
+					block += xchange;
+					bx += xchange;
 				}
-				if (xb < yb)
-					adx--;
+				addToBlock (block);
+				block += ymove;
+				by += ychange;
+			} while (by != by2);
+			while (block != endblock)
+			{
+				addToBlock (block);
+				block += xchange;
 			}
-			if (adx >= ady)		// X-major
+			addToBlock (block);
+		}
+		else					// Y-major
+		{
+			int xadd = dx < 0 ? -1 : BLOCKSIZE;
+			do
 			{
-				int yadd = dy < 0 ? -1 : BLOCKSIZE;
-				do
+				int stop = (Scale ((bx << BLOCKBITS) + xadd - (x1 - minx), dy, dx) + (y1 - miny)) >> BLOCKBITS;
+				while (by != stop)
 				{
-					int stop = (Scale ((by << BLOCKBITS) + yadd - (y1 - miny), dx, dy) + (x1 - minx)) >> BLOCKBITS;
-					while (bx != stop)
-					{
-						block->Push (line);
-						block += xchange;
-						bx += xchange;
-					}
-					block->Push (line);
+					addToBlock (block);
 					block += ymove;
 					by += ychange;
-				} while (by != by2);
-				while (block != endblock)
-				{
-					block->Push (line);
-					block += xchange;
 				}
-				block->Push (line);
-			}
-			else					// Y-major
+				addToBlock (block);
+				block += xchange;
+				bx += xchange;
+			} while (bx != bx2);
+			while (block != endblock)
 			{
-				int xadd = dx < 0 ? -1 : BLOCKSIZE;
-				do
-				{
-					int stop = (Scale ((bx << BLOCKBITS) + xadd - (x1 - minx), dy, dx) + (y1 - miny)) >> BLOCKBITS;
-					while (by != stop)
-					{
-						block->Push (line);
-						block += ymove;
-						by += ychange;
-					}
-					block->Push (line);
-					block += xchange;
-					bx += xchange;
-				} while (bx != bx2);
-				while (block != endblock)
-				{
-					block->Push (line);
-					block += ymove;
-				}
-				block->Push (line);
+				addToBlock (block);
+				block += ymove;
 			}
+			addToBlock (block);
 		}
 	}
-
-	BlockMap.Reserve (bmapwidth * bmapheight);
-	CreatePackedBlockmap (BlockLists, bmapwidth, bmapheight);
-	delete[] BlockLists;
 }
 
-void FBlockmapBuilder::CreateUnpackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight)
+void FBlockmapBuilder::CreateUnpackedBlockmap ()
 {
-	TArray<uint16_t> *block;
 	uint16_t zero = 0;
 	uint16_t terminator = 0xffff;
 
-	for (int i = 0; i < bmapwidth * bmapheight; ++i)
+	for (int i = 0; i < BMapWidth * BMapHeight; ++i)
 	{
 		BlockMap[4+i] = uint16_t(BlockMap.Size());
 		BlockMap.Push (zero);
-		block = &blocks[i];
-		for (unsigned int j = 0; j < block->Size(); ++j)
+		for (unsigned int j = BlockStarts[i]; j < BlockStarts[i+1]; ++j)
 		{
-			BlockMap.Push ((*block)[j]);
+			BlockMap.Push (BlockLines[j]);
 		}
 		BlockMap.Push (terminator);
 	}
 }
 
-static unsigned int BlockHash (TArray<uint16_t> *block)
-{
-	int hash = 0;
-	uint16_t *ar = &(*block)[0];
-	for (size_t i = 0; i < block->Size(); ++i)
-	{
-		hash = hash * 12235 + ar[i];
-	}
-	return hash & 0x7fffffff;
-}
-
-static bool BlockCompare (TArray<uint16_t> *block1, TArray<uint16_t> *block2)
+static uint64_t BlockHash (const uint16_t *lines, unsigned int count)
 {
-	size_t size = block1->Size();
-
-	if (size != block2->Size())
-	{
-		return false;
-	}
-	if (size == 0)
-	{
-		return true;
-	}
-	uint16_t *ar1 = &(*block1)[0];
-	uint16_t *ar2 = &(*block2)[0];
-	for (size_t i = 0; i < size; ++i)
+	// 64-bit FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (unsigned int i = 0; i < count; ++i)
 	{
-		if (ar1[i] != ar2[i])
-		{
-			return false;
-		}
+		hash = (hash ^ lines[i]) * 0x100000001b3ull;
 	}
-	return true;
+	return hash ^ count;
 }
 
-void FBlockmapBuilder::CreatePackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight)
+void FBlockmapBuilder::CreatePackedBlockmap ()
 {
-	uint16_t buckets[4096];
-	uint16_t *hashes, hashblock;
-	TArray<uint16_t> *block;
+	const int numBlocks = BMapWidth * BMapHeight;
 	uint16_t zero = 0;
 	uint16_t terminator = 0xffff;
-	uint16_t *array;
-	int i, hash;
 	int hashed = 0, nothashed = 0;
 
-	hashes = new uint16_t[bmapwidth * bmapheight];
+	// Maps a hash to the first written block with that hash. Blocks whose
+	// contents differ but whose hashes collide are chained through nextSame.
+	std::unordered_map<uint64_t, int> firstWithHash;
+	std::vector<int> nextSame(numBlocks, -1);
+	firstWithHash.reserve (numBlocks);
 
-	memset (hashes, 0xff, sizeof(uint16_t)*bmapwidth*bmapheight);
-	memset (buckets, 0xff, sizeof(buckets));
-
-	for (i = 0; i < bmapwidth * bmapheight; ++i)
+	for (int i = 0; i < numBlocks; ++i)
 	{
-		block = &blocks[i];
-		hash = BlockHash (block) % 4096;
-		hashblock = buckets[hash];
-		while (hashblock != 0xffff)
+		const uint16_t *lines = BlockLines.Data() + BlockStarts[i];
+		unsigned int count = BlockStarts[i+1] - BlockStarts[i];
+		uint64_t hash = BlockHash (lines, count);
+		int match = -1;
+
+		auto it = firstWithHash.find (hash);
+		if (it != firstWithHash.end())
 		{
-			if (BlockCompare (block, &blocks[hashblock]))
+			for (int j = it->second; j >= 0; j = nextSame[j])
 			{
-				break;
+				if (BlockStarts[j+1] - BlockStarts[j] == count &&
+					memcmp (BlockLines.Data() + BlockStarts[j], lines, count * sizeof(uint16_t)) == 0)
+				{
+					match = j;
+					break;
+				}
 			}
-			hashblock = hashes[hashblock];
 		}
-		if (hashblock != 0xffff)
+		if (match >= 0)
 		{
-			BlockMap[4+i] = BlockMap[4+hashblock];
+			BlockMap[4+i] = BlockMap[4+match];
 			hashed++;
 		}
 		else
 		{
-			hashes[i] = buckets[hash];
-			buckets[hash] = uint16_t(i);
+			if (it != firstWithHash.end())
+			{
+				nextSame[i] = it->second;
+				it->second = i;
+			}
+			else
+			{
+				firstWithHash[hash] = i;
+			}
 			BlockMap[4+i] = uint16_t(BlockMap.Size());
 			BlockMap.Push (zero);
-			array = &(*block)[0];
-			for (size_t j = 0; j < block->Size(); ++j)
+			for (unsigned int j = 0; j < count; ++j)
 			{
-				BlockMap.Push (array[j]);
+				BlockMap.Push (lines[j]);
 			}
 			BlockMap.Push (terminator);
 			nothashed++;
 		}
 	}
 
-	delete[] hashes;
-
 //	printf ("%d blocks written, %d blocks saved\n", nothashed, hashed);
 }
-
@@ -15,7 +15,16 @@ private:
 	FLevel &Level;
 	TArray<uint16_t> BlockMap;
 
+	int MinX, MinY;
+	int BMapWidth, BMapHeight;
+
+	// The lines in each block, stored as compressed sparse rows: block i
+	// holds BlockLines[BlockStarts[i]] up to BlockLines[BlockStarts[i+1]-1].
+	TArray<unsigned int> BlockStarts;
+	TArray<uint16_t> BlockLines;
+
 	void BuildBlockmap ();
-	void CreateUnpackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight);
-	void CreatePackedBlockmap (TArray<uint16_t> *blocks, int bmapwidth, int bmapheight);
+	template<typename Func> void RasterizeLine (int line, Func &&addToBlock);
+	void CreateUnpackedBlockmap ();
+	void CreatePackedBlockmap ();
 };
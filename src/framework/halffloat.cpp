@@ -23,6 +23,23 @@
 */
 
 #include "halffloat.h"
+#include <algorithm>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_F16C
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+// In halffloat_f16c.cpp, which is the only file built with F16C enabled
+void floatToHalfArrayF16C(const float *src, unsigned short *dst, size_t count, float minval, float maxval);
+void halfToFloatArrayF16C(const unsigned short *src, float *dst, size_t count);
+#endif
 
 namespace HalfFloatTables
 {
@@ -2181,37 +2198,37 @@ namespace HalfFloatTables
 		1024,
 		1024,
 		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
-		0,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
+		1024,
 	};
 
 	unsigned short base_table[512] =
@@ -3289,7 +3306,10 @@ namespace HalfFloatTables
 		offset_table[0] = 0;
 		offset_table[32] = 0;
 		for (int i = 1; i < 32; i++)
+		{
 			offset_table[i] = 1024;
+			offset_table[32 + i] = 1024;
+		}
 
 		for(unsigned int i=0; i<256; ++i)
 		{
@@ -3379,3 +3399,130 @@ namespace HalfFloatTables
 	}
 	*/
 }
+
+#ifdef HAVE_F16C
+// The F16C instructions are VEX encoded, so the OS must save the AVX state too
+static bool CheckF16C()
+{
+	const unsigned int osxsave = 1 << 27, avx = 1 << 28, f16c = 1 << 29;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	unsigned int ecx = info[2];
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+#endif
+	if ((ecx & (osxsave | avx | f16c)) != (osxsave | avx | f16c))
+		return false;
+
+#ifdef _MSC_VER
+	unsigned long long xcr0 = _xgetbv(0);
+#else
+	unsigned int xcr0, xcr0hi;
+	__asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));
+#endif
+	return (xcr0 & 6) == 6;
+}
+
+static const bool HaveF16C = CheckF16C();
+#endif
+
+#ifndef NO_SSE
+// Same rounding as the tables: toward zero, with anything from 65536 up
+// becoming infinity
+static inline __m128i floatToHalf4(__m128 value)
+{
+	__m128i f = _mm_castps_si128(value);
+	__m128i sign = _mm_and_si128(_mm_srli_epi32(f, 16), _mm_set1_epi32(0x8000));
+	__m128i a = _mm_and_si128(f, _mm_set1_epi32(0x7fffffff));
+
+	__m128i normal = _mm_srli_epi32(_mm_sub_epi32(a, _mm_set1_epi32(0x38000000)), 13);
+	__m128i denormal = _mm_cvttps_epi32(_mm_mul_ps(_mm_castsi128_ps(a), _mm_set1_ps(16777216.0f)));
+	__m128i infnan = _mm_or_si128(_mm_set1_epi32(0x7c00), _mm_srli_epi32(_mm_and_si128(a, _mm_set1_epi32(0x007fffff)), 13));
+
+	__m128i isDenormal = _mm_cmplt_epi32(a, _mm_set1_epi32(0x38800000));
+	__m128i isOverflow = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x477fffff));
+	__m128i isInfNan = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x7f7fffff));
+
+	__m128i h = _mm_or_si128(_mm_and_si128(isDenormal, denormal), _mm_andnot_si128(isDenormal, normal));
+	h = _mm_or_si128(_mm_and_si128(isOverflow, _mm_set1_epi32(0x7c00)), _mm_andnot_si128(isOverflow, h));
+	h = _mm_or_si128(_mm_and_si128(isInfNan, infnan), _mm_andnot_si128(isInfNan, h));
+	h = _mm_or_si128(h, sign);
+
+	// Sign extend so the saturating pack keeps all 16 bits
+	return _mm_srai_epi32(_mm_slli_epi32(h, 16), 16);
+}
+
+static inline __m128 halfToFloat4(__m128i h)
+{
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+	__m128i em = _mm_and_si128(h, _mm_set1_epi32(0x7fff));
+
+	__m128i normal = _mm_add_epi32(_mm_slli_epi32(em, 13), _mm_set1_epi32(0x38000000));
+	__m128i denormal = _mm_castps_si128(_mm_mul_ps(_mm_cvtepi32_ps(em), _mm_set1_ps(1.0f / 16777216.0f)));
+	__m128i infnan = _mm_or_si128(_mm_slli_epi32(em, 13), _mm_set1_epi32(0x7f800000));
+
+	__m128i isDenormal = _mm_cmplt_epi32(em, _mm_set1_epi32(0x0400));
+	__m128i isInfNan = _mm_cmpgt_epi32(em, _mm_set1_epi32(0x7bff));
+
+	__m128i f = _mm_or_si128(_mm_and_si128(isDenormal, denormal), _mm_andnot_si128(isDenormal, normal));
+	f = _mm_or_si128(_mm_and_si128(isInfNan, infnan), _mm_andnot_si128(isInfNan, f));
+	return _mm_castsi128_ps(_mm_or_si128(f, sign));
+}
+#endif
+
+void floatToHalfArray(const float *src, unsigned short *dst, size_t count, float minval, float maxval)
+{
+#ifdef HAVE_F16C
+	if (HaveF16C)
+	{
+		floatToHalfArrayF16C(src, dst, count, minval, maxval);
+		return;
+	}
+#endif
+
+	size_t i = 0;
+#ifndef NO_SSE
+	__m128 lo = _mm_set1_ps(minval);
+	__m128 hi = _mm_set1_ps(maxval);
+	for (; i + 8 <= count; i += 8)
+	{
+		// Operand order matches std::min/max, so NaN passes through like in the scalar loop
+		__m128 a = _mm_max_ps(lo, _mm_min_ps(hi, _mm_loadu_ps(src + i)));
+		__m128 b = _mm_max_ps(lo, _mm_min_ps(hi, _mm_loadu_ps(src + i + 4)));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(floatToHalf4(a), floatToHalf4(b)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		dst[i] = floatToHalf(std::max(std::min(src[i], maxval), minval));
+	}
+}
+
+void halfToFloatArray(const unsigned short *src, float *dst, size_t count)
+{
+#ifdef HAVE_F16C
+	if (HaveF16C)
+	{
+		halfToFloatArrayF16C(src, dst, count);
+		return;
+	}
+#endif
+
+	size_t i = 0;
+#ifndef NO_SSE
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_ps(dst + i, halfToFloat4(_mm_unpacklo_epi16(h, zero)));
+		_mm_storeu_ps(dst + i + 4, halfToFloat4(_mm_unpackhi_epi16(h, zero)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		dst[i] = halfToFloat(src[i]);
+	}
+}
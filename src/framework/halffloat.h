@@ -24,6 +24,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 namespace HalfFloatTables
 {
 	extern unsigned int mantissa_table[2048];
@@ -66,3 +68,10 @@ inline unsigned short floatToHalf(float float_value)
 	unsigned int f = *static_cast<unsigned int*>(ptr);
 	return base_table[(f >> 23) & 0x1ff] + ((f & 0x007fffff) >> shift_table[(f >> 23) & 0x1ff]);
 }
+
+/// Convert count floats to half-floats, clamping them to [minval, maxval] first.
+/// Gives the same results as floatToHalf for anything but NaN.
+void floatToHalfArray(const float *src, unsigned short *dst, size_t count, float minval, float maxval);
+
+/// Convert count half-floats to floats
+void halfToFloatArray(const unsigned short *src, float *dst, size_t count);
@@ -0,0 +1,59 @@
+//
+// Batched half float conversions using the F16C instructions. This file is
+// built with F16C code generation enabled, so nothing in it may run before
+// halffloat.cpp has checked that the processor supports it.
+//
+
+#include "halffloat.h"
+#include <algorithm>
+
+#ifdef HAVE_F16C
+#include <immintrin.h>
+
+void floatToHalfArrayF16C(const float *src, unsigned short *dst, size_t count, float minval, float maxval)
+{
+	__m128 lo = _mm_set1_ps(minval);
+	__m128 hi = _mm_set1_ps(maxval);
+	__m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 overflow = _mm_set1_ps(65536.0f);
+	__m128i inf = _mm_set1_epi16(0x7c00);
+	__m128i signbit = _mm_set1_epi16((short)0x8000);
+
+	size_t i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 value = _mm_max_ps(lo, _mm_min_ps(hi, _mm_loadu_ps(src + i)));
+		__m128i h = _mm_cvtps_ph(value, _MM_FROUND_TO_ZERO);
+
+		// Rounding toward zero saturates to the largest finite half, where the
+		// tables give infinity. Patch those lanes so all paths agree.
+		__m128i over = _mm_castps_si128(_mm_cmpge_ps(_mm_and_ps(value, absmask), overflow));
+		over = _mm_packs_epi32(over, over);
+		__m128i sign = _mm_srai_epi32(_mm_castps_si128(value), 31);
+		sign = _mm_and_si128(_mm_packs_epi32(sign, sign), signbit);
+		h = _mm_or_si128(_mm_and_si128(over, _mm_or_si128(inf, sign)), _mm_andnot_si128(over, h));
+
+		_mm_storel_epi64((__m128i*)(dst + i), h);
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = floatToHalf(std::max(std::min(src[i], maxval), minval));
+	}
+}
+
+void halfToFloatArrayF16C(const unsigned short *src, float *dst, size_t count)
+{
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i h = _mm_loadu_si128((const __m128i*)(src + i));
+		_mm_storeu_ps(dst + i, _mm_cvtph_ps(h));
+		_mm_storeu_ps(dst + i + 4, _mm_cvtph_ps(_mm_unpackhi_epi64(h, h)));
+	}
+	for (; i < count; i++)
+	{
+		dst[i] = halfToFloat(src[i]);
+	}
+}
+
+#endif
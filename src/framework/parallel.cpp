@@ -0,0 +1,14 @@
+
+#include "parallel.h"
+
+extern int NumThreads;
+
+int GetNumThreads()
+{
+	int numThreads = NumThreads;
+	if (numThreads <= 0)
+		numThreads = std::thread::hardware_concurrency();
+	if (numThreads <= 0)
+		numThreads = 4;
+	return numThreads;
+}
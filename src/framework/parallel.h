@@ -0,0 +1,32 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use: the -j setting, or one per hardware
+// thread when that is left at zero.
+int GetNumThreads();
+
+// Calls fn(i) for every i below count. Indices are handed out in order to
+// up to GetNumThreads() threads, one of which is the calling thread.
+template<typename F>
+void ParallelFor(size_t count, F fn)
+{
+	int numThreads = (int)std::min<size_t>(GetNumThreads(), count);
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < count; i = next++)
+			fn(i);
+	};
+
+	std::vector<std::thread> threads;
+	for (int i = 1; i < numThreads; i++)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (std::thread& t : threads)
+		t.join();
+}
@@ -0,0 +1,92 @@
+
+#include "progress.h"
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+extern EProgressMode ProgressMode;
+
+ProgressPhase::ProgressPhase(const char *name, size_t total) : Mode(ProgressMode), Name(name), Total(total), Done(0)
+{
+	// Carriage returns only make sense on a terminal, not in a log file
+	if (Mode == PROGRESS_TTY && !isatty(fileno(stdout)))
+		Mode = PROGRESS_Lines;
+
+	StartTime = std::chrono::steady_clock::now();
+
+	if (Mode == PROGRESS_JSON)
+		Report("begin", 0);
+
+	if (Mode != PROGRESS_None)
+		Reporter = std::thread([this]() { ReportLoop(); });
+}
+
+ProgressPhase::~ProgressPhase()
+{
+	if (Reporter.joinable())
+	{
+		{
+			std::unique_lock<std::mutex> lock(Mutex);
+			Finished = true;
+		}
+		Wakeup.notify_all();
+		Reporter.join();
+	}
+
+	if (Mode != PROGRESS_None)
+		Report("end", Done.load());
+}
+
+void ProgressPhase::ReportLoop()
+{
+	// A terminal gets a smooth counter, log collectors a line per second
+	auto interval = std::chrono::milliseconds(Mode == PROGRESS_TTY ? 100 : 1000);
+
+	std::unique_lock<std::mutex> lock(Mutex);
+	while (!Wakeup.wait_for(lock, interval, [this]() { return Finished; }))
+	{
+		size_t done = Done.load(std::memory_order_relaxed);
+		if (done != LastReported)
+			Report("running", done);
+	}
+}
+
+void ProgressPhase::Report(const char *state, size_t done)
+{
+	LastReported = done;
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - StartTime).count();
+
+	if (Mode == PROGRESS_JSON)
+	{
+		std::string name;
+		for (char c : Name)
+		{
+			if (c == '"' || c == '\\')
+				name.push_back('\\');
+			name.push_back(c);
+		}
+		// Kept apart from the log lines on stdout so the stream is pure JSON
+		fprintf(stderr, "{\"phase\":\"%s\",\"state\":\"%s\",\"done\":%zu,\"total\":%zu,\"elapsed\":%.3f}\n", name.c_str(), state, done, Total, elapsed);
+		fflush(stderr);
+		return;
+	}
+
+	double percent = Total > 0 ? double(done) / double(Total) * 100 : 100.0;
+	if (Mode == PROGRESS_Lines)
+	{
+		printf("%s: %.1f%%\t%zu/%zu\n", Name.c_str(), percent, done, Total);
+	}
+	else
+	{
+		printf("\r%s: %.1f%%\t%zu/%zu", Name.c_str(), percent, done, Total);
+		if (state[0] == 'e')
+			printf("\n");
+	}
+	fflush(stdout);
+}
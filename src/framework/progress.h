@@ -0,0 +1,50 @@
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum EProgressMode
+{
+	PROGRESS_None,		// Only the surrounding log lines are printed
+	PROGRESS_TTY,		// A percentage line redrawn in place
+	PROGRESS_Lines,		// TTY mode when stdout is not a terminal: one line per report
+	PROGRESS_JSON		// One JSON object per line on stderr for log collectors
+};
+
+// Progress of one phase of work, such as ray tracing a map. Workers only
+// bump an atomic counter with Advance. A reporter thread owned by the phase
+// prints the counter at a fixed rate until the phase is destroyed, so hot
+// loops never touch stdio.
+class ProgressPhase
+{
+public:
+	ProgressPhase(const char *name, size_t total);
+	~ProgressPhase();
+
+	void Advance(size_t amount = 1) { Done.fetch_add(amount, std::memory_order_relaxed); }
+
+private:
+	void ReportLoop();
+	void Report(const char *state, size_t done);
+
+	EProgressMode Mode;
+	std::string Name;
+	size_t Total;
+	std::atomic<size_t> Done;
+	size_t LastReported = (size_t)-1;
+	std::chrono::steady_clock::time_point StartTime;
+
+	std::mutex Mutex;
+	std::condition_variable Wakeup;
+	bool Finished = false;
+	std::thread Reporter;
+
+	ProgressPhase(const ProgressPhase &) = delete;
+	ProgressPhase &operator=(const ProgressPhase &) = delete;
+};
@@ -22,6 +22,13 @@ enum ERejectMode
 	ERM_Rebuild
 };
 
+enum ENodeMetric
+{
+	ENM_Segs,
+	ENM_Size,
+	ENM_Depth
+};
+
 extern const char		*Map;
 extern const char		*InName;
 extern const char		*OutName;
@@ -29,11 +36,16 @@ extern bool				 BuildNodes, BuildGLNodes, ConformNodes, GLOnly, WriteComments;
 extern bool				 NoPrune;
 extern EBlockmapMode	 BlockmapMode;
 extern ERejectMode		 RejectMode;
+extern bool				 ExactReject;
+extern bool				 UpdateInPlace;
 extern int				 MaxSegs;
 extern int				 SplitCost;
 extern int				 AAPreference;
+extern int				 NodeCandidates;
+extern ENodeMetric		 NodeMetric;
 extern bool				 CheckPolyobjs;
 extern bool				 CompressNodes, CompressGLNodes, ForceCompression, V5GLNodes;
+extern int				 CompressLevel;
 extern bool				 HaveSSE1, HaveSSE2;
 extern int				 SSELevel;
 
@@ -19,10 +19,14 @@
 */
 
 #include "level/level.h"
+#include "framework/parallel.h"
 #include "lightmap/cpuraytracer.h"
 #include "lightmap/gpuraytracer.h"
-//#include "rejectbuilder.h"
+#include "rejectbuilder/rejectbuilder.h"
 #include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #pragma warning(disable: 4267) // warning C4267: 'argument': conversion from 'size_t' to 'int', possible loss of data
@@ -31,6 +35,11 @@
 
 extern int LMDims;
 extern bool CPURaytrace;
+extern bool AdaptiveSamples;
+extern int AdaptiveSamplesMin;
+extern int AdaptiveSamplesMax;
+extern bool ProgressiveBake;
+extern double ProgressiveTime;
 
 extern void ShowView (FLevel *level);
 
@@ -130,43 +139,44 @@ void FProcessor::LoadThings ()
 
 	if (Extended)
 	{
-		MapThing2 *Things;
-		ReadMapLump<MapThing2> (Wad, "THINGS", Lump, Things, NumThings);
+		FLumpSpan span = Wad.GetMapLump ("THINGS", Lump);
+		NumThings = span.Count<MapThing2> ();
 
 		Level.Things.Resize(NumThings);
 		for (int i = 0; i < NumThings; ++i)
 		{
-			Level.Things[i].thingid = Things[i].thingid;
-			Level.Things[i].x = LittleShort(Things[i].x) << FRACBITS;
-			Level.Things[i].y = LittleShort(Things[i].y) << FRACBITS;
-			Level.Things[i].z = LittleShort(Things[i].z);
-			Level.Things[i].angle = LittleShort(Things[i].angle);
-			Level.Things[i].type = LittleShort(Things[i].type);
-			Level.Things[i].flags = LittleShort(Things[i].flags);
-			Level.Things[i].special = Things[i].special;
-			Level.Things[i].args[0] = Things[i].args[0];
-			Level.Things[i].args[1] = Things[i].args[1];
-			Level.Things[i].args[2] = Things[i].args[2];
-			Level.Things[i].args[3] = Things[i].args[3];
-			Level.Things[i].args[4] = Things[i].args[4];
+			MapThing2 thing = span.Get<MapThing2> (i);
+			Level.Things[i].thingid = thing.thingid;
+			Level.Things[i].x = LittleShort(thing.x) << FRACBITS;
+			Level.Things[i].y = LittleShort(thing.y) << FRACBITS;
+			Level.Things[i].z = LittleShort(thing.z);
+			Level.Things[i].angle = LittleShort(thing.angle);
+			Level.Things[i].type = LittleShort(thing.type);
+			Level.Things[i].flags = LittleShort(thing.flags);
+			Level.Things[i].special = thing.special;
+			Level.Things[i].args[0] = thing.args[0];
+			Level.Things[i].args[1] = thing.args[1];
+			Level.Things[i].args[2] = thing.args[2];
+			Level.Things[i].args[3] = thing.args[3];
+			Level.Things[i].args[4] = thing.args[4];
 			Level.Things[i].pitch = 0;
-			Level.Things[i].alpha = Things[i].alpha;
+			Level.Things[i].alpha = thing.alpha;
 		}
-		delete[] Things;
 	}
 	else
 	{
-		MapThing *mt;
-		ReadMapLump<MapThing> (Wad, "THINGS", Lump, mt, NumThings);
+		FLumpSpan span = Wad.GetMapLump ("THINGS", Lump);
+		NumThings = span.Count<MapThing> ();
 
 		Level.Things.Resize(NumThings);
 		for (int i = 0; i < NumThings; ++i)
 		{
-			Level.Things[i].x = LittleShort(mt[i].x) << FRACBITS;
-			Level.Things[i].y = LittleShort(mt[i].y) << FRACBITS;
-			Level.Things[i].angle = LittleShort(mt[i].angle);
-			Level.Things[i].type = LittleShort(mt[i].type);
-			Level.Things[i].flags = LittleShort(mt[i].flags);
+			MapThing mt = span.Get<MapThing> (i);
+			Level.Things[i].x = LittleShort(mt.x) << FRACBITS;
+			Level.Things[i].y = LittleShort(mt.y) << FRACBITS;
+			Level.Things[i].angle = LittleShort(mt.angle);
+			Level.Things[i].type = LittleShort(mt.type);
+			Level.Things[i].flags = LittleShort(mt.flags);
 			Level.Things[i].z = 0;
 			Level.Things[i].special = 0;
 			Level.Things[i].args[0] = 0;
@@ -177,7 +187,6 @@ void FProcessor::LoadThings ()
 			Level.Things[i].pitch = 0;
 			Level.Things[i].alpha = 1.0f;
 		}
-		delete[] mt;
 	}
 }
 
@@ -243,104 +252,101 @@ void FProcessor::LoadLines ()
 
 	if (Extended)
 	{
-		MapLineDef2 *Lines;
-
-		ReadMapLump<MapLineDef2> (Wad, "LINEDEFS", Lump, Lines, NumLines);
+		FLumpSpan span = Wad.GetMapLump ("LINEDEFS", Lump);
+		NumLines = span.Count<MapLineDef2> ();
 
 		Level.Lines.Resize(NumLines);
 		for (int i = 0; i < NumLines; ++i)
 		{
-			Level.Lines[i].special = Lines[i].special;
-			Level.Lines[i].args[0] = Lines[i].args[0];
-			Level.Lines[i].args[1] = Lines[i].args[1];
-			Level.Lines[i].args[2] = Lines[i].args[2];
-			Level.Lines[i].args[3] = Lines[i].args[3];
-			Level.Lines[i].args[4] = Lines[i].args[4];
-			Level.Lines[i].v1 = LittleShort(Lines[i].v1);
-			Level.Lines[i].v2 = LittleShort(Lines[i].v2);
-			Level.Lines[i].flags = LittleShort(Lines[i].flags);
-			Level.Lines[i].sidenum[0] = LittleShort(Lines[i].sidenum[0]);
-			Level.Lines[i].sidenum[1] = LittleShort(Lines[i].sidenum[1]);
+			MapLineDef2 line = span.Get<MapLineDef2> (i);
+			Level.Lines[i].special = line.special;
+			Level.Lines[i].args[0] = line.args[0];
+			Level.Lines[i].args[1] = line.args[1];
+			Level.Lines[i].args[2] = line.args[2];
+			Level.Lines[i].args[3] = line.args[3];
+			Level.Lines[i].args[4] = line.args[4];
+			Level.Lines[i].v1 = LittleShort(line.v1);
+			Level.Lines[i].v2 = LittleShort(line.v2);
+			Level.Lines[i].flags = LittleShort(line.flags);
+			Level.Lines[i].sidenum[0] = LittleShort(line.sidenum[0]);
+			Level.Lines[i].sidenum[1] = LittleShort(line.sidenum[1]);
 			if (Level.Lines[i].sidenum[0] == NO_MAP_INDEX) Level.Lines[i].sidenum[0] = NO_INDEX;
 			if (Level.Lines[i].sidenum[1] == NO_MAP_INDEX) Level.Lines[i].sidenum[1] = NO_INDEX;
 			SetLineID(&Level.Lines[i]);
 		}
-		delete[] Lines;
 	}
 	else
 	{
-		MapLineDef *ml;
-		ReadMapLump<MapLineDef> (Wad, "LINEDEFS", Lump, ml, NumLines);
+		FLumpSpan span = Wad.GetMapLump ("LINEDEFS", Lump);
+		NumLines = span.Count<MapLineDef> ();
 
 		Level.Lines.Resize(NumLines);
 		for (int i = 0; i < NumLines; ++i)
 		{
-			Level.Lines[i].v1 = LittleShort(ml[i].v1);
-			Level.Lines[i].v2 = LittleShort(ml[i].v2);
-			Level.Lines[i].flags = LittleShort(ml[i].flags);
-			Level.Lines[i].sidenum[0] = LittleShort(ml[i].sidenum[0]);
-			Level.Lines[i].sidenum[1] = LittleShort(ml[i].sidenum[1]);
+			MapLineDef ml = span.Get<MapLineDef> (i);
+			Level.Lines[i].v1 = LittleShort(ml.v1);
+			Level.Lines[i].v2 = LittleShort(ml.v2);
+			Level.Lines[i].flags = LittleShort(ml.flags);
+			Level.Lines[i].sidenum[0] = LittleShort(ml.sidenum[0]);
+			Level.Lines[i].sidenum[1] = LittleShort(ml.sidenum[1]);
 			if (Level.Lines[i].sidenum[0] == NO_MAP_INDEX) Level.Lines[i].sidenum[0] = NO_INDEX;
 			if (Level.Lines[i].sidenum[1] == NO_MAP_INDEX) Level.Lines[i].sidenum[1] = NO_INDEX;
 
 			// Store the special and tag in the args array so we don't lose them
 			Level.Lines[i].special = 0;
-			Level.Lines[i].args[0] = LittleShort(ml[i].special);
-			Level.Lines[i].args[1] = LittleShort(ml[i].tag);
+			Level.Lines[i].args[0] = LittleShort(ml.special);
+			Level.Lines[i].args[1] = LittleShort(ml.tag);
 			// We do not support slope creation via linedefs in Doom format maps because due to customizable translation
 			// we can never be sure what number a sloping special is.
 		}
-		delete[] ml;
 	}
 }
 
 void FProcessor::LoadVertices ()
 {
-	MapVertex *verts;
-	ReadMapLump<MapVertex> (Wad, "VERTEXES", Lump, verts, Level.NumVertices);
+	FLumpSpan span = Wad.GetMapLump ("VERTEXES", Lump);
+	Level.NumVertices = span.Count<MapVertex> ();
 
 	Level.Vertices = new WideVertex[Level.NumVertices];
 
 	for (int i = 0; i < Level.NumVertices; ++i)
 	{
-		Level.Vertices[i].x = LittleShort(verts[i].x) << FRACBITS;
-		Level.Vertices[i].y = LittleShort(verts[i].y) << FRACBITS;
+		MapVertex vert = span.Get<MapVertex> (i);
+		Level.Vertices[i].x = LittleShort(vert.x) << FRACBITS;
+		Level.Vertices[i].y = LittleShort(vert.y) << FRACBITS;
 		Level.Vertices[i].index = 0; // we don't need this value for non-UDMF maps
 	}
 }
 
 void FProcessor::LoadSides ()
 {
-	MapSideDef *Sides;
-	int NumSides;
-	ReadMapLump<MapSideDef> (Wad, "SIDEDEFS", Lump, Sides, NumSides);
+	FLumpSpan span = Wad.GetMapLump ("SIDEDEFS", Lump);
+	int NumSides = span.Count<MapSideDef> ();
 
 	Level.Sides.Resize(NumSides);
 	for (int i = 0; i < NumSides; ++i)
 	{
-		Level.Sides[i].textureoffset = Sides[i].textureoffset;
-		Level.Sides[i].rowoffset = Sides[i].rowoffset;
-		memcpy(Level.Sides[i].toptexture, Sides[i].toptexture, 8);
-		memcpy(Level.Sides[i].bottomtexture, Sides[i].bottomtexture, 8);
-		memcpy(Level.Sides[i].midtexture, Sides[i].midtexture, 8);
+		MapSideDef side = span.Get<MapSideDef> (i);
+		Level.Sides[i].textureoffset = side.textureoffset;
+		Level.Sides[i].rowoffset = side.rowoffset;
+		memcpy(Level.Sides[i].toptexture, side.toptexture, 8);
+		memcpy(Level.Sides[i].bottomtexture, side.bottomtexture, 8);
+		memcpy(Level.Sides[i].midtexture, side.midtexture, 8);
 
-		Level.Sides[i].sector = LittleShort(Sides[i].sector);
+		Level.Sides[i].sector = LittleShort(side.sector);
 		if (Level.Sides[i].sector == NO_MAP_INDEX) Level.Sides[i].sector = NO_INDEX;
 	}
-	delete [] Sides;
 }
 
 void FProcessor::LoadSectors ()
 {
-	MapSector *Sectors;
-	int NumSectors;
-
-	ReadMapLump<MapSector> (Wad, "SECTORS", Lump, Sectors, NumSectors);
+	FLumpSpan span = Wad.GetMapLump ("SECTORS", Lump);
+	int NumSectors = span.Count<MapSector> ();
 	Level.Sectors.Resize(NumSectors);
 
 	for (int i = 0; i < NumSectors; ++i)
 	{
-		Level.Sectors[i].data = Sectors[i];
+		Level.Sectors[i].data = span.Get<MapSector> (i);
 
 		Level.Sectors[i].ceilingplane.a = 0.0f;
 		Level.Sectors[i].ceilingplane.b = 0.0f;
@@ -632,7 +638,7 @@ void FProcessor::BuildNodes()
 		{
 			SSELevel = 0;
 		}
-		builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), BuildGLNodes);
+		builder = CreateNodeBuilder(BuildGLNodes);
 		if (builder == nullptr)
 		{
 			throw std::runtime_error("   Not enough memory to build nodes!");
@@ -662,7 +668,7 @@ void FProcessor::BuildNodes()
 				{
 					// Now repeat the process to obtain regular nodes
 					delete builder;
-					builder = new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), false);
+					builder = CreateNodeBuilder(false);
 					if (builder == nullptr)
 					{
 						throw std::runtime_error("   Not enough memory to build regular nodes!");
@@ -689,15 +695,171 @@ void FProcessor::BuildNodes()
 	}
 }
 
+//==========================================================================
+//
+// CreateNodeBuilder
+//
+// Normally this just builds a tree with the global split costs. When more
+// than one candidate is requested, several trees are built in parallel with
+// different costs and the one that scores best on NodeMetric is returned.
+//
+//==========================================================================
+
+// Cost variations tried by the candidates, in percent of the user's settings.
+static const struct { int MaxSegs, SplitCost, AAPreference; } CandidateScales[] =
+{
+	{ 100, 100, 100 },
+	{ 200, 100, 100 },
+	{ 100, 200, 100 },
+	{ 100,  50, 100 },
+	{ 100, 100, 200 },
+	{ 100, 100,  50 },
+	{ 400, 100, 100 },
+	{ 200, 200, 100 },
+	{ 200, 100, 200 },
+	{ 100,  50,  50 },
+	{  50, 100, 100 },
+	{ 400, 200, 200 },
+};
+static const int NumCandidateScales = int(sizeof(CandidateScales) / sizeof(CandidateScales[0]));
+
+FNodeBuilder *FProcessor::CreateNodeBuilder(bool makeGLnodes)
+{
+	int numCandidates = std::min(NodeCandidates, NumCandidateScales);
+	if (numCandidates <= 1)
+	{
+		return new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), makeGLnodes);
+	}
+
+	TArray<FNodeBuilder::FCosts> costs;
+	for (int i = 0; i < NumCandidateScales && (int)costs.Size() < numCandidates; ++i)
+	{
+		FNodeBuilder::FCosts cost;
+		cost.MaxSegs = std::max(MaxSegs * CandidateScales[i].MaxSegs / 100, 3);
+		cost.SplitCost = std::max(SplitCost * CandidateScales[i].SplitCost / 100, 1);
+		cost.AAPreference = std::max(AAPreference * CandidateScales[i].AAPreference / 100, 1);
+
+		unsigned int j;
+		for (j = 0; j < costs.Size(); ++j)
+		{
+			if (costs[j].MaxSegs == cost.MaxSegs && costs[j].SplitCost == cost.SplitCost && costs[j].AAPreference == cost.AAPreference)
+				break;
+		}
+		if (j == costs.Size())
+		{
+			costs.Push(cost);
+		}
+	}
+	numCandidates = costs.Size();
+
+	// Preparing a builder renumbers the level's line vertices, so it must be done
+	// serially. After the first one, the level's vertices are replaced by the builder's
+	// so that all following candidates see the same renumbered map.
+	std::vector<std::unique_ptr<FNodeBuilder>> builders(numCandidates);
+	for (int i = 0; i < numCandidates; ++i)
+	{
+		builders[i].reset(new FNodeBuilder(Level, PolyStarts, PolyAnchors, Wad.LumpName(Lump), makeGLnodes, costs[i], true));
+		if (i == 0)
+		{
+			delete[] Level.Vertices;
+			builders[0]->GetVertices(Level.Vertices, Level.NumVertices);
+		}
+	}
+
+	int numThreads = std::max(std::min(GetNumThreads(), numCandidates), 1);
+
+	printf("   Building %d node candidates on %d thread%s\n", numCandidates, numThreads, numThreads > 1 ? "s" : "");
+
+	std::vector<double> scores(numCandidates);
+	ParallelFor(numCandidates, [&](size_t i) {
+		builders[i]->Build();
+		scores[i] = ScoreNodeBuilder(builders[i].get(), makeGLnodes);
+	});
+
+	static const char *metricNames[] = { "segs", "bytes", "average depth" };
+	int best = 0;
+	for (int i = 0; i < numCandidates; ++i)
+	{
+		printf("   Candidate %d (-p %d -s %d -d %d): %.2f %s\n", i, costs[i].MaxSegs, costs[i].SplitCost, costs[i].AAPreference, scores[i], metricNames[NodeMetric]);
+		if (scores[i] < scores[best])
+		{
+			best = i;
+		}
+	}
+	printf("   Using candidate %d\n", best);
+
+	return builders[best].release();
+}
+
+// Lower scores are better. This runs on the candidate threads while the
+// level still holds the first candidate's vertices, so it only reads the
+// builder's own data.
+double FProcessor::ScoreNodeBuilder(FNodeBuilder *builder, bool makeGLnodes)
+{
+	const TArray<node_t> &nodes = builder->GetNodeTree();
+	int numNodes = nodes.Size();
+	int numSubs = builder->NumSubsectors();
+	int numSegs = builder->CountSegs(makeGLnodes);
+	int numVerts = builder->NumVertices();
+	int segSize = makeGLnodes && Level.NumLines() >= 65535 ? 13 : 11;
+
+	double score;
+	switch (NodeMetric)
+	{
+	default:
+	case ENM_Segs:
+		score = numSegs;
+		break;
+
+	case ENM_Size:
+		// Uncompressed size of an extended nodes lump, which is what gets deflated.
+		score = 4 + 8 + 8.0 * (numVerts - Level.NumOrgVerts) + 4 + 4.0 * numSubs + 4 + double(segSize) * numSegs + 4 + 32.0 * numNodes;
+		break;
+
+	case ENM_Depth:
+		score = 0;
+		if (numNodes > 0)
+		{
+			double weighted = 0, area = 0;
+			AccumulateNodeDepth(nodes, numNodes - 1, 1, weighted, area);
+			score = area > 0 ? weighted / area : 0;
+		}
+		break;
+	}
+	return score;
+}
+
+// Sums up the depth of every subsector weighted by the area of its bounding
+// box, which approximates the cost of a point lookup at a random location.
+void FProcessor::AccumulateNodeDepth(const TArray<node_t> &nodes, uint32_t node, int depth, double &weighted, double &area)
+{
+	for (int j = 0; j < 2; ++j)
+	{
+		uint32_t child = nodes[node].intchildren[j];
+		if (child & NFX_SUBSECTOR)
+		{
+			const fixed_t *bbox = nodes[node].bbox[j];
+			double a = double((bbox[BOXTOP] >> FRACBITS) - (bbox[BOXBOTTOM] >> FRACBITS)) * double((bbox[BOXRIGHT] >> FRACBITS) - (bbox[BOXLEFT] >> FRACBITS));
+			weighted += a * depth;
+			area += a;
+		}
+		else
+		{
+			AccumulateNodeDepth(nodes, child, depth + 1, weighted, area);
+		}
+	}
+}
+
 //#define USE_GPU_RAYTRACER
 
-void FProcessor::BuildLightmaps()
+void FProcessor::BuildLightmaps(const std::function<void()> &preview)
 {
 	Level.SetupLights();
 	LightmapMesh = std::make_unique<LevelMesh>(Level, Level.DefaultSamples, LMDims);
 
+	// Progressive bakes accumulate samples only the CPU ray tracer keeps
 	std::unique_ptr<GPURaytracer> gpuraytracer;
-	if (!CPURaytrace)
+	if (!CPURaytrace && !ProgressiveBake)
 	{
 		try
 		{
@@ -710,19 +872,63 @@ void FProcessor::BuildLightmaps()
 		}
 	}
 
-	if (gpuraytracer)
+	auto raytrace = [&]() {
+		if (gpuraytracer)
+		{
+			gpuraytracer->Raytrace(LightmapMesh.get());
+		}
+		else
+		{
+			CPURaytracer raytracer;
+			raytracer.Raytrace(LightmapMesh.get());
+		}
+	};
+
+	if (AdaptiveSamples)
 	{
-		gpuraytracer->Raytrace(LightmapMesh.get());
+		printf("Coarse pass at %d units per texel\n", AdaptiveSamplesMax);
+		LightmapMesh->SetSampleDimension(AdaptiveSamplesMax);
+		raytrace();
+		LightmapMesh->AdaptSampleDimensions(AdaptiveSamplesMin, AdaptiveSamplesMax);
 	}
-	else
+
+	if (ProgressiveBake)
 	{
 		CPURaytracer raytracer;
-		raytracer.Raytrace(LightmapMesh.get());
+		raytracer.RaytraceProgressive(LightmapMesh.get(), ProgressiveTime, [&]() {
+			if (preview)
+				LightmapMesh->CreatePreviewTextures(preview);
+		});
+	}
+	else
+	{
+		raytrace();
 	}
 
 	LightmapMesh->CreateTextures();
 }
 
+// Writes the map into a wad of its own with the lightmap built so far. Only
+// UDMF maps carry a LIGHTMAP lump, and writing a binary map builds its
+// blockmap and reject again, so those are skipped.
+void FProcessor::WritePreview(const std::string &filename)
+{
+	if (!isUDMF || !LightmapMesh)
+		return;
+
+	FWadWriter out(filename.c_str(), false);
+	Write(out);
+	out.Close();
+}
+
+void FProcessor::ExportMesh(const std::string &filename)
+{
+	if (LightmapMesh)
+	{
+		LightmapMesh->Export(filename);
+	}
+}
+
 void FProcessor::Write (FWadWriter &out)
 {
 	if (Level.NumLines() == 0 || Level.NumSides() == 0 || Level.NumSectors() == 0 || Level.NumVertices == 0)
@@ -789,10 +995,8 @@ void FProcessor::Write (FWadWriter &out)
 		switch (RejectMode)
 		{
 		case ERM_Rebuild:
-			//FRejectBuilder reject (Level);
-			//Level.Reject = reject.GetReject ();
-			printf ("   Rebuilding the reject is unsupported.\n");
-			// Intentional fall-through
+			RebuildReject ();
+			break;
 
 		case ERM_DontTouch:
 			{
@@ -942,6 +1146,61 @@ void FProcessor::Write (FWadWriter &out)
 	}
 }
 
+void FProcessor::RebuildReject ()
+{
+	printf ("   Rebuilding the reject (%s)\n", ExactReject ? "exact" : "fast");
+
+	if (Level.GLSubsectors != nullptr)
+	{
+		FRejectBuilder reject (Level, Level.GLVertices, Level.GLSegs, Level.GLSubsectors, Level.NumGLSubsectors, ExactReject);
+		Level.Reject = reject.GetReject ();
+		return;
+	}
+
+	// The reject builder needs closed subsectors, so build GL nodes just for it.
+	// The builder renumbers the line vertices and extracting its nodes reads
+	// its vertices through the level, so the level is put back afterwards.
+	std::vector<std::pair<int, int>> lineVerts (Level.NumLines ());
+	for (int i = 0; i < Level.NumLines (); ++i)
+	{
+		lineVerts[i] = std::make_pair (Level.Lines[i].v1, Level.Lines[i].v2);
+	}
+	WideVertex *orgVerts = Level.Vertices;
+	int orgNumVerts = Level.NumVertices;
+	int orgNumOrgVerts = Level.NumOrgVerts;
+
+	WideVertex *verts;
+	MapNodeEx *nodes;
+	MapSegGLEx *segs;
+	MapSubsectorEx *subs;
+	int numVerts, numNodes, numSegs, numSubs;
+	{
+		FNodeBuilder builder (Level, PolyStarts, PolyAnchors, Wad.LumpName (Lump), true);
+		builder.GetVertices (verts, numVerts);
+		Level.Vertices = verts;
+		Level.NumVertices = numVerts;
+		builder.GetGLNodes (nodes, numNodes, segs, numSegs, subs, numSubs);
+	}
+	{
+		FRejectBuilder reject (Level, verts, segs, subs, numSubs, ExactReject);
+		Level.Reject = reject.GetReject ();
+	}
+
+	for (int i = 0; i < Level.NumLines (); ++i)
+	{
+		Level.Lines[i].v1 = lineVerts[i].first;
+		Level.Lines[i].v2 = lineVerts[i].second;
+	}
+	Level.Vertices = orgVerts;
+	Level.NumVertices = orgNumVerts;
+	Level.NumOrgVerts = orgNumOrgVerts;
+
+	delete[] verts;
+	delete[] nodes;
+	delete[] segs;
+	delete[] subs;
+}
+
 //
 uint8_t *FProcessor::FixReject (const uint8_t *oldreject)
 {
@@ -1490,6 +1749,7 @@ void FProcessor::WriteBSPZ (FWadWriter &out, const char *label)
 	WriteSubsectorsZ (zout, Level.Subsectors, Level.NumSubsectors);
 	WriteSegsZ (zout, Level.Segs, Level.NumSegs);
 	WriteNodesZ (zout, Level.Nodes, Level.NumNodes, 1);
+	zout.Finish ();
 }
 
 void FProcessor::WriteGLBSPZ (FWadWriter &out, const char *label)
@@ -1523,6 +1783,7 @@ void FProcessor::WriteGLBSPZ (FWadWriter &out, const char *label)
 	WriteSubsectorsZ (zout, Level.GLSubsectors, Level.NumGLSubsectors);
 	WriteGLSegsZ (zout, Level.GLSegs, Level.NumGLSegs, nodever);
 	WriteNodesZ (zout, Level.GLNodes, Level.NumGLNodes, nodever);
+	zout.Finish ();
 }
 
 void FProcessor::WriteVerticesZ (ZLibOut &out, const WideVertex *verts, int orgverts, int newverts)
@@ -1769,72 +2030,202 @@ bool FProcessor::CheckForFracSplitters(const MapNodeEx *nodes, int numnodes)
 // zlib lump writer ---------------------------------------------------------
 
 ZLibOut::ZLibOut (FWadWriter &out)
-	: Out (out)
+	: Out (out), Chunked (false), Adler (1), StreamOpen (false)
 {
-	int err;
-
-	Stream.next_in = Z_NULL;
-	Stream.avail_in = 0;
-	Stream.zalloc = Z_NULL;
-	Stream.zfree = Z_NULL;
-	err = deflateInit (&Stream, 9);
+	Threads = GetNumThreads();
+	memset (&Stream, 0, sizeof(Stream));
+}
 
-	if (err != Z_OK)
+ZLibOut::~ZLibOut ()
+{
+	if (StreamOpen)
 	{
-		throw std::runtime_error("Could not initialize deflate buffer.");
+		deflateEnd (&Stream);
 	}
-
-	Stream.next_out = Buffer;
-	Stream.avail_out = BUFFER_SIZE;
 }
 
-ZLibOut::~ZLibOut ()
+void ZLibOut::Write (const uint8_t *data, int len)
 {
-	int err;
+	memcpy (&Staging[Staging.Reserve (len)], data, len);
 
-	for (;;)
+	// Compress once a full batch of chunks is known not to hold the end of the lump.
+	if (Staging.Size() > (size_t)Threads * CHUNK_SIZE)
 	{
-		err = deflate (&Stream, Z_FINISH);
-		if (err != Z_OK)
+		if (Threads == 1)
 		{
-			break;
+			DeflateStream (Z_NO_FLUSH);
 		}
-		if (Stream.avail_out == 0)
+		else
 		{
-			Out.AddToLump (Buffer, BUFFER_SIZE);
-			Stream.next_out = Buffer;
-			Stream.avail_out = BUFFER_SIZE;
+			DeflateChunks ((Staging.Size() - 1) / CHUNK_SIZE, false);
 		}
 	}
-	deflateEnd (&Stream);
-	/*if (err != Z_STREAM_END)
+}
+
+// Writes an array of 16-bit values without going through operator << for
+// each of them.
+void ZLibOut::Write16 (const uint16_t *data, size_t count)
+{
+#ifdef __BIG_ENDIAN__
+	uint16_t swapped[4096];
+	while (count > 0)
 	{
-		throw std::runtime_error("Error deflating data.");
-	}*/
-	Out.AddToLump (Buffer, BUFFER_SIZE - Stream.avail_out);
+		size_t n = std::min(count, sizeof(swapped) / sizeof(swapped[0]));
+		for (size_t i = 0; i < n; ++i)
+		{
+			swapped[i] = LittleShort(data[i]);
+		}
+		Write ((const uint8_t *)swapped, int(n * 2));
+		data += n;
+		count -= n;
+	}
+#else
+	while (count > 0)
+	{
+		// Write in pieces so a batch of chunks can go out before the next one is copied.
+		size_t n = std::min(count, (size_t)CHUNK_SIZE / 2);
+		Write ((const uint8_t *)data, int(n * 2));
+		data += n;
+		count -= n;
+	}
+#endif
+}
+
+void ZLibOut::Finish ()
+{
+	if (Threads == 1 || (!Chunked && Staging.Size() <= CHUNK_SIZE))
+	{
+		// A single zlib stream is the same as what a serial compressor makes.
+		DeflateStream (Z_FINISH);
+		return;
+	}
+
+	DeflateChunks ((Staging.Size() + CHUNK_SIZE - 1) / CHUNK_SIZE, true);
+
+	uint8_t trailer[4] = { uint8_t(Adler >> 24), uint8_t(Adler >> 16), uint8_t(Adler >> 8), uint8_t(Adler) };
+	Out.AddToLump (trailer, 4);
 }
 
-void ZLibOut::Write (uint8_t *data, int len)
+// Feeds everything staged to the single zlib stream.
+void ZLibOut::DeflateStream (int flush)
 {
+	if (!StreamOpen)
+	{
+		if (deflateInit (&Stream, CompressLevel) != Z_OK)
+		{
+			throw std::runtime_error("Could not initialize deflate buffer.");
+		}
+		StreamOpen = true;
+	}
+
+	uint8_t buffer[64 * 1024];
 	int err;
 
-	Stream.next_in = data;
-	Stream.avail_in = len;
-	err = deflate (&Stream, 0);
-	while (Stream.avail_out == 0 && err == Z_OK)
+	Stream.next_in = Staging.Data();
+	Stream.avail_in = Staging.Size();
+	do
 	{
-		Out.AddToLump (Buffer, BUFFER_SIZE);
-		Stream.next_out = Buffer;
-		Stream.avail_out = BUFFER_SIZE;
-		if (Stream.avail_in != 0)
+		Stream.next_out = buffer;
+		Stream.avail_out = sizeof(buffer);
+		err = deflate (&Stream, flush);
+		if (err != Z_OK && err != Z_STREAM_END && err != Z_BUF_ERROR)
 		{
-			err = deflate (&Stream, 0);
+			throw std::runtime_error("Error deflating data.");
 		}
+		Out.AddToLump (buffer, int(sizeof(buffer) - Stream.avail_out));
+	} while (flush == Z_FINISH ? err != Z_STREAM_END : (Stream.avail_in > 0 || Stream.avail_out == 0));
+	Staging.Clear();
+
+	if (flush == Z_FINISH)
+	{
+		deflateEnd (&Stream);
+		StreamOpen = false;
+	}
+}
+
+// Compresses the first numChunks chunks of the staged data on all threads
+// and writes them out. Every chunk is a raw deflate stream that ends on a
+// byte boundary without a final block, except for the last one, so they
+// can simply be concatenated between a zlib header and the Adler-32 of all
+// data.
+void ZLibOut::DeflateChunks (size_t numChunks, bool last)
+{
+	const uint8_t *data = Staging.Data();
+	size_t size = std::min((size_t)Staging.Size(), numChunks * CHUNK_SIZE);
+
+	if (!Chunked)
+	{
+		static const uint8_t levelFlags[] = { 0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda };
+		uint8_t header[2] = { 0x78, levelFlags[CompressLevel] };
+		Out.AddToLump (header, 2);
+		Chunked = true;
 	}
-	if (err != Z_OK)
+
+	int numThreads = (int)std::min((size_t)Threads, numChunks);
+	std::vector<TArray<uint8_t>> chunks(numChunks);
+	std::atomic<size_t> next(0);
+	std::atomic<bool> failed(false);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < numThreads; ++t)
+	{
+		threads.push_back(std::thread([&]() {
+			for (size_t i = next++; i < numChunks; i = next++)
+			{
+				size_t start = i * CHUNK_SIZE;
+				try
+				{
+					DeflateChunk (data + start, std::min(size - start, (size_t)CHUNK_SIZE), last && i == numChunks - 1, chunks[i]);
+				}
+				catch (...)
+				{
+					failed = true;
+				}
+			}
+		}));
+	}
+	Adler = (uint32_t)adler32 (Adler, data, size);
+	for (auto &thread : threads)
+	{
+		thread.join();
+	}
+	if (failed)
 	{
 		throw std::runtime_error("Error deflating data.");
 	}
+
+	for (auto &chunk : chunks)
+	{
+		Out.AddToLump (chunk.Data(), chunk.Size());
+	}
+
+	size_t left = Staging.Size() - size;
+	memmove (Staging.Data(), Staging.Data() + size, left);
+	Staging.Resize ((unsigned int)left);
+}
+
+void ZLibOut::DeflateChunk (const uint8_t *data, size_t len, bool last, TArray<uint8_t> &out)
+{
+	z_stream stream;
+
+	memset (&stream, 0, sizeof(stream));
+	if (deflateInit2 (&stream, CompressLevel, Z_DEFLATED, -MZ_DEFAULT_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		throw std::runtime_error("Could not initialize deflate buffer.");
+	}
+
+	// Leave room for the empty stored block a sync flush ends with.
+	out.Resize ((unsigned int)deflateBound (&stream, (mz_ulong)len) + 16);
+	stream.next_in = data;
+	stream.avail_in = (unsigned int)len;
+	stream.next_out = out.Data();
+	stream.avail_out = out.Size();
+	int err = deflate (&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+	deflateEnd (&stream);
+	if (err != (last ? Z_STREAM_END : Z_OK) || stream.avail_in != 0)
+	{
+		throw std::runtime_error("Error deflating data.");
+	}
+	out.Resize ((unsigned int)stream.total_out);
 }
 
 ZLibOut &ZLibOut::operator << (uint8_t val)
@@ -1870,3 +2261,10 @@ ZLibOut &ZLibOut::operator << (fixed_t val)
 	Write ((uint8_t *)&val, 4);
 	return *this;
 }
+
+ZLibOut &ZLibOut::operator << (float val)
+{
+	uint32_t bits;
+	memcpy (&bits, &val, 4);
+	return *this << bits;
+}
@@ -9,6 +9,7 @@
 #include "blockmapbuilder/blockmapbuilder.h"
 #include "lightmap/levelmesh.h"
 #include <miniz/miniz.h>
+#include <functional>
 
 #define DEFINE_SPECIAL(name, num, min, max, map) name = num,
 
@@ -28,6 +29,11 @@ typedef enum {
 	Init_TransferSky = 255
 } staticinit_t;
 
+// Compresses a lump as it is written. Data is deflated in chunks that are
+// compressed on separate threads as soon as a batch of them is complete,
+// and joined into one zlib stream, the same way pigz does it. With a
+// single thread, or when the whole lump fits in one chunk, it is a plain
+// zlib stream. Finish must be called after the last write.
 class ZLibOut
 {
 public:
@@ -39,15 +45,26 @@ public:
 	ZLibOut &operator << (int16_t);
 	ZLibOut &operator << (uint32_t);
 	ZLibOut &operator << (fixed_t);
-	void Write(uint8_t *data, int len);
+	ZLibOut &operator << (float);
+	void Write(const uint8_t *data, int len);
+	void Write16(const uint16_t *data, size_t count);
+	void Finish();
 
 private:
-	enum { BUFFER_SIZE = 8192 };
+	enum { CHUNK_SIZE = 1 << 20 };
 
-	z_stream Stream;
-	uint8_t Buffer[BUFFER_SIZE];
+	TArray<uint8_t> Staging;	// Data not compressed yet
 
 	FWadWriter &Out;
+	int Threads;
+	bool Chunked;				// The zlib header has been written and chunks are going out
+	uint32_t Adler;
+	z_stream Stream;			// Used when there is only one thread
+	bool StreamOpen;
+
+	void DeflateChunks(size_t numChunks, bool last);
+	void DeflateStream(int flush);
+	static void DeflateChunk(const uint8_t *data, size_t len, bool last, TArray<uint8_t> &out);
 };
 
 class FProcessor
@@ -56,8 +73,11 @@ public:
 	FProcessor(FWadReader &inwad, int lump);
 
 	void BuildNodes();
-	void BuildLightmaps();
+	// preview is called with the pages of each pass of a progressive bake
+	void BuildLightmaps(const std::function<void()> &preview = nullptr);
 	void Write(FWadWriter &out);
+	void WritePreview(const std::string &filename);
+	void ExportMesh(const std::string &filename);
 
 private:
 	void LoadUDMF();
@@ -69,11 +89,16 @@ private:
 	void GetPolySpots();
 	void SetLineID(IntLineDef *ld);
 
+	FNodeBuilder *CreateNodeBuilder(bool makeGLnodes);
+	double ScoreNodeBuilder(FNodeBuilder *builder, bool makeGLnodes);
+	static void AccumulateNodeDepth(const TArray<node_t> &nodes, uint32_t node, int depth, double &weighted, double &area);
+
 	MapNodeEx *NodesToEx(const MapNode *nodes, int count);
 	MapSubsectorEx *SubsectorsToEx(const MapSubsector *ssec, int count);
 	MapSegGLEx *SegGLsToEx(const MapSegGL *segs, int count);
 
 	uint8_t *FixReject(const uint8_t *oldreject);
+	void RebuildReject();
 	bool CheckForFracSplitters(const MapNodeEx *nodes, int count);
 
 	void WriteLines(FWadWriter &out);
@@ -662,12 +662,11 @@ void FProcessor::ParseMapProperties()
 
 void FProcessor::ParseTextMap(int lump)
 {
-	char *buffer;
-	int buffersize;
 	TArray<WideVertex> Vertices;
 
-	ReadLump<char> (Wad, lump, buffer, buffersize);
-	SC_OpenMem("TEXTMAP", buffer, buffersize);
+	// The scanner reads straight out of the mapped wad.
+	FLumpSpan span = Wad.GetLump (lump);
+	SC_OpenMem("TEXTMAP", (const char *)span.Data, (int)span.Size);
 
 	SC_SetCMode(true);
 	ParseMapProperties();
@@ -706,7 +705,6 @@ void FProcessor::ParseTextMap(int lump)
 	Level.NumVertices = Vertices.Size();
 	memcpy(Level.Vertices, &Vertices[0], Vertices.Size() * sizeof(WideVertex));
 	SC_Close();
-	delete[] buffer;
 }
 
 
@@ -930,7 +928,6 @@ void FProcessor::WriteUDMF(FWadWriter &out)
 	if (LightmapMesh)
 	{
 		LightmapMesh->AddLightmapLump(out);
-		//LightmapMesh->Export("level.obj");
 	}
 
 	out.CreateLabel("ENDMAP");
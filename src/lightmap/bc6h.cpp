@@ -0,0 +1,578 @@
+
+#include "bc6h.h"
+#include "framework/parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+	const int Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	const int HalfMax = 0x7bff;
+
+	struct ModeInfo
+	{
+		uint8_t ModeBits;
+		int EndpointBits;
+		int DeltaBits;		// Bits stored for the second endpoint
+		bool Transformed;	// Second endpoint is stored as a signed delta from the first
+	};
+
+	// The one-region modes, 11 to 14 in the specification
+	const ModeInfo Modes[4] =
+	{
+		{ 0x03, 10, 10, false },
+		{ 0x07, 11, 9, true },
+		{ 0x0b, 12, 8, true },
+		{ 0x0f, 16, 4, true }
+	};
+
+	struct BlockBits
+	{
+		uint64_t Lo = 0, Hi = 0;
+
+		void Put(int pos, int count, uint32_t value)
+		{
+			for (int i = 0; i < count; i++, pos++)
+			{
+				uint64_t bit = (value >> i) & 1;
+				if (pos < 64) Lo |= bit << pos;
+				else Hi |= bit << (pos - 64);
+			}
+		}
+
+		uint32_t Get(int pos, int count) const
+		{
+			uint32_t value = 0;
+			for (int i = 0; i < count; i++, pos++)
+			{
+				uint64_t bit = pos < 64 ? (Lo >> pos) : (Hi >> (pos - 64));
+				value |= uint32_t(bit & 1) << i;
+			}
+			return value;
+		}
+	};
+
+	// Calls fn(field, bit, pos) for every endpoint bit of a one-region mode.
+	// Fields 0-2 are r,g,b of the first endpoint and 3-5 the second. The low
+	// ten bits of the first endpoint come first, the rest of it is spread
+	// out, highest bit first, after each channel of the second endpoint.
+	template<typename F>
+	void ForEachEndpointBit(const ModeInfo& mode, F fn)
+	{
+		int pos = 5;
+		for (int c = 0; c < 3; c++)
+		{
+			for (int bit = 0; bit < 10; bit++)
+				fn(c, bit, pos++);
+		}
+		for (int c = 0; c < 3; c++)
+		{
+			for (int bit = 0; bit < mode.DeltaBits; bit++)
+				fn(3 + c, bit, pos++);
+			for (int bit = mode.EndpointBits - 1; bit >= 10; bit--)
+				fn(c, bit, pos++);
+		}
+	}
+
+	int Unquantize(int comp, int bits)
+	{
+		if (bits >= 15)
+			return comp;
+		if (comp == 0)
+			return 0;
+		if (comp == (1 << bits) - 1)
+			return 0xffff;
+		return ((comp << 16) + 0x8000) >> bits;
+	}
+
+	// Quantizes a value in the unquantized (0-65535) range
+	int Quantize(float value, int bits)
+	{
+		int maxval = (1 << bits) - 1;
+		if (bits >= 15)
+			return std::max(0, std::min(maxval, (int)(value + 0.5f)));
+
+		int q = std::max(0, std::min(maxval, (int)(value * (1 << bits) / 65536.0f)));
+		int best = q;
+		float bestError = std::fabs(Unquantize(q, bits) - value);
+		for (int c = std::max(q - 1, 0); c <= std::min(q + 1, maxval); c++)
+		{
+			float error = std::fabs(Unquantize(c, bits) - value);
+			if (error < bestError)
+			{
+				best = c;
+				bestError = error;
+			}
+		}
+		return best;
+	}
+
+	int Interpolate(int a, int b, int weight)
+	{
+		int value = ((64 - weight) * a + weight * b + 32) >> 6;
+		return (value * 31) >> 6;
+	}
+
+	struct Block
+	{
+		float Half[16][3];		// Texels as half float bit patterns
+		float Value[16][3];		// The same in the unquantized range (Half * 64 / 31)
+	};
+
+	struct Candidate
+	{
+		int Mode;
+		int E0[3], E1[3];
+		uint8_t Indices[16];
+		float Error;
+	};
+
+	class BlockEncoder
+	{
+	public:
+		BlockEncoder(EBC6HQuality quality) : Quality(quality) { }
+
+		void Encode(const Block& block, uint8_t* output);
+
+	private:
+		EBC6HQuality Quality;
+
+		float Evaluate(const Block& block, Candidate& cand);
+		bool FixAnchor(Candidate& cand);
+		void FitMode(const Block& block, int mode, const float* e0, const float* e1, Candidate& best);
+		void Refine(const Block& block, Candidate& best);
+		void Perturb(const Block& block, Candidate& best);
+		void Write(const Candidate& cand, uint8_t* output);
+	};
+
+	// Picks the nearest palette entry for every texel and returns the total squared error
+	float BlockEncoder::Evaluate(const Block& block, Candidate& cand)
+	{
+		const ModeInfo& mode = Modes[cand.Mode];
+
+		alignas(16) float palette[3][16];
+		for (int c = 0; c < 3; c++)
+		{
+			int a = Unquantize(cand.E0[c], mode.EndpointBits);
+			int b = Unquantize(cand.E1[c], mode.EndpointBits);
+			for (int i = 0; i < 16; i++)
+				palette[c][i] = (float)Interpolate(a, b, Weights[i]);
+		}
+
+		float total = 0.0f;
+#ifndef NO_SSE
+		__m128 pr[4], pg[4], pb[4];
+		for (int k = 0; k < 4; k++)
+		{
+			pr[k] = _mm_load_ps(palette[0] + k * 4);
+			pg[k] = _mm_load_ps(palette[1] + k * 4);
+			pb[k] = _mm_load_ps(palette[2] + k * 4);
+		}
+
+		for (int i = 0; i < 16; i++)
+		{
+			__m128 r = _mm_set1_ps(block.Half[i][0]);
+			__m128 g = _mm_set1_ps(block.Half[i][1]);
+			__m128 b = _mm_set1_ps(block.Half[i][2]);
+
+			__m128 bestDist = _mm_set1_ps(3.4e38f);
+			__m128i bestIndex = _mm_setzero_si128();
+			__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+			for (int k = 0; k < 4; k++)
+			{
+				__m128 dr = _mm_sub_ps(pr[k], r);
+				__m128 dg = _mm_sub_ps(pg[k], g);
+				__m128 db = _mm_sub_ps(pb[k], b);
+				__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+				__m128i closer = _mm_castps_si128(_mm_cmplt_ps(dist, bestDist));
+				bestDist = _mm_min_ps(dist, bestDist);
+				bestIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, bestIndex));
+				index = _mm_add_epi32(index, _mm_set1_epi32(4));
+			}
+
+			alignas(16) float dists[4];
+			alignas(16) int indices[4];
+			_mm_store_ps(dists, bestDist);
+			_mm_store_si128((__m128i*)indices, bestIndex);
+			int lane = 0;
+			for (int k = 1; k < 4; k++)
+			{
+				if (dists[k] < dists[lane] || (dists[k] == dists[lane] && indices[k] < indices[lane]))
+					lane = k;
+			}
+			cand.Indices[i] = (uint8_t)indices[lane];
+			total += dists[lane];
+		}
+#else
+		for (int i = 0; i < 16; i++)
+		{
+			float bestDist = 3.4e38f;
+			int bestIndex = 0;
+			for (int j = 0; j < 16; j++)
+			{
+				float dr = palette[0][j] - block.Half[i][0];
+				float dg = palette[1][j] - block.Half[i][1];
+				float db = palette[2][j] - block.Half[i][2];
+				float dist = dr * dr + dg * dg + db * db;
+				if (dist < bestDist)
+				{
+					bestDist = dist;
+					bestIndex = j;
+				}
+			}
+			cand.Indices[i] = (uint8_t)bestIndex;
+			total += bestDist;
+		}
+#endif
+		return total;
+	}
+
+	// The first index is stored with its high bit implied to be zero.
+	// Swapping the endpoints reverses the palette and fixes that, unless
+	// the delta no longer fits.
+	bool BlockEncoder::FixAnchor(Candidate& cand)
+	{
+		if (!(cand.Indices[0] & 8))
+			return true;
+
+		const ModeInfo& mode = Modes[cand.Mode];
+		if (mode.Transformed)
+		{
+			int limit = 1 << (mode.DeltaBits - 1);
+			for (int c = 0; c < 3; c++)
+			{
+				if (cand.E0[c] - cand.E1[c] >= limit)
+					return false;
+			}
+		}
+
+		for (int c = 0; c < 3; c++)
+			std::swap(cand.E0[c], cand.E1[c]);
+		for (int i = 0; i < 16; i++)
+			cand.Indices[i] = 15 - cand.Indices[i];
+		return true;
+	}
+
+	void BlockEncoder::FitMode(const Block& block, int modeIndex, const float* e0, const float* e1, Candidate& best)
+	{
+		const ModeInfo& mode = Modes[modeIndex];
+
+		Candidate cand;
+		cand.Mode = modeIndex;
+		for (int c = 0; c < 3; c++)
+		{
+			cand.E0[c] = Quantize(e0[c], mode.EndpointBits);
+			cand.E1[c] = Quantize(e1[c], mode.EndpointBits);
+			if (mode.Transformed)
+			{
+				int limit = 1 << (mode.DeltaBits - 1);
+				int delta = std::max(-limit, std::min(limit - 1, cand.E1[c] - cand.E0[c]));
+				cand.E1[c] = cand.E0[c] + delta;
+			}
+		}
+
+		cand.Error = Evaluate(block, cand);
+		if (cand.Error < best.Error && FixAnchor(cand))
+			best = cand;
+	}
+
+	// Least squares fit of the endpoints to the indices picked for them
+	void BlockEncoder::Refine(const Block& block, Candidate& best)
+	{
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+		float ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; i++)
+		{
+			float t = Weights[best.Indices[i]] * (1.0f / 64.0f);
+			float s = 1.0f - t;
+			aa += s * s;
+			ab += s * t;
+			bb += t * t;
+			for (int c = 0; c < 3; c++)
+			{
+				ax[c] += s * block.Value[i][c];
+				bx[c] += t * block.Value[i][c];
+			}
+		}
+
+		float det = aa * bb - ab * ab;
+		if (std::fabs(det) < 1e-6f)
+			return;
+
+		float e0[3], e1[3];
+		for (int c = 0; c < 3; c++)
+		{
+			e0[c] = std::max(0.0f, std::min(65535.0f, (bb * ax[c] - ab * bx[c]) / det));
+			e1[c] = std::max(0.0f, std::min(65535.0f, (aa * bx[c] - ab * ax[c]) / det));
+		}
+		FitMode(block, best.Mode, e0, e1, best);
+	}
+
+	// Tries moving each quantized endpoint component one step either way
+	void BlockEncoder::Perturb(const Block& block, Candidate& best)
+	{
+		const ModeInfo& mode = Modes[best.Mode];
+		int maxval = (1 << mode.EndpointBits) - 1;
+		int limit = 1 << (mode.DeltaBits - 1);
+
+		for (int pass = 0; pass < 4; pass++)
+		{
+			bool improved = false;
+			for (int field = 0; field < 6; field++)
+			{
+				for (int step = -1; step <= 1; step += 2)
+				{
+					Candidate cand = best;
+					int* e = field < 3 ? &cand.E0[field] : &cand.E1[field - 3];
+					*e += step;
+					if (*e < 0 || *e > maxval)
+						continue;
+					int c = field % 3;
+					if (mode.Transformed && (cand.E1[c] - cand.E0[c] < -limit || cand.E1[c] - cand.E0[c] >= limit))
+						continue;
+
+					cand.Error = Evaluate(block, cand);
+					if (cand.Error < best.Error && FixAnchor(cand))
+					{
+						best = cand;
+						improved = true;
+					}
+				}
+			}
+			if (!improved)
+				break;
+		}
+	}
+
+	void BlockEncoder::Encode(const Block& block, uint8_t* output)
+	{
+		float lo[3], hi[3], mean[3] = { 0.0f, 0.0f, 0.0f };
+		for (int c = 0; c < 3; c++)
+		{
+			lo[c] = hi[c] = block.Value[0][c];
+			for (int i = 0; i < 16; i++)
+			{
+				lo[c] = std::min(lo[c], block.Value[i][c]);
+				hi[c] = std::max(hi[c], block.Value[i][c]);
+				mean[c] += block.Value[i][c];
+			}
+			mean[c] *= 1.0f / 16.0f;
+		}
+
+		float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int i = 0; i < 16; i++)
+		{
+			float r = block.Value[i][0] - mean[0];
+			float g = block.Value[i][1] - mean[1];
+			float b = block.Value[i][2] - mean[2];
+			cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+			cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+		}
+
+		Candidate best;
+		best.Error = 3.4e38f;
+
+		// Bounding box diagonal, flipping the channels that go against the widest one
+		float e0[3], e1[3];
+		int widest = 0;
+		for (int c = 1; c < 3; c++)
+		{
+			if (hi[c] - lo[c] > hi[widest] - lo[widest])
+				widest = c;
+		}
+		const int covIndex[3][3] = { { 0, 1, 2 }, { 1, 3, 4 }, { 2, 4, 5 } };
+		for (int c = 0; c < 3; c++)
+		{
+			bool flip = cov[covIndex[widest][c]] < 0.0f;
+			e0[c] = flip ? hi[c] : lo[c];
+			e1[c] = flip ? lo[c] : hi[c];
+		}
+		FitMode(block, 0, e0, e1, best);
+		if (Quality == BC6H_Fast || best.Error == 0.0f)
+		{
+			Write(best, output);
+			return;
+		}
+
+		// Principal axis by power iteration, starting from the diagonal
+		float axis[3] = { e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2] };
+		for (int iter = 0; iter < 4; iter++)
+		{
+			float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+			float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+			float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+			float len = std::max(std::max(std::fabs(x), std::fabs(y)), std::fabs(z));
+			if (len <= 0.0f)
+				break;
+			axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+		}
+		float lenSqr = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+		if (lenSqr > 0.0f)
+		{
+			float tmin = 3.4e38f, tmax = -3.4e38f;
+			for (int i = 0; i < 16; i++)
+			{
+				float t = 0.0f;
+				for (int c = 0; c < 3; c++)
+					t += (block.Value[i][c] - mean[c]) * axis[c];
+				tmin = std::min(tmin, t);
+				tmax = std::max(tmax, t);
+			}
+			for (int c = 0; c < 3; c++)
+			{
+				e0[c] = std::max(0.0f, std::min(65535.0f, mean[c] + axis[c] * tmin / lenSqr));
+				e1[c] = std::max(0.0f, std::min(65535.0f, mean[c] + axis[c] * tmax / lenSqr));
+			}
+		}
+
+		int lastMode = Quality == BC6H_High ? 3 : 0;
+		for (int mode = 0; mode <= lastMode; mode++)
+		{
+			Candidate modeBest;
+			modeBest.Error = 3.4e38f;
+			FitMode(block, mode, e0, e1, modeBest);
+			if (modeBest.Error == 3.4e38f)
+				continue;
+			for (int iter = 0; iter < 2; iter++)
+				Refine(block, modeBest);
+			if (Quality == BC6H_High)
+				Perturb(block, modeBest);
+			if (modeBest.Error < best.Error)
+				best = modeBest;
+		}
+
+		Write(best, output);
+	}
+
+	void BlockEncoder::Write(const Candidate& cand, uint8_t* output)
+	{
+		const ModeInfo& mode = Modes[cand.Mode];
+
+		BlockBits bits;
+		bits.Put(0, 5, mode.ModeBits);
+		ForEachEndpointBit(mode, [&](int field, int bit, int pos) {
+			int value;
+			if (field < 3)
+				value = cand.E0[field];
+			else if (mode.Transformed)
+				value = cand.E1[field - 3] - cand.E0[field - 3];
+			else
+				value = cand.E1[field - 3];
+			bits.Put(pos, 1, (uint32_t)value >> bit);
+		});
+
+		bits.Put(65, 3, cand.Indices[0]);
+		for (int i = 1; i < 16; i++)
+			bits.Put(64 + i * 4, 4, cand.Indices[i]);
+
+		for (int i = 0; i < 8; i++)
+		{
+			output[i] = (uint8_t)(bits.Lo >> (i * 8));
+			output[8 + i] = (uint8_t)(bits.Hi >> (i * 8));
+		}
+	}
+
+	void LoadBlock(const uint16_t* pixels, int width, int bx, int by, Block& block)
+	{
+		for (int y = 0; y < 4; y++)
+		{
+			const uint16_t* line = pixels + ((size_t)(by * 4 + y) * width + bx * 4) * 3;
+			for (int x = 0; x < 4; x++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					int h = line[x * 3 + c];
+					if (h & 0x8000)
+						h = 0;
+					else if (h > HalfMax)
+						h = HalfMax;
+					block.Half[y * 4 + x][c] = (float)h;
+					block.Value[y * 4 + x][c] = h * (64.0f / 31.0f);
+				}
+			}
+		}
+	}
+
+	void DecodeBlock(const uint8_t* input, uint16_t* pixels, int width)
+	{
+		BlockBits bits;
+		for (int i = 0; i < 8; i++)
+		{
+			bits.Lo |= (uint64_t)input[i] << (i * 8);
+			bits.Hi |= (uint64_t)input[8 + i] << (i * 8);
+		}
+
+		const ModeInfo* mode = nullptr;
+		if ((bits.Lo & 3) >= 2)
+		{
+			for (const ModeInfo& m : Modes)
+			{
+				if (bits.Get(0, 5) == m.ModeBits)
+					mode = &m;
+			}
+		}
+
+		int e[6] = { 0, 0, 0, 0, 0, 0 };
+		if (mode)
+		{
+			ForEachEndpointBit(*mode, [&](int field, int bit, int pos) {
+				e[field] |= bits.Get(pos, 1) << bit;
+			});
+			if (mode->Transformed)
+			{
+				int mask = (1 << mode->EndpointBits) - 1;
+				for (int c = 0; c < 3; c++)
+				{
+					int delta = e[3 + c];
+					if (delta & (1 << (mode->DeltaBits - 1)))
+						delta -= 1 << mode->DeltaBits;
+					e[3 + c] = (e[c] + delta) & mask;
+				}
+			}
+			for (int i = 0; i < 6; i++)
+				e[i] = Unquantize(e[i], mode->EndpointBits);
+		}
+
+		for (int i = 0; i < 16; i++)
+		{
+			int index = mode ? (i == 0 ? bits.Get(65, 3) : bits.Get(64 + i * 4, 4)) : 0;
+			uint16_t* texel = pixels + ((size_t)(i / 4) * width + i % 4) * 3;
+			for (int c = 0; c < 3; c++)
+				texel[c] = mode ? (uint16_t)Interpolate(e[c], e[3 + c], Weights[index]) : 0;
+		}
+	}
+}
+
+void BC6HEncoder::Encode(const uint16_t* pixels, int width, int height, EBC6HQuality quality, std::vector<uint8_t>& output)
+{
+	int blocksWide = width / 4;
+	output.resize(EncodedSize(width, height));
+
+	ParallelFor(height / 4, [&](size_t by) {
+		BlockEncoder encoder(quality);
+		Block block;
+		for (int bx = 0; bx < blocksWide; bx++)
+		{
+			LoadBlock(pixels, width, bx, (int)by, block);
+			encoder.Encode(block, output.data() + ((size_t)by * blocksWide + bx) * BLOCK_BYTES);
+		}
+	});
+}
+
+void BC6HEncoder::Decode(const uint8_t* blocks, int width, int height, uint16_t* pixels)
+{
+	int blocksWide = width / 4;
+
+	ParallelFor(height / 4, [&](size_t by) {
+		for (int bx = 0; bx < blocksWide; bx++)
+		{
+			const uint8_t* block = blocks + ((size_t)by * blocksWide + bx) * BLOCK_BYTES;
+			DecodeBlock(block, pixels + ((size_t)by * 4 * width + bx * 4) * 3, width);
+		}
+	});
+}
@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum EBC6HQuality
+{
+	BC6H_None,		// Pages are written as raw RGB16F
+	BC6H_Fast,
+	BC6H_Normal,
+	BC6H_High
+};
+
+// Encodes RGB16F images into BC6H_UF16 blocks. Only the one-region modes
+// (11 to 14) are used, which is what lightmaps need: texels vary slowly and
+// a block rarely holds two unrelated colors.
+class BC6HEncoder
+{
+public:
+	enum { BLOCK_BYTES = 16 };
+
+	// width and height must be multiples of 4. Negative values are clamped
+	// to zero since the unsigned format can't store them.
+	static void Encode(const uint16_t* pixels, int width, int height, EBC6HQuality quality, std::vector<uint8_t>& output);
+
+	// Decodes blocks written by Encode back into RGB16F. Two-region modes are
+	// not decoded and come out black.
+	static void Decode(const uint8_t* blocks, int width, int height, uint16_t* pixels);
+
+	static size_t EncodedSize(int width, int height) { return (size_t)(width / 4) * (height / 4) * BLOCK_BYTES; }
+};
@@ -28,10 +28,11 @@
 #include <immintrin.h>
 #endif
 
-TriangleMeshShape::TriangleMeshShape(const vec3 *vertices, int num_vertices, const unsigned int *elements, int num_elements)
-	: vertices(vertices), num_vertices(num_vertices), elements(elements), num_elements(num_elements)
+TriangleMeshShape::TriangleMeshShape(const vec3 *input_vertices, int num_vertices, const unsigned int *input_elements, int num_elements)
 {
-	int num_triangles = num_elements / 3;
+	weld(input_vertices, num_vertices, input_elements, num_elements);
+
+	int num_triangles = (int)triangle_ids.size();
 	if (num_triangles <= 0)
 		return;
 
@@ -51,6 +52,100 @@ TriangleMeshShape::TriangleMeshShape(const vec3 *vertices, int num_vertices, con
 	std::vector<int> work_buffer(num_triangles * 2);
 
 	root = subdivide(&triangles[0], (int)triangles.size(), &centroids[0], &work_buffer[0]);
+
+	build_triangles();
+
+	// Queries only use the leaf ordered triangles
+	std::vector<vec3>().swap(vertices);
+	std::vector<unsigned int>().swap(elements);
+}
+
+void TriangleMeshShape::weld(const vec3 *input_vertices, int num_vertices, const unsigned int *input_elements, int num_elements)
+{
+	struct WeldKey
+	{
+		int64_t x, y, z;
+		int index;
+	};
+
+	std::vector<WeldKey> keys(num_vertices);
+	for (int i = 0; i < num_vertices; i++)
+	{
+		const vec3 &v = input_vertices[i];
+		keys[i] = { std::llround(v.x * 65536.0), std::llround(v.y * 65536.0), std::llround(v.z * 65536.0), i };
+	}
+	std::sort(keys.begin(), keys.end(), [](const WeldKey &a, const WeldKey &b) {
+		if (a.x != b.x) return a.x < b.x;
+		if (a.y != b.y) return a.y < b.y;
+		if (a.z != b.z) return a.z < b.z;
+		return a.index < b.index;
+	});
+
+	// The first vertex at each position stands in for the others
+	std::vector<int> leader(num_vertices);
+	for (int i = 0; i < num_vertices; i++)
+	{
+		bool same = i > 0 && keys[i].x == keys[i - 1].x && keys[i].y == keys[i - 1].y && keys[i].z == keys[i - 1].z;
+		leader[keys[i].index] = same ? leader[keys[i - 1].index] : keys[i].index;
+	}
+
+	std::vector<unsigned int> remap(num_vertices);
+	for (int i = 0; i < num_vertices; i++)
+	{
+		if (leader[i] == i)
+		{
+			remap[i] = (unsigned int)vertices.size();
+			vertices.push_back(input_vertices[i]);
+		}
+		else
+		{
+			remap[i] = remap[leader[i]];
+		}
+	}
+
+	int num_triangles = num_elements / 3;
+	elements.reserve(num_triangles * 3);
+	triangle_ids.reserve(num_triangles);
+	for (int i = 0; i < num_triangles; i++)
+	{
+		unsigned int a = remap[input_elements[i * 3]];
+		unsigned int b = remap[input_elements[i * 3 + 1]];
+		unsigned int c = remap[input_elements[i * 3 + 2]];
+		if (a == b || b == c || c == a)
+			continue;
+
+		elements.push_back(a);
+		elements.push_back(b);
+		elements.push_back(c);
+		triangle_ids.push_back(i);
+	}
+}
+
+void TriangleMeshShape::build_triangles()
+{
+	// Renumber the triangles in the order their leaves were created so that
+	// triangles near each other in the tree are near each other in memory
+	std::vector<int> leaf_ids;
+	leaf_ids.reserve(triangle_ids.size());
+	ray_triangles.reserve(triangle_ids.size());
+
+	for (Node &node : nodes)
+	{
+		if (node.element_index == -1)
+			continue;
+
+		int element_index = node.element_index;
+		node.element_index = (int)leaf_ids.size() * 3;
+		leaf_ids.push_back(triangle_ids[element_index / 3]);
+
+		Triangle tri;
+		tri.p0 = vertices[elements[element_index]];
+		tri.e1 = vertices[elements[element_index + 1]] - tri.p0;
+		tri.e2 = vertices[elements[element_index + 2]] - tri.p0;
+		ray_triangles.push_back(tri);
+	}
+
+	triangle_ids.swap(leaf_ids);
 }
 
 float TriangleMeshShape::sweep(TriangleMeshShape *shape1, SphereShape *shape2, const vec3 &target)
@@ -217,7 +312,7 @@ void TriangleMeshShape::find_first_hit(TriangleMeshShape *shape, const RayBBox &
 			if (t < hit->fraction)
 			{
 				hit->fraction = t;
-				hit->triangle = shape->nodes[a].element_index / 3;
+				hit->triangle = shape->triangle_ids[shape->nodes[a].element_index / 3];
 				hit->b = baryB;
 				hit->c = baryC;
 			}
@@ -237,22 +332,15 @@ bool TriangleMeshShape::overlap_bv_ray(TriangleMeshShape *shape, const RayBBox &
 
 float TriangleMeshShape::intersect_triangle_ray(TriangleMeshShape *shape, const RayBBox &ray, int a, float &barycentricB, float &barycentricC)
 {
-	const int start_element = shape->nodes[a].element_index;
-
-	vec3 p[3] =
-	{
-		shape->vertices[shape->elements[start_element]],
-		shape->vertices[shape->elements[start_element + 1]],
-		shape->vertices[shape->elements[start_element + 2]]
-	};
+	const Triangle &tri = shape->ray_triangles[shape->nodes[a].element_index / 3];
 
 	// MoellerTrumbore ray-triangle intersection algorithm:
 
 	vec3 D = ray.end - ray.start;
 
-	// Find vectors for two edges sharing p[0]
-	vec3 e1 = p[1] - p[0];
-	vec3 e2 = p[2] - p[0];
+	// Edges sharing p[0], precomputed
+	const vec3 &e1 = tri.e1;
+	const vec3 &e2 = tri.e2;
 
 	// Begin calculating determinant - also used to calculate u parameter
 	vec3 P = cross(D, e2);
@@ -269,7 +357,7 @@ float TriangleMeshShape::intersect_triangle_ray(TriangleMeshShape *shape, const
 	float inv_det = 1.0f / det;
 
 	// Calculate distance from p[0] to ray origin
-	vec3 T = ray.start - p[0];
+	vec3 T = ray.start - tri.p0;
 
 	// Calculate u parameter and test bound
 	float u = dot(T, P) * inv_det;
@@ -311,14 +399,9 @@ bool TriangleMeshShape::sweep_overlap_bv_sphere(TriangleMeshShape *shape1, Spher
 
 float TriangleMeshShape::sweep_intersect_triangle_sphere(TriangleMeshShape *shape1, SphereShape *shape2, int a, const vec3 &target)
 {
-	const int start_element = shape1->nodes[a].element_index;
+	const Triangle &tri = shape1->ray_triangles[shape1->nodes[a].element_index / 3];
 
-	vec3 p[3] =
-	{
-		shape1->vertices[shape1->elements[start_element]],
-		shape1->vertices[shape1->elements[start_element + 1]],
-		shape1->vertices[shape1->elements[start_element + 2]]
-	};
+	vec3 p[3] = { tri.p0, tri.p0 + tri.e1, tri.p0 + tri.e2 };
 
 	vec3 c = shape2->center;
 	vec3 e = target;
@@ -484,12 +567,12 @@ bool TriangleMeshShape::overlap_triangle_sphere(TriangleMeshShape *shape1, Spher
 {
 	// http://realtimecollisiondetection.net/blog/?p=103
 
-	int element_index = shape1->nodes[shape1_node_index].element_index;
+	const Triangle &tri = shape1->ray_triangles[shape1->nodes[shape1_node_index].element_index / 3];
 
 	vec3 P = shape2->center;
-	vec3 A = shape1->vertices[shape1->elements[element_index]] - P;
-	vec3 B = shape1->vertices[shape1->elements[element_index + 1]] - P;
-	vec3 C = shape1->vertices[shape1->elements[element_index + 2]] - P;
+	vec3 A = tri.p0 - P;
+	vec3 B = tri.p0 + tri.e1 - P;
+	vec3 C = tri.p0 + tri.e2 - P;
 	float r = shape2->radius;
 	float rr = r * r;
 
@@ -582,13 +665,13 @@ float TriangleMeshShape::get_average_depth() const
 			return (float)level;
 	};
 	float depth_sum = visit(1, root);
-	int leaf_count = (num_elements / 3);
+	int leaf_count = (int)triangle_ids.size();
 	return depth_sum / leaf_count;
 }
 
 float TriangleMeshShape::get_balanced_depth() const
 {
-	return std::log2((float)(num_elements / 3));
+	return std::log2((float)triangle_ids.size());
 }
 
 int TriangleMeshShape::subdivide(int *triangles, int num_triangles, const vec3 *centroids, int *work_buffer)
@@ -25,6 +25,7 @@
 #include "math/mathlib.h"
 #include <vector>
 #include <cmath>
+#include <cstdint>
 
 class SphereShape
 {
@@ -82,6 +83,9 @@ public:
 class TriangleMeshShape
 {
 public:
+	// Vertices sharing a position on the 16.16 fixed point grid maps are
+	// made on are welded, and triangles left degenerate by that are dropped.
+	// TraceHit::triangle refers to the triangles as passed in here.
 	TriangleMeshShape(const vec3 *vertices, int num_vertices, const unsigned int *elements, int num_elements);
 
 	int get_min_depth() const;
@@ -112,10 +116,22 @@ private:
 		int element_index = -1;
 	};
 
-	const vec3 *vertices = nullptr;
-	const int num_vertices = 0;
-	const unsigned int *elements = nullptr;
-	int num_elements = 0;
+	// What the ray intersector needs of a triangle, computed once up front
+	struct Triangle
+	{
+		vec3 p0;
+		vec3 e1;
+		vec3 e2;
+	};
+
+	// Welded copy of the mesh, only kept while the tree is built
+	std::vector<vec3> vertices;
+	std::vector<unsigned int> elements;
+
+	// Triangles in the order of the leaves referring to them. triangle_ids
+	// maps them back to their index in the mesh passed to the constructor.
+	std::vector<Triangle> ray_triangles;
+	std::vector<int> triangle_ids;
 
 	std::vector<Node> nodes;
 	int root = -1;
@@ -143,6 +159,8 @@ private:
 	inline bool is_leaf(int node_index);
 	inline float volume(int node_index);
 
+	void weld(const vec3 *input_vertices, int num_vertices, const unsigned int *input_elements, int num_elements);
+	void build_triangles();
 	int subdivide(int *triangles, int num_triangles, const vec3 *centroids, int *work_buffer);
 };
 
@@ -6,15 +6,18 @@
 #include "framework/binfile.h"
 #include "framework/templates.h"
 #include "framework/halffloat.h"
+#include "framework/parallel.h"
+#include "framework/progress.h"
 #include <map>
 #include <vector>
 #include <algorithm>
 #include <thread>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
 
 extern bool VKDebug;
-extern int NumThreads;
+extern ETraceBackend TraceBackend;
 
 CPURaytracer::CPURaytracer()
 {
@@ -28,6 +31,82 @@ void CPURaytracer::Raytrace(LevelMesh* level)
 {
 	mesh = level;
 
+	std::vector<CPUTraceTask> tasks = CreateTasks();
+	CreateTracers();
+
+	//printf("Ray tracing with %d bounce(s)\n", mesh->map->LightBounce);
+	printf("Ray tracing in progress...\n");
+
+	{
+		ProgressPhase progress("Ray tracing", tasks.size());
+		RunJob((int)tasks.size(), [&](int id) { RaytraceTask(tasks[id]); progress.Advance(); });
+	}
+
+	if (TraceBackend == TRACE_Check)
+		printf("Map tracer check: %lld of %lld traces hit a different surface\n", (long long)MismatchedTraces, (long long)CheckedTraces);
+
+	printf("Ray tracing complete\n");
+}
+
+void CPURaytracer::RaytraceProgressive(LevelMesh* level, double timeLimit, const std::function<void()>& preview)
+{
+	mesh = level;
+
+	std::vector<CPUTraceTask> tasks = CreateTasks();
+	CreateTracers();
+	Accumulators.assign(mesh->Samples.Size(), CPUTexelAccumulator{ vec3(0.0f), vec3(0.0f), 0 });
+
+	printf("Progressive ray tracing in progress...\n");
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto deadline = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeLimit));
+	std::atomic<bool> expired(false);
+
+	uint32_t done = 0;
+	while (done < (uint32_t)coverageSampleCount)
+	{
+		// Doubles the samples traced so far, starting with one subset
+		uint32_t end = std::min(std::max(done * 2, (uint32_t)coverageSubsetSize), (uint32_t)coverageSampleCount);
+		printf("Tracing %d of %d coverage samples\n", (int)end, coverageSampleCount);
+
+		{
+			ProgressPhase progress("Ray tracing", tasks.size());
+			RunJob((int)tasks.size(), [&](int id) {
+				// The first pass always completes so every texel has a value
+				if (done > 0 && timeLimit > 0.0 && (expired || std::chrono::steady_clock::now() >= deadline))
+				{
+					expired = true;
+					return;
+				}
+				RaytraceProgressiveTask(tasks[id], done, end);
+				progress.Advance();
+			});
+		}
+		done = end;
+
+		if (done < (uint32_t)coverageSampleCount && timeLimit > 0.0 && std::chrono::steady_clock::now() >= deadline)
+			expired = true;
+
+		StoreAccumulators();
+		if (expired)
+		{
+			printf("Time limit of %.1f seconds reached, stopping refinement\n", timeLimit);
+			break;
+		}
+		if (done < (uint32_t)coverageSampleCount && preview)
+			preview();
+	}
+	Accumulators.clear();
+	Accumulators.shrink_to_fit();
+
+	if (TraceBackend == TRACE_Check)
+		printf("Map tracer check: %lld of %lld traces hit a different surface\n", (long long)MismatchedTraces, (long long)CheckedTraces);
+
+	printf("Ray tracing complete\n");
+}
+
+std::vector<CPUTraceTask> CPURaytracer::CreateTasks()
+{
 	std::vector<CPUTraceTask> tasks;
 	for (size_t i = 0; i < mesh->lightProbes.size(); i++)
 	{
@@ -40,7 +119,7 @@ void CPURaytracer::Raytrace(LevelMesh* level)
 
 	for (size_t i = 0; i < mesh->surfaces.size(); i++)
 	{
-		Surface* surface = mesh->surfaces[i].get();
+		Surface* surface = &mesh->surfaces[i];
 		int sampleWidth = surface->lightmapDims[0];
 		int sampleHeight = surface->lightmapDims[1];
 		for (int y = 0; y < sampleHeight; y++)
@@ -55,51 +134,131 @@ void CPURaytracer::Raytrace(LevelMesh* level)
 			}
 		}
 	}
+	return tasks;
+}
 
-	CollisionMesh = std::make_unique<TriangleMeshShape>(mesh->MeshVertices.Data(), mesh->MeshVertices.Size(), mesh->MeshElements.Data(), mesh->MeshElements.Size());
+void CPURaytracer::CreateTracers()
+{
+	if (TraceBackend != TRACE_Map)
+		CollisionMesh = std::make_unique<TriangleMeshShape>(mesh->MeshVertices.Data(), mesh->MeshVertices.Size(), mesh->MeshElements.Data(), mesh->MeshElements.Size());
+	if (TraceBackend != TRACE_BVH)
+		MapTrace = std::make_unique<MapTracer>(mesh);
+	CheckedTraces = 0;
+	MismatchedTraces = 0;
 	CreateHemisphereVectors();
 	CreateLights();
+}
 
-	//printf("Ray tracing with %d bounce(s)\n", mesh->map->LightBounce);
-	printf("Ray tracing in progress...\n");
+void CPURaytracer::RaytraceTask(const CPUTraceTask& task)
+{
+	CPUTraceState state;
+	BeginTrace(state, task);
+
+	state.PassType = 0;
+	state.SampleIndex = 0;
+	state.SampleCount = bounceSampleCount;
+	RunBounceTrace(state);
 
-	RunJob((int)tasks.size(), [=](int id) { RaytraceTask(tasks[id]); });
+	state.SampleCount = coverageSampleCount;
+	RunLightTrace(state);
+
+	RunBounces(state);
 
-	printf("\nRay tracing complete\n");
+	if (task.id >= 0)
+	{
+		Surface* surface = &mesh->surfaces[task.id];
+		size_t sampleWidth = surface->lightmapDims[0];
+		mesh->SetSample(surface, task.x + task.y * sampleWidth, state.Output);
+	}
+	else
+	{
+		LightProbeSample& probe = mesh->lightProbes[(size_t)(-task.id) - 2];
+		probe.Color = state.Output;
+	}
 }
 
-void CPURaytracer::RaytraceTask(const CPUTraceTask& task)
+// Traces the coverage samples from coverageStart to coverageEnd of a texel.
+// Only direct light is sampled per texel area, so everything else is traced
+// once by the first pass. Light probes take a single ray for each light and
+// are finished by the first pass as well.
+void CPURaytracer::RaytraceProgressiveTask(const CPUTraceTask& task, uint32_t coverageStart, uint32_t coverageEnd)
 {
+	if (task.id < 0)
+	{
+		if (coverageStart == 0)
+			RaytraceTask(task);
+		return;
+	}
+
+	Surface* surface = &mesh->surfaces[task.id];
+	CPUTexelAccumulator& texel = Accumulators[surface->firstSample + task.x + (size_t)task.y * surface->lightmapDims[0]];
+
 	CPUTraceState state;
+	BeginTrace(state, task);
+
+	if (coverageStart == 0)
+	{
+		state.PassType = 0;
+		state.SampleIndex = 0;
+		state.SampleCount = bounceSampleCount;
+		RunBounceTrace(state);
+		RunBounces(state);
+		texel.Base = state.Output;
+	}
+
+	state.PassType = 0;
+	state.SampleCount = coverageSampleCount;
+	state.CoverageStart = coverageStart;
+	state.CoverageEnd = coverageEnd;
+	state.Position = state.StartPosition;
+	state.Surf = state.StartSurface;
+	state.Output = vec3(0.0f);
+	state.OutputAttenuation = 1.0f;
+	RunLightTrace(state);
+
+	texel.Direct += state.Output * (float)(coverageEnd - coverageStart);
+	texel.Samples += coverageEnd - coverageStart;
+}
+
+void CPURaytracer::StoreAccumulators()
+{
+	for (size_t i = 0; i < Accumulators.size(); i++)
+	{
+		const CPUTexelAccumulator& texel = Accumulators[i];
+		if (texel.Samples > 0)
+			mesh->Samples.Set(i, texel.Base + texel.Direct * (1.0f / (float)texel.Samples));
+	}
+}
+
+void CPURaytracer::BeginTrace(CPUTraceState& state, const CPUTraceTask& task)
+{
 	state.EndTrace = false;
+	state.CoverageStart = 0;
+	state.CoverageEnd = coverageSampleCount;
 
 	if (task.id >= 0)
 	{
-		Surface* surface = mesh->surfaces[task.id].get();
+		Surface* surface = &mesh->surfaces[task.id];
 		vec3 pos = surface->lightmapOrigin + surface->lightmapSteps[0] * (float)task.x + surface->lightmapSteps[1] * (float)task.y;
 		state.StartPosition = pos;
-		state.StartSurface = surface;
+		state.StartSurface = task.id;
 	}
 	else
 	{
 		LightProbeSample& probe = mesh->lightProbes[(size_t)(-task.id) - 2];
 		state.StartPosition = probe.Position;
-		state.StartSurface = nullptr;
+		state.StartSurface = -1;
 	}
 
 	state.LightCount = mesh->map->ThingLights.Size();
 	state.SunDir = mesh->map->GetSunDirection();
 	state.SunColor = mesh->map->GetSunColor();
 	state.SunIntensity = 1.0f;
+}
 
-	state.PassType = 0;
-	state.SampleIndex = 0;
-	state.SampleCount = bounceSampleCount;
-	RunBounceTrace(state);
-
-	state.SampleCount = coverageSampleCount;
-	RunLightTrace(state);
-
+// Adds the light reaching the start position after bouncing off surfaces
+void CPURaytracer::RunBounces(CPUTraceState& state)
+{
 	for (uint32_t i = 0; i < (uint32_t)bounceSampleCount && !state.EndTrace; i++)
 	{
 		state.PassType = 1;
@@ -120,24 +279,12 @@ void CPURaytracer::RaytraceTask(const CPUTraceTask& task)
 			RunBounceTrace(state);
 		}
 	}
-
-	if (task.id >= 0)
-	{
-		Surface* surface = mesh->surfaces[task.id].get();
-		size_t sampleWidth = surface->lightmapDims[0];
-		surface->samples[task.x + task.y * sampleWidth] = state.Output;
-	}
-	else
-	{
-		LightProbeSample& probe = mesh->lightProbes[(size_t)(-task.id) - 2];
-		probe.Color = state.Output;
-	}
 }
 
 void CPURaytracer::RunBounceTrace(CPUTraceState& state)
 {
 	vec3 origin;
-	Surface* surface;
+	int surface;
 	if (state.PassType == 2)
 	{
 		origin = state.Position;
@@ -154,7 +301,7 @@ void CPURaytracer::RunBounceTrace(CPUTraceState& state)
 
 	if (state.PassType == 0)
 	{
-		if (surface)
+		if (surface != -1)
 		{
 			CPUEmissiveSurface emissive = GetEmissive(surface);
 			incoming = emissive.Color * emissive.Intensity;
@@ -169,9 +316,9 @@ void CPURaytracer::RunBounceTrace(CPUTraceState& state)
 			incomingAttenuation = 1.0f / float(state.SampleCount);
 
 		vec3 normal;
-		if (surface)
+		if (surface != -1)
 		{
-			normal = surface->plane.Normal();
+			normal = mesh->TraceInfo.Normals[surface];
 		}
 		else
 		{
@@ -234,13 +381,13 @@ void CPURaytracer::RunLightTrace(CPUTraceState& state)
 	if (incomingAttenuation <= 0.0f)
 		return;
 
-	Surface* surface = state.Surf;
+	int surface = state.Surf;
 
 	vec3 origin = state.Position;
 	vec3 normal;
-	if (surface)
+	if (surface != -1)
 	{
-		normal = surface->plane.Normal();
+		normal = mesh->TraceInfo.Normals[surface];
 		origin += normal * 0.1f;
 	}
 
@@ -251,31 +398,31 @@ void CPURaytracer::RunLightTrace(CPUTraceState& state)
 		const float dist = 32768.0f;
 
 		float attenuation = 0.0f;
-		if (state.PassType == 0 && surface)
+		if (state.PassType == 0 && surface != -1)
 		{
 			vec3 e0 = normalize(cross(normal, std::abs(normal.x) < std::abs(normal.y) ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f)));
 			vec3 e1 = cross(normal, e0);
 			e0 = cross(normal, e1);
 
-			for (uint32_t i = 0; i < state.SampleCount; i++)
+			for (uint32_t k = state.CoverageStart; k < state.CoverageEnd; k++)
 			{
-				vec2 offset = (Hammersley(i, state.SampleCount) - 0.5f) * float(surface->sampleDimension);
+				vec2 offset = (Hammersley(GetCoverageSample(k), state.SampleCount) - 0.5f) * mesh->TraceInfo.SampleDistances[surface];
 				vec3 origin2 = origin + e0 * offset.x + e1 * offset.y;
 
 				vec3 start = origin2;
 				vec3 end = start + state.SunDir * dist;
 				LevelTraceHit hit = Trace(start, end);
-				if (hit.fraction < 1.0f && hit.hitSurface->bSky)
+				if (hit.fraction < 1.0f && mesh->TraceInfo.Sky[hit.hitSurface])
 					attenuation += 1.0f;
 			}
-			attenuation *= 1.0f / float(state.SampleCount);
+			attenuation *= 1.0f / float(state.CoverageEnd - state.CoverageStart);
 		}
 		else
 		{
 			vec3 start = origin;
 			vec3 end = start + state.SunDir * dist;
 			LevelTraceHit hit = Trace(start, end);
-			attenuation = (hit.fraction < 1.0f && hit.hitSurface->bSky) ? 1.0f : 0.0f;
+			attenuation = (hit.fraction < 1.0f && mesh->TraceInfo.Sky[hit.hitSurface]) ? 1.0f : 0.0f;
 		}
 		incoming += state.SunColor * (attenuation * state.SunIntensity * incomingAttenuation);
 	}
@@ -291,7 +438,7 @@ void CPURaytracer::RunLightTrace(CPUTraceState& state)
 
 			float distAttenuation = std::max(1.0f - (dist / light.Radius), 0.0f);
 			float angleAttenuation = 1.0f;
-			if (surface)
+			if (surface != -1)
 			{
 				angleAttenuation = std::max(dot(normal, dir), 0.0f);
 			}
@@ -308,21 +455,21 @@ void CPURaytracer::RunLightTrace(CPUTraceState& state)
 			{
 				float shadowAttenuation = 0.0f;
 
-				if (state.PassType == 0 && surface)
+				if (state.PassType == 0 && surface != -1)
 				{
 					vec3 e0 = normalize(cross(normal, std::abs(normal.x) < std::abs(normal.y) ? vec3(1.0f, 0.0f, 0.0f) : vec3(0.0f, 1.0f, 0.0f)));
 					vec3 e1 = cross(normal, e0);
 					e0 = cross(normal, e1);
-					for (uint32_t i = 0; i < state.SampleCount; i++)
+					for (uint32_t k = state.CoverageStart; k < state.CoverageEnd; k++)
 					{
-						vec2 offset = (Hammersley(i, state.SampleCount) - 0.5f) * float(surface->sampleDimension);
+						vec2 offset = (Hammersley(GetCoverageSample(k), state.SampleCount) - 0.5f) * mesh->TraceInfo.SampleDistances[surface];
 						vec3 origin2 = origin + e0 * offset.x + e1 * offset.y;
 
 						LevelTraceHit hit = Trace(origin2, light.Origin);
 						if (hit.fraction == 1.0f)
 							shadowAttenuation += 1.0f;
 					}
-					shadowAttenuation *= 1.0f / float(state.SampleCount);
+					shadowAttenuation *= 1.0f / float(state.CoverageEnd - state.CoverageStart);
 				}
 				else
 				{
@@ -356,6 +503,19 @@ vec2 CPURaytracer::Hammersley(uint32_t i, uint32_t N)
 	return vec2(float(i) / float(N), RadicalInverse_VdC(i));
 }
 
+// Maps position k in subset order to a coverage sample. The samples form a
+// Hammersley set, x being i / N and y the bit reversal of i. Subset c holds
+// the samples whose low bits are the high bits xor c, so each subset is a
+// small Hammersley set spread over the whole texel and any run of subsets
+// is as well. The hits are only counted, so the order they are traced in
+// doesn't change the result.
+uint32_t CPURaytracer::GetCoverageSample(uint32_t k) const
+{
+	uint32_t subset = k / coverageSubsetSize;
+	uint32_t t = k % coverageSubsetSize;
+	return t * (coverageSampleCount / coverageSubsetSize) + (t ^ subset);
+}
+
 float CPURaytracer::RadicalInverse_VdC(uint32_t bits)
 {
 	bits = (bits << 16u) | (bits >> 16u);
@@ -401,36 +561,12 @@ void CPURaytracer::CreateLights()
 	}
 }
 
-CPUEmissiveSurface CPURaytracer::GetEmissive(Surface* surface)
+CPUEmissiveSurface CPURaytracer::GetEmissive(int surface)
 {
 	CPUEmissiveSurface info;
 
-	SurfaceLightDef* def = nullptr;
-	if (surface->type >= ST_MIDDLESIDE && surface->type <= ST_LOWERSIDE)
-	{
-		int lightdefidx = mesh->map->Sides[surface->typeIndex].lightdef;
-		if (lightdefidx != -1)
-		{
-			def = &mesh->map->SurfaceLights[lightdefidx];
-		}
-	}
-	else if (surface->type == ST_FLOOR || surface->type == ST_CEILING)
-	{
-		MapSubsectorEx* sub = &mesh->map->GLSubsectors[surface->typeIndex];
-		IntSector* sector = mesh->map->GetSectorFromSubSector(sub);
-
-		if (sector && surface->numVerts > 0)
-		{
-			if (sector->floorlightdef != -1 && surface->type == ST_FLOOR)
-			{
-				def = &mesh->map->SurfaceLights[sector->floorlightdef];
-			}
-			else if (sector->ceilinglightdef != -1 && surface->type == ST_CEILING)
-			{
-				def = &mesh->map->SurfaceLights[sector->ceilinglightdef];
-			}
-		}
-	}
+	int lightdef = mesh->TraceInfo.LightDefs[surface];
+	SurfaceLightDef* def = lightdef != -1 ? &mesh->map->SurfaceLights[lightdef] : nullptr;
 
 	if (def)
 	{
@@ -450,16 +586,30 @@ CPUEmissiveSurface CPURaytracer::GetEmissive(Surface* surface)
 
 LevelTraceHit CPURaytracer::Trace(const vec3& startVec, const vec3& endVec)
 {
-	TraceHit hit = TriangleMeshShape::find_first_hit(CollisionMesh.get(), startVec, endVec);
-
 	LevelTraceHit trace;
 	trace.start = startVec;
 	trace.end = endVec;
+
+	if (TraceBackend == TRACE_Map)
+	{
+		MapTraceHit hit = MapTrace->Trace(startVec, endVec);
+		trace.fraction = hit.fraction;
+		trace.hitSurface = hit.surface;
+		trace.indices[0] = 0;
+		trace.indices[1] = 0;
+		trace.indices[2] = 0;
+		trace.b = 0.0f;
+		trace.c = 0.0f;
+		return trace;
+	}
+
+	TraceHit hit = TriangleMeshShape::find_first_hit(CollisionMesh.get(), startVec, endVec);
+
 	trace.fraction = hit.fraction;
 	if (trace.fraction < 1.0f)
 	{
 		int elementIdx = hit.triangle * 3;
-		trace.hitSurface = mesh->surfaces[mesh->MeshSurfaces[hit.triangle]].get();
+		trace.hitSurface = mesh->MeshSurfaces[hit.triangle];
 		trace.indices[0] = mesh->MeshUVIndex[mesh->MeshElements[elementIdx]];
 		trace.indices[1] = mesh->MeshUVIndex[mesh->MeshElements[elementIdx + 1]];
 		trace.indices[2] = mesh->MeshUVIndex[mesh->MeshElements[elementIdx + 2]];
@@ -468,30 +618,34 @@ LevelTraceHit CPURaytracer::Trace(const vec3& startVec, const vec3& endVec)
 	}
 	else
 	{
-		trace.hitSurface = nullptr;
+		trace.hitSurface = -1;
 		trace.indices[0] = 0;
 		trace.indices[1] = 0;
 		trace.indices[2] = 0;
 		trace.b = 0.0f;
 		trace.c = 0.0f;
 	}
+
+	if (TraceBackend == TRACE_Check)
+	{
+		CheckedTraces++;
+		if (MapTrace->Trace(startVec, endVec).surface != trace.hitSurface)
+			MismatchedTraces++;
+	}
+
 	return trace;
 }
 
 bool CPURaytracer::TraceAnyHit(const vec3& startVec, const vec3& endVec)
 {
+	if (TraceBackend == TRACE_Map)
+		return MapTrace->Trace(startVec, endVec).fraction < 1.0f;
 	return TriangleMeshShape::find_any_hit(CollisionMesh.get(), startVec, endVec);
 }
 
 void CPURaytracer::RunJob(int count, std::function<void(int)> callback)
 {
-	int numThreads = NumThreads;
-	if (numThreads <= 0)
-		numThreads = std::thread::hardware_concurrency();
-	if (numThreads <= 0)
-		numThreads = 4;
-
-	numThreads = std::min(numThreads, count);
+	int numThreads = std::min(GetNumThreads(), count);
 
 	std::condition_variable condvar;
 	std::mutex m;
@@ -507,21 +661,9 @@ void CPURaytracer::RunJob(int count, std::function<void(int)> callback)
 	{
 		threads.push_back(std::thread([&, threadIndex]() {
 
-			if (threadIndex == 0)
-			{
-				for (int i = 0; i < count; i += numThreads)
-				{
-					if((i / numThreads) % 8192 == 0)
-						printf("\r%.1f%%\t%d/%d", double(i) / double(count) * 100, i, count);
-					callback(i);
-				}
-			}
-			else
+			for (int i = threadIndex; i < count; i += numThreads)
 			{
-				for (int i = threadIndex; i < count; i += numThreads)
-				{
-					callback(i);
-				}
+				callback(i);
 			}
 
 			std::unique_lock<std::mutex> lock(m);
@@ -538,7 +680,6 @@ void CPURaytracer::RunJob(int count, std::function<void(int)> callback)
 		{
 			condvar.wait_for(lock, std::chrono::milliseconds(500), [&]() { return threadsleft == 0; });
 		}
-		printf("\r%.1f%%\t%d/%d\n", 100.0, count, count);
 	}
 
 	for (int i = 0; i < numThreads; i++)
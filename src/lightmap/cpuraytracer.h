@@ -2,7 +2,9 @@
 #pragma once
 
 #include <functional>
+#include <atomic>
 #include "collision.h"
+#include "maptracer.h"
 
 class LevelMesh;
 
@@ -26,6 +28,8 @@ struct CPUTraceState
 {
 	uint32_t SampleIndex;
 	uint32_t SampleCount;
+	uint32_t CoverageStart;		// Coverage samples traced, in subset order
+	uint32_t CoverageEnd;
 	uint32_t PassType;
 	uint32_t LightCount;
 	vec3 SunDir;
@@ -34,10 +38,10 @@ struct CPUTraceState
 	vec3 HemisphereVec;
 
 	vec3 StartPosition;
-	Surface* StartSurface;
+	int StartSurface;		// LevelMesh::surfaces index or -1 for probes
 
 	vec3 Position;
-	Surface* Surf;
+	int Surf;
 
 	vec3 Output;
 	float OutputAttenuation;
@@ -45,6 +49,14 @@ struct CPUTraceState
 	bool EndTrace;
 };
 
+// Running totals of a texel in a progressive bake
+struct CPUTexelAccumulator
+{
+	vec3 Base;			// Emissive and bounced light, traced in full by the first pass
+	vec3 Direct;		// Direct light of each pass weighted by its coverage samples
+	uint32_t Samples;	// Coverage samples so far
+};
+
 struct CPUEmissiveSurface
 {
 	float Distance;
@@ -58,7 +70,7 @@ struct LevelTraceHit
 	vec3 end;
 	float fraction;
 
-	Surface* hitSurface;
+	int hitSurface;
 	int indices[3];
 	float b, c;
 };
@@ -71,12 +83,26 @@ public:
 
 	void Raytrace(LevelMesh* level);
 
+	// Traces in passes that each double the coverage samples per texel.
+	// Every pass but the last stores its result in the mesh samples and
+	// calls preview. Refining stops early once timeLimit seconds have gone
+	// by, if it is above zero.
+	void RaytraceProgressive(LevelMesh* level, double timeLimit, const std::function<void()>& preview);
+
 private:
+	std::vector<CPUTraceTask> CreateTasks();
+	void CreateTracers();
+
 	void RaytraceTask(const CPUTraceTask& task);
+	void RaytraceProgressiveTask(const CPUTraceTask& task, uint32_t coverageStart, uint32_t coverageEnd);
+	void StoreAccumulators();
+
+	void BeginTrace(CPUTraceState& state, const CPUTraceTask& task);
+	void RunBounces(CPUTraceState& state);
 	void RunBounceTrace(CPUTraceState& state);
 	void RunLightTrace(CPUTraceState& state);
 
-	CPUEmissiveSurface GetEmissive(Surface* surface);
+	CPUEmissiveSurface GetEmissive(int surface);
 
 	void CreateHemisphereVectors();
 	void CreateLights();
@@ -88,15 +114,28 @@ private:
 
 	static float RadicalInverse_VdC(uint32_t bits);
 	static vec2 Hammersley(uint32_t i, uint32_t N);
+	uint32_t GetCoverageSample(uint32_t k) const;
 
 	static void RunJob(int count, std::function<void(int i)> callback);
 
 	const int coverageSampleCount = 256;
 	const int bounceSampleCount = 2048;
 
+	// Coverage samples are traced in subsets of this many, the square root
+	// of coverageSampleCount, see GetCoverageSample
+	const int coverageSubsetSize = 16;
+
 	LevelMesh* mesh = nullptr;
 	std::vector<vec3> HemisphereVectors;
 	std::vector<CPULightInfo> Lights;
 
 	std::unique_ptr<TriangleMeshShape> CollisionMesh;
+	std::unique_ptr<MapTracer> MapTrace;
+
+	// Indexed like LevelMesh::Samples
+	std::vector<CPUTexelAccumulator> Accumulators;
+
+	// Traces where the two backends disagree, when checking them
+	std::atomic<int64_t> CheckedTraces;
+	std::atomic<int64_t> MismatchedTraces;
 };
@@ -6,6 +6,7 @@
 #include "framework/binfile.h"
 #include "framework/templates.h"
 #include "framework/halffloat.h"
+#include "framework/progress.h"
 #include "vulkanbuilders.h"
 #include <map>
 #include <vector>
@@ -61,7 +62,7 @@ void GPURaytracer::Raytrace(LevelMesh* level)
 
 	for (size_t i = 0; i < mesh->surfaces.size(); i++)
 	{
-		Surface* surface = mesh->surfaces[i].get();
+		Surface* surface = &mesh->surfaces[i];
 		int sampleWidth = surface->lightmapDims[0];
 		int sampleHeight = surface->lightmapDims[1];
 		for (int y = 0; y < sampleHeight; y++)
@@ -94,10 +95,10 @@ void GPURaytracer::Raytrace(LevelMesh* level)
 	printf("Ray tracing in progress...\n");
 
 	RunAsync([&]() {
+		ProgressPhase progress("Ray tracing", tasks.size());
 		size_t maxTasks = (size_t)rayTraceImageSize * rayTraceImageSize;
 		for (size_t startTask = 0; startTask < tasks.size(); startTask += maxTasks)
 		{
-			printf("\r%.1f%%\t%d/%d", double(startTask) / double(tasks.size()) * 100, startTask, tasks.size());
 			size_t numTasks = std::min(tasks.size() - startTask, maxTasks);
 			UploadTasks(tasks.data() + startTask, numTasks);
 
@@ -144,8 +145,8 @@ void GPURaytracer::Raytrace(LevelMesh* level)
 
 			EndTracing();
 			DownloadTasks(tasks.data() + startTask, numTasks);
+			progress.Advance(numTasks);
 		}
-		printf("\r%.1f%%\t%d/%d\n", 100.0, tasks.size(), tasks.size());
 	});
 
 	if (device->renderdoc)
@@ -193,7 +194,7 @@ void GPURaytracer::UploadTasks(const TraceTask* tasks, size_t size)
 
 		if (task.id >= 0)
 		{
-			Surface* surface = mesh->surfaces[task.id].get();
+			Surface* surface = &mesh->surfaces[task.id];
 			vec3 pos = surface->lightmapOrigin + surface->lightmapSteps[0] * (task.x + 0.5f) + surface->lightmapSteps[1] * (task.y + 0.5f);
 			startPositions[i] = vec4(pos, (float)task.id);
 		}
@@ -343,9 +344,9 @@ void GPURaytracer::DownloadTasks(const TraceTask* tasks, size_t size)
 		const TraceTask& task = tasks[i];
 		if (task.id >= 0)
 		{
-			Surface* surface = mesh->surfaces[task.id].get();
+			Surface* surface = &mesh->surfaces[task.id];
 			size_t sampleWidth = surface->lightmapDims[0];
-			surface->samples[task.x + task.y * sampleWidth] = vec3(output[i].x, output[i].y, output[i].z);
+			mesh->SetSample(surface, task.x + task.y * sampleWidth, vec3(output[i].x, output[i].y, output[i].z));
 		}
 		else
 		{
@@ -360,38 +361,14 @@ void GPURaytracer::CreateVertexAndIndexBuffers()
 {
 	std::vector<SurfaceInfo> surfaces;
 	surfaces.reserve(mesh->surfaces.size());
-	for (const auto& surface : mesh->surfaces)
+	const SurfaceTraceTable& table = mesh->TraceInfo;
+	for (size_t i = 0; i < mesh->surfaces.size(); i++)
 	{
-		SurfaceLightDef* def = nullptr;
-		if (surface->type >= ST_MIDDLESIDE && surface->type <= ST_LOWERSIDE)
-		{
-			int lightdefidx = mesh->map->Sides[surface->typeIndex].lightdef;
-			if (lightdefidx != -1)
-			{
-				def = &mesh->map->SurfaceLights[lightdefidx];
-			}
-		}
-		else if (surface->type == ST_FLOOR || surface->type == ST_CEILING)
-		{
-			MapSubsectorEx* sub = &mesh->map->GLSubsectors[surface->typeIndex];
-			IntSector* sector = mesh->map->GetSectorFromSubSector(sub);
-
-			if (sector && surface->numVerts > 0)
-			{
-				if (sector->floorlightdef != -1 && surface->type == ST_FLOOR)
-				{
-					def = &mesh->map->SurfaceLights[sector->floorlightdef];
-				}
-				else if (sector->ceilinglightdef != -1 && surface->type == ST_CEILING)
-				{
-					def = &mesh->map->SurfaceLights[sector->ceilinglightdef];
-				}
-			}
-		}
+		SurfaceLightDef* def = table.LightDefs[i] != -1 ? &mesh->map->SurfaceLights[table.LightDefs[i]] : nullptr;
 
 		SurfaceInfo info;
-		info.Sky = surface->bSky ? 1.0f : 0.0f;
-		info.Normal = surface->plane.Normal();
+		info.Sky = table.Sky[i] ? 1.0f : 0.0f;
+		info.Normal = table.Normals[i];
 		if (def)
 		{
 			info.EmissiveDistance = def->distance + def->distance;
@@ -405,7 +382,7 @@ void GPURaytracer::CreateVertexAndIndexBuffers()
 			info.EmissiveColor = vec3(0.0f, 0.0f, 0.0f);
 		}
 
-		info.SamplingDistance = surface->sampleDimension;
+		info.SamplingDistance = table.SampleDistances[i];
 		surfaces.push_back(info);
 	}
 
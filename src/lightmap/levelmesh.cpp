@@ -29,9 +29,12 @@
 #include "framework/templates.h"
 #include "framework/halffloat.h"
 #include "framework/binfile.h"
+#include "framework/parallel.h"
 #include "level/level.h"
 #include "levelmesh.h"
-#include "pngwriter.h"
+#include "bc6h.h"
+#include "meshexport.h"
+#include <algorithm>
 #include <map>
 
 #ifdef _MSC_VER
@@ -39,6 +42,19 @@
 #pragma warning(disable: 4244) // warning C4244: '=': conversion from '__int64' to 'int', possible loss of data
 #endif
 
+extern EBC6HQuality BC6HQuality;
+extern bool LightmapRotation;
+extern ESampleFormat SampleFormat;
+
+namespace
+{
+	// Largest luminance step between neighbouring texels an adaptive bake
+	// leaves unrefined, relative to the brighter texel. The black level keeps
+	// noise in nearly unlit areas from counting as contrast.
+	const float AdaptiveMaxContrast = 0.125f;
+	const float AdaptiveBlackLevel = 0.02f;
+}
+
 LevelMesh::LevelMesh(FLevel &doomMap, int sampleDistance, int textureSize)
 {
 	map = &doomMap;
@@ -48,13 +64,15 @@ LevelMesh::LevelMesh(FLevel &doomMap, int sampleDistance, int textureSize)
 
 	printf("\n------------- Building side surfaces -------------\n");
 
-	for (unsigned int i = 0; i < doomMap.Sides.Size(); i++)
-	{
-		CreateSideSurfaces(doomMap, &doomMap.Sides[i]);
-		printf("Sides: %i / %i\r", i + 1, doomMap.Sides.Size());
-	}
+	// Surfaces are created into a list per side or subsector on all threads
+	// and then concatenated in order, so the result doesn't depend on timing.
+	std::vector<SurfaceList> sideSurfaces(doomMap.Sides.Size());
+	ParallelFor(sideSurfaces.size(), [&](size_t i) {
+		CreateSideSurfaces(doomMap, &doomMap.Sides[i], sideSurfaces[i]);
+	});
+	AppendSurfaces(sideSurfaces);
 
-	printf("\nSide surfaces: %i\n", (int)surfaces.size());
+	printf("Side surfaces: %i\n", (int)surfaces.size());
 
 	CreateSubsectorSurfaces(doomMap);
 
@@ -62,56 +80,160 @@ LevelMesh::LevelMesh(FLevel &doomMap, int sampleDistance, int textureSize)
 
 	printf("Building level mesh...\n\n");
 
-	for (size_t i = 0; i < surfaces.size(); i++)
+	BuildMeshArrays();
+
+	CreateLightProbes(doomMap);
+
+	BuildLightmapLayout();
+}
+
+// Sizes every surface's lightmap block for its sampleDimension, merges the
+// flats into charts and allocates the samples the tracers fill.
+void LevelMesh::BuildLightmapLayout()
+{
+	for (Surface& surface : surfaces)
 	{
-		const auto &s = surfaces[i];
-		int numVerts = s->numVerts;
-		unsigned int pos = MeshVertices.Size();
+		surface.chartOwner = nullptr;
+		surface.nextChartMember = nullptr;
+	}
+
+	ParallelFor(surfaces.size(), [&](size_t i) {
+		BuildSurfaceParams(&surfaces[i]);
+	});
+
+	MergeCharts(*map);
+	AllocSamples();
+	BuildTraceTable(*map);
+}
 
-		for (int j = 0; j < numVerts; j++)
+// Gives every surface the same texel size, for the coarse pass of an
+// adaptive bake.
+void LevelMesh::SetSampleDimension(int dimension)
+{
+	for (Surface& surface : surfaces)
+		surface.sampleDimension = dimension;
+	BuildLightmapLayout();
+}
+
+// Picks a texel size for each chart from the samples of a coarse bake. Each
+// halving of the texel size halves the contrast between neighbouring texels
+// of a smooth gradient, so a chart is refined until its steepest step drops
+// below AdaptiveMaxContrast or minDimension is reached. Flat lighting keeps
+// the coarse texels.
+void LevelMesh::AdaptSampleDimensions(int minDimension, int maxDimension)
+{
+	std::vector<int> dimensions(surfaces.size());
+	ParallelFor(surfaces.size(), [&](size_t i) {
+		Surface* surface = &surfaces[i];
+		if (surface->chartOwner)
+			return;
+
+		float contrast = GetSampleContrast(surface);
+		int dimension = surface->sampleDimension;
+		while (dimension > minDimension && contrast > AdaptiveMaxContrast)
 		{
-			MeshVertices.Push(s->verts[j]);
-			MeshUVIndex.Push(j);
+			dimension /= 2;
+			contrast *= 0.5f;
 		}
+		dimension = std::max(std::min(dimension, maxDimension), minDimension);
 
-		if (s->type == ST_FLOOR || s->type == ST_CEILING)
+		for (Surface* s = surface; s; s = s->nextChartMember)
+			dimensions[s - surfaces.data()] = dimension;
+	});
+
+	std::map<int, int> histogram;
+	for (size_t i = 0; i < surfaces.size(); i++)
+	{
+		surfaces[i].sampleDimension = dimensions[i];
+		histogram[dimensions[i]]++;
+	}
+
+	printf("Adaptive texel sizes:");
+	for (auto it = histogram.begin(); it != histogram.end(); ++it)
+		printf("%s %d at %d", it == histogram.begin() ? "" : ",", it->second, it->first);
+	printf(" units\n");
+
+	BuildLightmapLayout();
+}
+
+// Largest relative luminance step between neighbouring texels of a chart.
+// Only texels on or next to the chart's polygons count, since the border
+// texels outside them may lie in a wall.
+float LevelMesh::GetSampleContrast(Surface* surface)
+{
+	int sampleWidth = surface->lightmapDims[0];
+	int sampleHeight = surface->lightmapDims[1];
+	if (sampleWidth == 0 || sampleHeight == 0)
+		return 0.0f;
+
+	std::vector<vec3> colorSamples((size_t)sampleWidth * sampleHeight);
+	Samples.Read(surface->firstSample, colorSamples.size(), colorSamples.data());
+
+	// Lightmap coordinates are still in texels relative to the block here
+	std::vector<uint8_t> covered(colorSamples.size());
+	std::vector<unsigned int> elements;
+	for (Surface* s = surface; s; s = s->nextChartMember)
+	{
+		elements.resize(GetSurfaceTriangles(s, nullptr) * 3);
+		int count = GetSurfaceTriangles(s, elements.data());
+		for (int t = 0; t < count; t++)
 		{
-			for (int j = 2; j < numVerts; j++)
+			vec2 p[3];
+			for (int j = 0; j < 3; j++)
+				p[j] = MeshLightmapCoords[elements[t * 3 + j]];
+
+			float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+			if (area == 0.0f)
+				continue;
+			float side = area > 0.0f ? 1.0f : -1.0f;
+
+			int x0 = std::max((int)std::floor(std::min(std::min(p[0].x, p[1].x), p[2].x)), 0);
+			int y0 = std::max((int)std::floor(std::min(std::min(p[0].y, p[1].y), p[2].y)), 0);
+			int x1 = std::min((int)std::ceil(std::max(std::max(p[0].x, p[1].x), p[2].x)), sampleWidth - 1);
+			int y1 = std::min((int)std::ceil(std::max(std::max(p[0].y, p[1].y), p[2].y)), sampleHeight - 1);
+			for (int y = y0; y <= y1; y++)
 			{
-				if (!IsDegenerate(s->verts[0], s->verts[j - 1], s->verts[j]))
+				for (int x = x0; x <= x1; x++)
 				{
-					MeshElements.Push(pos);
-					MeshElements.Push(pos + j - 1);
-					MeshElements.Push(pos + j);
-					MeshSurfaces.Push(i);
+					// Inside, or within half a texel of an edge
+					bool inside = true;
+					for (int j = 0; j < 3 && inside; j++)
+					{
+						vec2 a = p[j];
+						vec2 b = p[(j + 1) % 3];
+						vec2 edge = b - a;
+						float distance = side * (edge.x * (y - a.y) - edge.y * (x - a.x)) / length(edge);
+						inside = distance >= -0.5f;
+					}
+					if (inside)
+						covered[y * sampleWidth + x] = 1;
 				}
 			}
 		}
-		else if (s->type == ST_MIDDLESIDE || s->type == ST_UPPERSIDE || s->type == ST_LOWERSIDE)
-		{
-			if (!IsDegenerate(s->verts[0], s->verts[1], s->verts[2]))
-			{
-				MeshElements.Push(pos + 0);
-				MeshElements.Push(pos + 1);
-				MeshElements.Push(pos + 2);
-				MeshSurfaces.Push(i);
-			}
-			if (!IsDegenerate(s->verts[1], s->verts[2], s->verts[3]))
-			{
-				MeshElements.Push(pos + 3);
-				MeshElements.Push(pos + 2);
-				MeshElements.Push(pos + 1);
-				MeshSurfaces.Push(i);
-			}
-		}
 	}
 
-	CreateLightProbes(doomMap);
-
-	for (size_t i = 0; i < surfaces.size(); i++)
+	auto luminance = [](const vec3& c) { return c.x * 0.2126f + c.y * 0.7152f + c.z * 0.0722f; };
+	auto step = [&](size_t a, size_t b) {
+		if (!covered[a] || !covered[b])
+			return 0.0f;
+		float la = luminance(colorSamples[a]);
+		float lb = luminance(colorSamples[b]);
+		return std::abs(la - lb) / (std::max(la, lb) + AdaptiveBlackLevel);
+	};
+
+	float contrast = 0.0f;
+	for (int y = 0; y < sampleHeight; y++)
 	{
-		BuildSurfaceParams(surfaces[i].get());
+		for (int x = 0; x < sampleWidth; x++)
+		{
+			size_t i = (size_t)y * sampleWidth + x;
+			if (x + 1 < sampleWidth)
+				contrast = std::max(contrast, step(i, i + 1));
+			if (y + 1 < sampleHeight)
+				contrast = std::max(contrast, step(i, i + sampleWidth));
+		}
 	}
+	return contrast;
 }
 
 // Determines a lightmap block in which to map to the lightmap texture.
@@ -131,6 +253,12 @@ void LevelMesh::BuildSurfaceParams(Surface* surface)
 
 	plane = &surface->plane;
 	bounds = GetBoundsFromSurface(surface);
+	for (Surface* member = surface->nextChartMember; member; member = member->nextChartMember)
+	{
+		const vec3* verts = GetVerts(member);
+		for (int j = 0; j < member->numVerts; j++)
+			bounds.AddPoint(verts[j]);
+	}
 
 	if (surface->sampleDimension < 0) surface->sampleDimension = 1;
 	surface->sampleDimension = Math::RoundPowerOfTwo(surface->sampleDimension);
@@ -187,19 +315,23 @@ void LevelMesh::BuildSurfaceParams(Surface* surface)
 		height = (textureHeight - 2);
 	}
 
-	surface->lightmapCoords.resize(surface->numVerts);
-	for (i = 0; i < surface->numVerts; i++)
+	for (Surface* s = surface; s; s = s->nextChartMember)
 	{
-		vec3 tDelta = surface->verts[i] - bounds.min;
-		surface->lightmapCoords[i].x = dot(tDelta, tCoords[0]);
-		surface->lightmapCoords[i].y = dot(tDelta, tCoords[1]);
+		const vec3* verts = GetVerts(s);
+		vec2* lightmapCoords = GetLightmapCoords(s);
+		for (int j = 0; j < s->numVerts; j++)
+		{
+			vec3 tDelta = verts[j] - bounds.min;
+			lightmapCoords[j].x = dot(tDelta, tCoords[0]);
+			lightmapCoords[j].y = dot(tDelta, tCoords[1]);
+		}
 	}
 
 	/*
 	surface->coveragemask.resize(width * height);
 	if (surface->type == ST_FLOOR || surface->type == ST_CEILING)
 	{
-		int count = surfaces[i]->numVerts;
+		int count = surfaces[i].numVerts;
 		for (i = 0; i < count; i++)
 		{
 			MarkEdge(surface, i, i + 1 % count);
@@ -237,8 +369,6 @@ void LevelMesh::BuildSurfaceParams(Surface* surface)
 	surface->lightmapSteps[0] = tCoords[0] * (float)surface->sampleDimension;
 	surface->lightmapSteps[1] = tCoords[1] * (float)surface->sampleDimension;
 
-	surface->samples.resize(width * height);
-	surface->indirect.resize(width * height);
 }
 
 BBox LevelMesh::GetBoundsFromSurface(const Surface* surface)
@@ -249,17 +379,18 @@ BBox LevelMesh::GetBoundsFromSurface(const Surface* surface)
 	BBox bounds;
 	bounds.Clear();
 
+	const vec3* verts = GetVerts(surface);
 	for (int i = 0; i < surface->numVerts; i++)
 	{
 		for (int j = 0; j < 3; j++)
 		{
-			if (surface->verts[i][j] < low[j])
+			if (verts[i][j] < low[j])
 			{
-				low[j] = surface->verts[i][j];
+				low[j] = verts[i][j];
 			}
-			if (surface->verts[i][j] > hi[j])
+			if (verts[i][j] > hi[j])
 			{
-				hi[j] = surface->verts[i][j];
+				hi[j] = verts[i][j];
 			}
 		}
 	}
@@ -272,35 +403,67 @@ BBox LevelMesh::GetBoundsFromSurface(const Surface* surface)
 
 void LevelMesh::CreateTextures()
 {
-	std::vector<Surface*> sortedSurfaces;
-	sortedSurfaces.reserve(surfaces.size());
-	for (auto& surf : surfaces)
-		sortedSurfaces.push_back(surf.get());
-	std::sort(sortedSurfaces.begin(), sortedSurfaces.end(), [](Surface* a, Surface* b) { return a->lightmapDims[1] < b->lightmapDims[1]; });
-
-	for (Surface* surf : sortedSurfaces)
+	// Samples were allocated in packing order, so everything up to the
+	// surface just placed has been copied and its blocks can go.
+	for (Surface* surf : GetPackingOrder())
 	{
 		FinishSurface(surf);
+		Samples.Release(surf->firstSample + (size_t)surf->lightmapDims[0] * surf->lightmapDims[1]);
 	}
+	Samples.Clear();
+
+	long long usedArea = 0;
+	for (auto& texture : textures)
+		usedArea += texture->UsedArea();
+	long long pageArea = (long long)textureWidth * textureHeight;
+	printf("Lightmap pages: %d, fill rate %.1f%%\n", (int)textures.size(), textures.empty() ? 0.0 : usedArea * 100.0 / (pageArea * textures.size()));
+}
+
+// Builds the pages from the samples traced so far and calls write while
+// they exist. Afterwards the mesh is as it was before, with the samples
+// zeroed, so tracing can go on and store its next results.
+void LevelMesh::CreatePreviewTextures(const std::function<void()>& write)
+{
+	std::vector<vec2> blockCoords = MeshLightmapCoords;
+	size_t count = Samples.Size();
+
+	CreateTextures();
+	write();
+
+	textures.clear();
+	MeshLightmapCoords = blockCoords;
+	Samples.Allocate(count, SampleFormat);
+}
+
+std::vector<Surface*> LevelMesh::GetPackingOrder()
+{
+	// Tallest blocks first suits the skyline packer best. When blocks may be
+	// rotated their longest side counts as the height.
+	auto packHeight = [](const Surface* s) { return LightmapRotation ? std::max(s->lightmapDims[0], s->lightmapDims[1]) : s->lightmapDims[1]; };
+	auto packWidth = [](const Surface* s) { return LightmapRotation ? std::min(s->lightmapDims[0], s->lightmapDims[1]) : s->lightmapDims[0]; };
+
+	std::vector<Surface*> sortedSurfaces;
+	sortedSurfaces.reserve(surfaces.size());
+	for (auto& surf : surfaces)
+		sortedSurfaces.push_back(&surf);
+	std::stable_sort(sortedSurfaces.begin(), sortedSurfaces.end(), [&](Surface* a, Surface* b) {
+		if (packHeight(a) != packHeight(b))
+			return packHeight(a) > packHeight(b);
+		return packWidth(a) > packWidth(b);
+	});
+	return sortedSurfaces;
 }
 
 void LevelMesh::FinishSurface(Surface* surface)
 {
+	// Placed together with the surface owning the chart
+	if (surface->chartOwner)
+		return;
+
 	int sampleWidth = surface->lightmapDims[0];
 	int sampleHeight = surface->lightmapDims[1];
-	vec3* colorSamples = surface->samples.data();
-
-	if (!surface->indirect.empty())
-	{
-		vec3* indirect = surface->indirect.data();
-		for (int i = 0; i < sampleHeight; i++)
-		{
-			for (int j = 0; j < sampleWidth; j++)
-			{
-				colorSamples[i * sampleWidth + j] += indirect[i * sampleWidth + j] * 0.5f;
-			}
-		}
-	}
+	std::vector<vec3> colorSamples((size_t)sampleWidth * sampleHeight);
+	Samples.Read(surface->firstSample, colorSamples.size(), colorSamples.data());
 
 	// SVE redraws the scene for lightmaps, so for optimizations,
 	// tell the engine to ignore this surface if completely black
@@ -320,86 +483,71 @@ void LevelMesh::FinishSurface(Surface* surface)
 
 	if (bShouldLookupTexture == false)
 	{
-		surface->lightmapNum = -1;
+		for (Surface* s = surface; s; s = s->nextChartMember)
+			s->lightmapNum = -1;
 	}
 	else
 	{
 		int x = 0, y = 0;
-		surface->lightmapNum = AllocTextureRoom(sampleWidth + 2, sampleHeight + 2, &x, &y);
+		bool rotated = false;
+		surface->lightmapNum = AllocTextureRoom(sampleWidth + 2, sampleHeight + 2, &x, &y, &rotated);
 		x++;
 		y++;
 
 		uint16_t* currentTexture = textures[surface->lightmapNum]->Pixels();
 
-		// calculate final texture coordinates
-		for (int i = 0; i < surface->numVerts; i++)
+		// calculate final texture coordinates. A rotated block is stored
+		// transposed, sample rows becoming texture columns.
+		for (Surface* s = surface; s; s = s->nextChartMember)
 		{
-			auto& u = surface->lightmapCoords[i].x;
-			auto& v = surface->lightmapCoords[i].y;
-			u = (u + x) / (float)textureWidth;
-			v = (v + y) / (float)textureHeight;
-		}
+			vec2* lightmapCoords = GetLightmapCoords(s);
+			for (int i = 0; i < s->numVerts; i++)
+			{
+				auto& u = lightmapCoords[i].x;
+				auto& v = lightmapCoords[i].y;
+				if (rotated)
+					std::swap(u, v);
+				u = (u + x) / (float)textureWidth;
+				v = (v + y) / (float)textureHeight;
+			}
 
-		surface->lightmapOffs[0] = x;
-		surface->lightmapOffs[1] = y;
+			s->lightmapNum = surface->lightmapNum;
+			s->lightmapOffs[0] = x;
+			s->lightmapOffs[1] = y;
+		}
 
-#if 1
-		// store results to lightmap texture
-		float weights[9] = { 0.125f, 0.25f, 0.125f, 0.25f, 0.50f, 0.25f, 0.125f, 0.25f, 0.125f };
-		for (int y = 0; y < sampleHeight; y++)
+		if (!rotated)
 		{
-			vec3* src = &colorSamples[y * sampleWidth];
-			for (int x = 0; x < sampleWidth; x++)
+			// store results to lightmap texture, a row at a time
+			for (int y = 0; y < sampleHeight; y++)
 			{
-				// gaussian blur with a 3x3 kernel
-				vec3 color = { 0.0f };
-				for (int yy = -1; yy <= 1; yy++)
-				{
-					int yyy = clamp(y + yy, 0, sampleHeight - 1) - y;
-					for (int xx = -1; xx <= 1; xx++)
-					{
-						int xxx = clamp(x + xx, 0, sampleWidth - 1);
-						color += src[yyy * sampleWidth + xxx] * weights[4 + xx + yy * 3];
-					}
-				}
-				color *= 0.5f;
-
-				// get texture offset
 				int offs = ((textureWidth * (y + surface->lightmapOffs[1])) + surface->lightmapOffs[0]) * 3;
-
-				// convert RGB to bytes
-				currentTexture[offs + x * 3 + 0] = floatToHalf(clamp(colorSamples[y * sampleWidth + x].x, -65000.0f, 65000.0f));
-				currentTexture[offs + x * 3 + 1] = floatToHalf(clamp(colorSamples[y * sampleWidth + x].y, -65000.0f, 65000.0f));
-				currentTexture[offs + x * 3 + 2] = floatToHalf(clamp(colorSamples[y * sampleWidth + x].z, -65000.0f, 65000.0f));
+				floatToHalfArray(&colorSamples[y * sampleWidth].x, currentTexture + offs, sampleWidth * 3, -65000.0f, 65000.0f);
 			}
 		}
-#else
-		// store results to lightmap texture
-		for (int i = 0; i < sampleHeight; i++)
+		else
 		{
-			for (int j = 0; j < sampleWidth; j++)
+			std::vector<vec3> column(sampleHeight);
+			for (int x = 0; x < sampleWidth; x++)
 			{
-				// get texture offset
-				int offs = ((textureWidth * (i + surface->lightmapOffs[1])) + surface->lightmapOffs[0]) * 3;
+				for (int y = 0; y < sampleHeight; y++)
+					column[y] = colorSamples[y * sampleWidth + x];
 
-				// convert RGB to bytes
-				currentTexture[offs + j * 3 + 0] = floatToHalf(clamp(colorSamples[i * sampleWidth + j].x, -65000.0f, 65000.0f));
-				currentTexture[offs + j * 3 + 1] = floatToHalf(clamp(colorSamples[i * sampleWidth + j].y, -65000.0f, 65000.0f));
-				currentTexture[offs + j * 3 + 2] = floatToHalf(clamp(colorSamples[i * sampleWidth + j].z, -65000.0f, 65000.0f));
+				int offs = ((textureWidth * (x + surface->lightmapOffs[1])) + surface->lightmapOffs[0]) * 3;
+				floatToHalfArray(&column[0].x, currentTexture + offs, sampleHeight * 3, -65000.0f, 65000.0f);
 			}
 		}
-#endif
 	}
 }
 
-int LevelMesh::AllocTextureRoom(int width, int height, int* x, int* y)
+int LevelMesh::AllocTextureRoom(int width, int height, int* x, int* y, bool* rotated)
 {
 	int numTextures = textures.size();
 
 	int k;
 	for (k = 0; k < numTextures; ++k)
 	{
-		if (textures[k]->MakeRoomForBlock(width, height, x, y))
+		if (textures[k]->MakeRoomForBlock(width, height, LightmapRotation, x, y, rotated))
 		{
 			break;
 		}
@@ -408,7 +556,7 @@ int LevelMesh::AllocTextureRoom(int width, int height, int* x, int* y)
 	if (k == numTextures)
 	{
 		textures.push_back(std::make_unique<LightmapTexture>(textureWidth, textureHeight));
-		if (!textures[k]->MakeRoomForBlock(width, height, x, y))
+		if (!textures[k]->MakeRoomForBlock(width, height, LightmapRotation, x, y, rotated))
 		{
 			throw std::runtime_error("Lightmap allocation failed");
 		}
@@ -470,7 +618,7 @@ void LevelMesh::CreateLightProbes(FLevel& map)
 	}
 }
 
-void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side)
+void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side, SurfaceList &output)
 {
 	IntSector *front;
 	IntSector *back;
@@ -523,38 +671,35 @@ void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side)
 
 			IntSideDef* otherSide = &doomMap.Sides[side->line->sidenum[0]] == side ? &doomMap.Sides[side->line->sidenum[1]] : &doomMap.Sides[side->line->sidenum[0]];
 
-			auto surf = std::make_unique<Surface>();
-			surf->material = "texture";
+			Surface* surf = output.Add(4);
+			vec3* verts = &output.verts[surf->firstVert];
+			vec2* uvs = &output.texCoords[surf->firstVert];
+			surf->material = output.AddMaterial("texture");
 			surf->type = ST_MIDDLESIDE;
 			surf->typeIndex = typeIndex;
 			surf->controlSector = xfloor;
 			surf->sampleDimension = (surf->sampleDimension = otherSide->GetSampleDistanceMiddle()) ? surf->sampleDimension : defaultSamples;
-			surf->numVerts = 4;
-			surf->verts.resize(4);
-			surf->verts[0].x = surf->verts[2].x = v2.x;
-			surf->verts[0].y = surf->verts[2].y = v2.y;
-			surf->verts[1].x = surf->verts[3].x = v1.x;
-			surf->verts[1].y = surf->verts[3].y = v1.y;
-			surf->verts[0].z = xfloor->floorplane.zAt(v2.x, v2.y);
-			surf->verts[1].z = xfloor->floorplane.zAt(v1.x, v1.y);
-			surf->verts[2].z = xfloor->ceilingplane.zAt(v2.x, v2.y);
-			surf->verts[3].z = xfloor->ceilingplane.zAt(v1.x, v1.y);
-			surf->plane.SetNormal(surf->verts[0], surf->verts[1], surf->verts[2]);
-			surf->plane.SetDistance(surf->verts[0]);
-
-			float texZ = surf->verts[0].z;
-
-			surf->uvs.resize(4);
-			surf->uvs[0].x = 0.0f;
-			surf->uvs[1].x = distance / texWidth;
-			surf->uvs[2].x = 0.0f;
-			surf->uvs[3].x = distance / texWidth;
-			surf->uvs[0].y = (surf->verts[0].z - texZ) / texHeight;
-			surf->uvs[1].y = (surf->verts[1].z - texZ) / texHeight;
-			surf->uvs[2].y = (surf->verts[2].z - texZ) / texHeight;
-			surf->uvs[3].y = (surf->verts[3].z - texZ) / texHeight;
-
-			surfaces.push_back(std::move(surf));
+			verts[0].x = verts[2].x = v2.x;
+			verts[0].y = verts[2].y = v2.y;
+			verts[1].x = verts[3].x = v1.x;
+			verts[1].y = verts[3].y = v1.y;
+			verts[0].z = xfloor->floorplane.zAt(v2.x, v2.y);
+			verts[1].z = xfloor->floorplane.zAt(v1.x, v1.y);
+			verts[2].z = xfloor->ceilingplane.zAt(v2.x, v2.y);
+			verts[3].z = xfloor->ceilingplane.zAt(v1.x, v1.y);
+			surf->plane.SetNormal(verts[0], verts[1], verts[2]);
+			surf->plane.SetDistance(verts[0]);
+
+			float texZ = verts[0].z;
+
+			uvs[0].x = 0.0f;
+			uvs[1].x = distance / texWidth;
+			uvs[2].x = 0.0f;
+			uvs[3].x = distance / texWidth;
+			uvs[0].y = (verts[0].z - texZ) / texHeight;
+			uvs[1].y = (verts[1].z - texZ) / texHeight;
+			uvs[2].y = (verts[2].z - texZ) / texHeight;
+			uvs[3].y = (verts[3].z - texZ) / texHeight;
 		}
 
 		float v1TopBack = back->ceilingplane.zAt(v1.x, v1.y);
@@ -575,40 +720,37 @@ void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side)
 				float texWidth = 128.0f;
 				float texHeight = 128.0f;
 
-				auto surf = std::make_unique<Surface>();
-				surf->material = side->bottomtexture;
-				surf->numVerts = 4;
-				surf->verts.resize(4);
-
-				surf->verts[0].x = surf->verts[2].x = v1.x;
-				surf->verts[0].y = surf->verts[2].y = v1.y;
-				surf->verts[1].x = surf->verts[3].x = v2.x;
-				surf->verts[1].y = surf->verts[3].y = v2.y;
-				surf->verts[0].z = v1Bottom;
-				surf->verts[1].z = v2Bottom;
-				surf->verts[2].z = v1BottomBack;
-				surf->verts[3].z = v2BottomBack;
-
-				surf->plane.SetNormal(surf->verts[0], surf->verts[1], surf->verts[2]);
-				surf->plane.SetDistance(surf->verts[0]);
+				Surface* surf = output.Add(4);
+				vec3* verts = &output.verts[surf->firstVert];
+				vec2* uvs = &output.texCoords[surf->firstVert];
+				surf->material = output.AddMaterial(side->bottomtexture);
+
+				verts[0].x = verts[2].x = v1.x;
+				verts[0].y = verts[2].y = v1.y;
+				verts[1].x = verts[3].x = v2.x;
+				verts[1].y = verts[3].y = v2.y;
+				verts[0].z = v1Bottom;
+				verts[1].z = v2Bottom;
+				verts[2].z = v1BottomBack;
+				verts[3].z = v2BottomBack;
+
+				surf->plane.SetNormal(verts[0], verts[1], verts[2]);
+				surf->plane.SetDistance(verts[0]);
 				surf->type = ST_LOWERSIDE;
 				surf->typeIndex = typeIndex;
 				surf->controlSector = nullptr;
 				surf->sampleDimension = (surf->sampleDimension = side->GetSampleDistanceBottom()) ? surf->sampleDimension : defaultSamples;
 
-				float texZ = surf->verts[0].z;
+				float texZ = verts[0].z;
 
-				surf->uvs.resize(4);
-				surf->uvs[0].x = 0.0f;
-				surf->uvs[1].x = distance / texWidth;
-				surf->uvs[2].x = 0.0f;
-				surf->uvs[3].x = distance / texWidth;
-				surf->uvs[0].y = (surf->verts[0].z - texZ) / texHeight;
-				surf->uvs[1].y = (surf->verts[1].z - texZ) / texHeight;
-				surf->uvs[2].y = (surf->verts[2].z - texZ) / texHeight;
-				surf->uvs[3].y = (surf->verts[3].z - texZ) / texHeight;
-
-				surfaces.push_back(std::move(surf));
+				uvs[0].x = 0.0f;
+				uvs[1].x = distance / texWidth;
+				uvs[2].x = 0.0f;
+				uvs[3].x = distance / texWidth;
+				uvs[0].y = (verts[0].z - texZ) / texHeight;
+				uvs[1].y = (verts[1].z - texZ) / texHeight;
+				uvs[2].y = (verts[2].z - texZ) / texHeight;
+				uvs[3].y = (verts[3].z - texZ) / texHeight;
 			}
 
 			v1Bottom = v1BottomBack;
@@ -633,41 +775,38 @@ void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side)
 				float texWidth = 128.0f;
 				float texHeight = 128.0f;
 
-				auto surf = std::make_unique<Surface>();
-				surf->material = side->toptexture;
-				surf->numVerts = 4;
-				surf->verts.resize(4);
-
-				surf->verts[0].x = surf->verts[2].x = v1.x;
-				surf->verts[0].y = surf->verts[2].y = v1.y;
-				surf->verts[1].x = surf->verts[3].x = v2.x;
-				surf->verts[1].y = surf->verts[3].y = v2.y;
-				surf->verts[0].z = v1TopBack;
-				surf->verts[1].z = v2TopBack;
-				surf->verts[2].z = v1Top;
-				surf->verts[3].z = v2Top;
-
-				surf->plane.SetNormal(surf->verts[0], surf->verts[1], surf->verts[2]);
-				surf->plane.SetDistance(surf->verts[0]);
+				Surface* surf = output.Add(4);
+				vec3* verts = &output.verts[surf->firstVert];
+				vec2* uvs = &output.texCoords[surf->firstVert];
+				surf->material = output.AddMaterial(side->toptexture);
+
+				verts[0].x = verts[2].x = v1.x;
+				verts[0].y = verts[2].y = v1.y;
+				verts[1].x = verts[3].x = v2.x;
+				verts[1].y = verts[3].y = v2.y;
+				verts[0].z = v1TopBack;
+				verts[1].z = v2TopBack;
+				verts[2].z = v1Top;
+				verts[3].z = v2Top;
+
+				surf->plane.SetNormal(verts[0], verts[1], verts[2]);
+				surf->plane.SetDistance(verts[0]);
 				surf->type = ST_UPPERSIDE;
 				surf->typeIndex = typeIndex;
 				surf->bSky = bSky;
 				surf->controlSector = nullptr;
 				surf->sampleDimension = (surf->sampleDimension = side->GetSampleDistanceTop()) ? surf->sampleDimension : defaultSamples;
 
-				float texZ = surf->verts[0].z;
-
-				surf->uvs.resize(4);
-				surf->uvs[0].x = 0.0f;
-				surf->uvs[1].x = distance / texWidth;
-				surf->uvs[2].x = 0.0f;
-				surf->uvs[3].x = distance / texWidth;
-				surf->uvs[0].y = (surf->verts[0].z - texZ) / texHeight;
-				surf->uvs[1].y = (surf->verts[1].z - texZ) / texHeight;
-				surf->uvs[2].y = (surf->verts[2].z - texZ) / texHeight;
-				surf->uvs[3].y = (surf->verts[3].z - texZ) / texHeight;
+				float texZ = verts[0].z;
 
-				surfaces.push_back(std::move(surf));
+				uvs[0].x = 0.0f;
+				uvs[1].x = distance / texWidth;
+				uvs[2].x = 0.0f;
+				uvs[3].x = distance / texWidth;
+				uvs[0].y = (verts[0].z - texZ) / texHeight;
+				uvs[1].y = (verts[1].z - texZ) / texHeight;
+				uvs[2].y = (verts[2].z - texZ) / texHeight;
+				uvs[3].y = (verts[3].z - texZ) / texHeight;
 			}
 
 			v1Top = v1TopBack;
@@ -681,51 +820,47 @@ void LevelMesh::CreateSideSurfaces(FLevel &doomMap, IntSideDef *side)
 		float texWidth = 128.0f;
 		float texHeight = 128.0f;
 
-		auto surf = std::make_unique<Surface>();
-		surf->material = side->midtexture;
-		surf->numVerts = 4;
-		surf->verts.resize(4);
-
-		surf->verts[0].x = surf->verts[2].x = v1.x;
-		surf->verts[0].y = surf->verts[2].y = v1.y;
-		surf->verts[1].x = surf->verts[3].x = v2.x;
-		surf->verts[1].y = surf->verts[3].y = v2.y;
-		surf->verts[0].z = v1Bottom;
-		surf->verts[1].z = v2Bottom;
-		surf->verts[2].z = v1Top;
-		surf->verts[3].z = v2Top;
-
-		surf->plane.SetNormal(surf->verts[0], surf->verts[1], surf->verts[2]);
-		surf->plane.SetDistance(surf->verts[0]);
+		Surface* surf = output.Add(4);
+		vec3* verts = &output.verts[surf->firstVert];
+		vec2* uvs = &output.texCoords[surf->firstVert];
+		surf->material = output.AddMaterial(side->midtexture);
+
+		verts[0].x = verts[2].x = v1.x;
+		verts[0].y = verts[2].y = v1.y;
+		verts[1].x = verts[3].x = v2.x;
+		verts[1].y = verts[3].y = v2.y;
+		verts[0].z = v1Bottom;
+		verts[1].z = v2Bottom;
+		verts[2].z = v1Top;
+		verts[3].z = v2Top;
+
+		surf->plane.SetNormal(verts[0], verts[1], verts[2]);
+		surf->plane.SetDistance(verts[0]);
 		surf->type = ST_MIDDLESIDE;
 		surf->typeIndex = typeIndex;
 		surf->controlSector = nullptr;
 		surf->sampleDimension = (surf->sampleDimension = side->GetSampleDistanceMiddle()) ? surf->sampleDimension : defaultSamples;
 
-		float texZ = surf->verts[0].z;
+		float texZ = verts[0].z;
 
-		surf->uvs.resize(4);
-		surf->uvs[0].x = 0.0f;
-		surf->uvs[1].x = distance / texWidth;
-		surf->uvs[2].x = 0.0f;
-		surf->uvs[3].x = distance / texWidth;
-		surf->uvs[0].y = (surf->verts[0].z - texZ) / texHeight;
-		surf->uvs[1].y = (surf->verts[1].z - texZ) / texHeight;
-		surf->uvs[2].y = (surf->verts[2].z - texZ) / texHeight;
-		surf->uvs[3].y = (surf->verts[3].z - texZ) / texHeight;
-
-		surfaces.push_back(std::move(surf));
+		uvs[0].x = 0.0f;
+		uvs[1].x = distance / texWidth;
+		uvs[2].x = 0.0f;
+		uvs[3].x = distance / texWidth;
+		uvs[0].y = (verts[0].z - texZ) / texHeight;
+		uvs[1].y = (verts[1].z - texZ) / texHeight;
+		uvs[2].y = (verts[2].z - texZ) / texHeight;
+		uvs[3].y = (verts[3].z - texZ) / texHeight;
 	}
 }
 
-void LevelMesh::CreateFloorSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor)
+void LevelMesh::CreateFloorSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor, SurfaceList &output)
 {
-	auto surf = std::make_unique<Surface>();
+	Surface* surf = output.Add(sub->numlines);
+	vec3* verts = &output.verts[surf->firstVert];
+	vec2* uvs = &output.texCoords[surf->firstVert];
 	surf->sampleDimension = sector->sampleDistanceFloor ? sector->sampleDistanceFloor : defaultSamples;
-	surf->material = sector->data.floorpic;
-	surf->numVerts = sub->numlines;
-	surf->verts.resize(surf->numVerts);
-	surf->uvs.resize(surf->numVerts);
+	surf->material = output.AddMaterial(sector->data.floorpic);
 
 	if (!is3DFloor)
 	{
@@ -741,29 +876,26 @@ void LevelMesh::CreateFloorSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSect
 		MapSegGLEx *seg = &doomMap.GLSegs[sub->firstline + (surf->numVerts - 1) - j];
 		FloatVertex v1 = doomMap.GetSegVertex(seg->v1);
 
-		surf->verts[j].x = v1.x;
-		surf->verts[j].y = v1.y;
-		surf->verts[j].z = surf->plane.zAt(surf->verts[j].x, surf->verts[j].y);
+		verts[j].x = v1.x;
+		verts[j].y = v1.y;
+		verts[j].z = surf->plane.zAt(verts[j].x, verts[j].y);
 
-		surf->uvs[j].x = v1.x / 64.0f;
-		surf->uvs[j].y = v1.y / 64.0f;
+		uvs[j].x = v1.x / 64.0f;
+		uvs[j].y = v1.y / 64.0f;
 	}
 
 	surf->type = ST_FLOOR;
 	surf->typeIndex = typeIndex;
 	surf->controlSector = is3DFloor ? sector : nullptr;
-
-	surfaces.push_back(std::move(surf));
 }
 
-void LevelMesh::CreateCeilingSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor)
+void LevelMesh::CreateCeilingSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor, SurfaceList &output)
 {
-	auto surf = std::make_unique<Surface>();
-	surf->material = sector->data.ceilingpic;
+	Surface* surf = output.Add(sub->numlines);
+	vec3* verts = &output.verts[surf->firstVert];
+	vec2* uvs = &output.texCoords[surf->firstVert];
+	surf->material = output.AddMaterial(sector->data.ceilingpic);
 	surf->sampleDimension = sector->sampleDistanceCeiling ? sector->sampleDistanceCeiling : defaultSamples;
-	surf->numVerts = sub->numlines;
-	surf->verts.resize(surf->numVerts);
-	surf->uvs.resize(surf->numVerts);
 	surf->bSky = sector->skySector;
 
 	if (!is3DFloor)
@@ -780,51 +912,392 @@ void LevelMesh::CreateCeilingSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSe
 		MapSegGLEx *seg = &doomMap.GLSegs[sub->firstline + j];
 		FloatVertex v1 = doomMap.GetSegVertex(seg->v1);
 
-		surf->verts[j].x = v1.x;
-		surf->verts[j].y = v1.y;
-		surf->verts[j].z = surf->plane.zAt(surf->verts[j].x, surf->verts[j].y);
+		verts[j].x = v1.x;
+		verts[j].y = v1.y;
+		verts[j].z = surf->plane.zAt(verts[j].x, verts[j].y);
 
-		surf->uvs[j].x = v1.x / 64.0f;
-		surf->uvs[j].y = v1.y / 64.0f;
+		uvs[j].x = v1.x / 64.0f;
+		uvs[j].y = v1.y / 64.0f;
 	}
 
 	surf->type = ST_CEILING;
 	surf->typeIndex = typeIndex;
 	surf->controlSector = is3DFloor ? sector : nullptr;
-
-	surfaces.push_back(std::move(surf));
 }
 
 void LevelMesh::CreateSubsectorSurfaces(FLevel &doomMap)
 {
 	printf("\n------------- Building subsector surfaces -------------\n");
 
-	for (int i = 0; i < doomMap.NumGLSubsectors; i++)
-	{
-		printf("Subsectors: %i / %i\r", i + 1, doomMap.NumGLSubsectors);
-
+	std::vector<SurfaceList> subsectorSurfaces(doomMap.NumGLSubsectors);
+	ParallelFor(subsectorSurfaces.size(), [&](size_t i) {
 		MapSubsectorEx *sub = &doomMap.GLSubsectors[i];
 
 		if (sub->numlines < 3)
 		{
-			continue;
+			return;
 		}
 
 		IntSector *sector = doomMap.GetSectorFromSubSector(sub);
 		if (!sector || sector->controlsector)
-			continue;
+			return;
 
-		CreateFloorSurface(doomMap, sub, sector, i, false);
-		CreateCeilingSurface(doomMap, sub, sector, i, false);
+		SurfaceList &output = subsectorSurfaces[i];
+		CreateFloorSurface(doomMap, sub, sector, (int)i, false, output);
+		CreateCeilingSurface(doomMap, sub, sector, (int)i, false, output);
 
 		for (unsigned int j = 0; j < sector->x3dfloors.Size(); j++)
 		{
-			CreateFloorSurface(doomMap, sub, sector->x3dfloors[j], i, true);
-			CreateCeilingSurface(doomMap, sub, sector->x3dfloors[j], i, true);
+			CreateFloorSurface(doomMap, sub, sector->x3dfloors[j], (int)i, true, output);
+			CreateCeilingSurface(doomMap, sub, sector->x3dfloors[j], (int)i, true, output);
 		}
+	});
+	AppendSurfaces(subsectorSurfaces);
+
+	printf("Leaf surfaces: %i\n", (int)surfaces.size() - doomMap.NumGLSubsectors);
+}
+
+Surface* LevelMesh::SurfaceList::Add(int numVerts)
+{
+	surfaces.push_back(Surface());
+	Surface* surf = &surfaces.back();
+	surf->numVerts = numVerts;
+	surf->firstVert = (int)verts.size();
+	verts.resize(verts.size() + numVerts);
+	texCoords.resize(texCoords.size() + numVerts);
+	return surf;
+}
+
+// Moves the per item surface lists into surfaces and their vertices into the
+// mesh arrays. The lists are concatenated in item order, so the result is the
+// same as creating them one at a time.
+void LevelMesh::AppendSurfaces(std::vector<SurfaceList> &lists)
+{
+	std::vector<size_t> start(lists.size() + 1);
+	std::vector<size_t> startVert(lists.size() + 1);
+	start[0] = surfaces.size();
+	startVert[0] = MeshVertices.Size();
+	for (size_t i = 0; i < lists.size(); i++)
+	{
+		start[i + 1] = start[i] + lists[i].surfaces.size();
+		startVert[i + 1] = startVert[i] + lists[i].verts.size();
 	}
 
-	printf("\nLeaf surfaces: %i\n", (int)surfaces.size() - doomMap.NumGLSubsectors);
+	// Materials are few, so they are interned on one thread
+	std::map<std::string, int> materialIndex;
+	for (size_t i = 0; i < Materials.size(); i++)
+		materialIndex[Materials[i]] = (int)i;
+
+	std::vector<std::vector<int>> listMaterials(lists.size());
+	for (size_t i = 0; i < lists.size(); i++)
+	{
+		for (const char* name : lists[i].materials)
+		{
+			auto it = materialIndex.find(name);
+			if (it == materialIndex.end())
+			{
+				it = materialIndex.insert(std::make_pair(std::string(name), (int)Materials.size())).first;
+				Materials.push_back(name);
+			}
+			listMaterials[i].push_back(it->second);
+		}
+	}
+
+	surfaces.resize(start.back());
+	MeshVertices.Resize(startVert.back());
+	MeshTexCoords.resize(startVert.back());
+	ParallelFor(lists.size(), [&](size_t i) {
+		SurfaceList& list = lists[i];
+		for (size_t j = 0; j < list.surfaces.size(); j++)
+		{
+			Surface& surf = surfaces[start[i] + j];
+			surf = list.surfaces[j];
+			surf.firstVert += (int)startVert[i];
+			surf.material = listMaterials[i][surf.material];
+		}
+		std::copy(list.verts.begin(), list.verts.end(), &MeshVertices[startVert[i]]);
+		std::copy(list.texCoords.begin(), list.texCoords.end(), MeshTexCoords.begin() + startVert[i]);
+		list = SurfaceList();
+	});
+}
+
+// Builds the triangle list of the mesh. The first pass counts the
+// non-degenerate triangles of each surface and the second one fills them in
+// at the offsets given by the running totals.
+void LevelMesh::BuildMeshArrays()
+{
+	size_t count = surfaces.size();
+	std::vector<unsigned int> firstTriangle(count + 1);
+
+	ParallelFor(count, [&](size_t i) {
+		firstTriangle[i + 1] = GetSurfaceTriangles(&surfaces[i], nullptr);
+	});
+
+	for (size_t i = 0; i < count; i++)
+		firstTriangle[i + 1] += firstTriangle[i];
+
+	MeshUVIndex.Resize(MeshVertices.Size());
+	MeshLightmapCoords.resize(MeshVertices.Size());
+	MeshElements.Resize(firstTriangle[count] * 3);
+	MeshSurfaces.Resize(firstTriangle[count]);
+
+	ParallelFor(count, [&](size_t i) {
+		const Surface *s = &surfaces[i];
+		for (int j = 0; j < s->numVerts; j++)
+			MeshUVIndex[s->firstVert + j] = j;
+
+		unsigned int tri = firstTriangle[i];
+		int numTris = GetSurfaceTriangles(s, &MeshElements[tri * 3]);
+		for (int j = 0; j < numTris; j++)
+			MeshSurfaces[tri + j] = (int)i;
+	});
+}
+
+// Writes the non-degenerate triangles of a surface to elements and returns
+// how many there are. With a null elements pointer the triangles are only
+// counted.
+int LevelMesh::GetSurfaceTriangles(const Surface *s, unsigned int *elements) const
+{
+	const vec3* verts = GetVerts(s);
+	unsigned int pos = s->firstVert;
+	int count = 0;
+	auto addTriangle = [&](int a, int b, int c) {
+		if (elements)
+		{
+			elements[count * 3 + 0] = pos + a;
+			elements[count * 3 + 1] = pos + b;
+			elements[count * 3 + 2] = pos + c;
+		}
+		count++;
+	};
+
+	if (s->type == ST_FLOOR || s->type == ST_CEILING)
+	{
+		for (int j = 2; j < s->numVerts; j++)
+		{
+			if (!IsDegenerate(verts[0], verts[j - 1], verts[j]))
+				addTriangle(0, j - 1, j);
+		}
+	}
+	else if (s->type == ST_MIDDLESIDE || s->type == ST_UPPERSIDE || s->type == ST_LOWERSIDE)
+	{
+		if (!IsDegenerate(verts[0], verts[1], verts[2]))
+			addTriangle(0, 1, 2);
+		if (!IsDegenerate(verts[1], verts[2], verts[3]))
+			addTriangle(3, 2, 1);
+	}
+	return count;
+}
+
+// Merges neighbouring flats of the same sector and plane into shared
+// lightmap charts. The first surface of a chart owns its samples and the
+// others only map their vertices into it. A flat joins a chart only if the
+// chart then needs no more texels than the surfaces did on their own, which
+// keeps L-shaped rooms and the like from wasting page space. Charts are
+// kept to half a page so they still pack well.
+void LevelMesh::MergeCharts(FLevel &doomMap)
+{
+	std::vector<int> flats;
+	std::vector<IntSector*> flatSectors(surfaces.size());
+	for (size_t i = 0; i < surfaces.size(); i++)
+	{
+		const Surface* s = &surfaces[i];
+		if (s->type == ST_FLOOR || s->type == ST_CEILING)
+		{
+			flats.push_back((int)i);
+			flatSectors[i] = doomMap.GetSectorFromSubSector(&doomMap.GLSubsectors[s->typeIndex]);
+		}
+	}
+
+	auto canShareChart = [&](int a, int b) {
+		const Surface* sa = &surfaces[a];
+		const Surface* sb = &surfaces[b];
+		return sa->type == sb->type && flatSectors[a] == flatSectors[b] && sa->controlSector == sb->controlSector &&
+			sa->sampleDimension == sb->sampleDimension && sa->bSky == sb->bSky &&
+			sa->plane.a == sb->plane.a && sa->plane.b == sb->plane.b && sa->plane.c == sb->plane.c && sa->plane.d == sb->plane.d;
+	};
+
+	// Flats are neighbours when their subsectors share a seg. GL segs come in
+	// pairs along both sides of a line or partition, so the partner of each
+	// seg leads straight to the subsector on the other side.
+	std::vector<std::vector<int>> subsectorFlats(doomMap.NumGLSubsectors);
+	for (int i : flats)
+		subsectorFlats[surfaces[i].typeIndex].push_back(i);
+
+	std::vector<int> segSubsectors(doomMap.NumGLSegs, -1);
+	for (int i = 0; i < doomMap.NumGLSubsectors; i++)
+	{
+		const MapSubsectorEx& sub = doomMap.GLSubsectors[i];
+		for (uint32_t j = 0; j < sub.numlines; j++)
+			segSubsectors[sub.firstline + j] = i;
+	}
+
+	std::vector<std::vector<int>> neighbours(surfaces.size());
+	ParallelFor(flats.size(), [&](size_t k) {
+		int i = flats[k];
+		const MapSubsectorEx& sub = doomMap.GLSubsectors[surfaces[i].typeIndex];
+		std::vector<int>& list = neighbours[i];
+		for (uint32_t j = 0; j < sub.numlines; j++)
+		{
+			uint32_t partner = doomMap.GLSegs[sub.firstline + j].partner;
+			if (partner == NO_INDEX || partner >= (uint32_t)doomMap.NumGLSegs || segSubsectors[partner] < 0)
+				continue;
+
+			for (int n : subsectorFlats[segSubsectors[partner]])
+			{
+				if (n != i && canShareChart(i, n))
+					list.push_back(n);
+			}
+		}
+
+		// Neighbours are visited in surface order when charts are grown
+		std::sort(list.begin(), list.end());
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+	});
+
+	std::vector<bool> assigned(surfaces.size());
+	std::vector<Surface*> owners;
+	int mergedFlats = 0;
+
+	for (int first : flats)
+	{
+		if (assigned[first])
+			continue;
+		assigned[first] = true;
+
+		Surface* owner = &surfaces[first];
+		BBox bounds = GetBoundsFromSurface(owner);
+		int separateArea = owner->lightmapDims[0] * owner->lightmapDims[1];
+
+		// Grow the chart across shared edges, breadth first
+		std::vector<int> chart = { first };
+		for (size_t k = 0; k < chart.size(); k++)
+		{
+			for (int n : neighbours[chart[k]])
+			{
+				if (assigned[n])
+					continue;
+
+				Surface* candidate = &surfaces[n];
+				const vec3* verts = GetVerts(candidate);
+				BBox merged = bounds;
+				for (int v = 0; v < candidate->numVerts; v++)
+					merged.AddPoint(verts[v]);
+
+				int width, height;
+				GetChartSize(owner->plane, merged, owner->sampleDimension, width, height);
+				int area = separateArea + candidate->lightmapDims[0] * candidate->lightmapDims[1];
+				if (width > textureWidth / 2 || height > textureHeight / 2 || width * height > area)
+					continue;
+
+				assigned[n] = true;
+				chart.push_back(n);
+				bounds = merged;
+				separateArea = area;
+			}
+		}
+
+		if (chart.size() > 1)
+		{
+			for (size_t k = chart.size() - 1; k > 0; k--)
+			{
+				Surface* member = &surfaces[chart[k]];
+				member->chartOwner = owner;
+				member->nextChartMember = owner->nextChartMember;
+				owner->nextChartMember = member;
+			}
+			owners.push_back(owner);
+			mergedFlats += (int)chart.size();
+		}
+	}
+
+	ParallelFor(owners.size(), [&](size_t i) {
+		BuildSurfaceParams(owners[i]);
+		for (Surface* member = owners[i]->nextChartMember; member; member = member->nextChartMember)
+		{
+			member->lightmapDims[0] = 0;
+			member->lightmapDims[1] = 0;
+		}
+	});
+
+	printf("Merged %d flats into %d lightmap charts\n", mergedFlats, (int)owners.size());
+}
+
+// Gives every surface its range of Samples and allocates them all at once.
+// Ranges follow the order CreateTextures places surfaces in, so the buffer
+// is consumed front to back and can be released as it goes.
+void LevelMesh::AllocSamples()
+{
+	size_t count = 0;
+	for (Surface* surface : GetPackingOrder())
+	{
+		surface->firstSample = (int)count;
+		count += (size_t)surface->lightmapDims[0] * surface->lightmapDims[1];
+	}
+	Samples.Allocate(count, SampleFormat);
+
+	printf("Lightmap samples: %d (%.1f MB)\n", (int)count, Samples.BytesAllocated() / (1024.0 * 1024.0));
+}
+
+void LevelMesh::BuildTraceTable(FLevel &doomMap)
+{
+	size_t count = surfaces.size();
+	TraceInfo.Normals.resize(count);
+	TraceInfo.SampleDistances.resize(count);
+	TraceInfo.Sky.resize(count);
+	TraceInfo.LightDefs.resize(count);
+
+	ParallelFor(count, [&](size_t i) {
+		const Surface& surface = surfaces[i];
+
+		int lightdef = -1;
+		if (surface.type >= ST_MIDDLESIDE && surface.type <= ST_LOWERSIDE)
+		{
+			lightdef = doomMap.Sides[surface.typeIndex].lightdef;
+		}
+		else if (surface.type == ST_FLOOR || surface.type == ST_CEILING)
+		{
+			MapSubsectorEx* sub = &doomMap.GLSubsectors[surface.typeIndex];
+			IntSector* sector = doomMap.GetSectorFromSubSector(sub);
+
+			if (sector && surface.numVerts > 0)
+			{
+				if (sector->floorlightdef != -1 && surface.type == ST_FLOOR)
+				{
+					lightdef = sector->floorlightdef;
+				}
+				else if (sector->ceilinglightdef != -1 && surface.type == ST_CEILING)
+				{
+					lightdef = sector->ceilinglightdef;
+				}
+			}
+		}
+
+		TraceInfo.Normals[i] = surface.plane.Normal();
+		TraceInfo.SampleDistances[i] = (float)surface.sampleDimension;
+		TraceInfo.Sky[i] = surface.bSky ? 1 : 0;
+		TraceInfo.LightDefs[i] = lightdef;
+	});
+}
+
+// Size in samples of the lightmap block BuildSurfaceParams would make for
+// the bounds, before clamping to the page size.
+void LevelMesh::GetChartSize(const Plane& plane, const BBox& bounds, int sampleDimension, int& width, int& height)
+{
+	vec3 roundedSize;
+	for (int i = 0; i < 3; i++)
+	{
+		float lo = sampleDimension * (Math::Floor(bounds.min[i] / sampleDimension) - 1);
+		float hi = sampleDimension * (Math::Ceil(bounds.max[i] / sampleDimension) + 1);
+		roundedSize[i] = (hi - lo) / sampleDimension;
+	}
+
+	switch (plane.BestAxis())
+	{
+	case Plane::AXIS_YZ: width = (int)roundedSize.y; height = (int)roundedSize.z; break;
+	case Plane::AXIS_XZ: width = (int)roundedSize.x; height = (int)roundedSize.z; break;
+	default: width = (int)roundedSize.x; height = (int)roundedSize.y; break;
+	}
 }
 
 bool LevelMesh::IsDegenerate(const vec3 &v0, const vec3 &v1, const vec3 &v2)
@@ -845,278 +1318,131 @@ bool LevelMesh::IsDegenerate(const vec3 &v0, const vec3 &v1, const vec3 &v2)
 
 void LevelMesh::AddLightmapLump(FWadWriter& wadFile)
 {
-	// Calculate size of lump
 	int numTexCoords = 0;
 	int numSurfaces = 0;
 	for (size_t i = 0; i < surfaces.size(); i++)
 	{
-		if (surfaces[i]->lightmapNum != -1)
+		if (surfaces[i].lightmapNum != -1)
 		{
-			numTexCoords += surfaces[i]->numVerts;
+			numTexCoords += surfaces[i].numVerts;
 			numSurfaces++;
 		}
 	}
 
-	int version = 0;
-	int headerSize = 5 * sizeof(uint32_t) + 2 * sizeof(uint16_t);
-	int surfacesSize = surfaces.size() * 5 * sizeof(uint32_t);
-	int texCoordsSize = numTexCoords * 2 * sizeof(float);
-	int texDataSize = textures.size() * textureWidth * textureHeight * 3 * 2;
-	int lightProbesSize = lightProbes.size() * 6 * sizeof(float);
-	int lumpSize = headerSize + lightProbesSize + surfacesSize + texCoordsSize + texDataSize;
+	// Version 1 stores the pages as BC6H blocks instead of raw RGB16F
+	bool compressPages = BC6HQuality != BC6H_None && textureWidth % 4 == 0 && textureHeight % 4 == 0;
 
-	// Setup buffer
-	std::vector<uint8_t> buffer(lumpSize);
-	BinFile lumpFile;
-	lumpFile.SetBuffer(buffer.data());
+	// The lump is compressed as it is written, so only a few chunks of it are in memory at a time
+	int version = compressPages ? 1 : 0;
+	ZLibOut zout(wadFile);
+	wadFile.StartWritingLump("LIGHTMAP");
 
 	// Write header
-	lumpFile.Write32(version);
-	lumpFile.Write16(textureWidth);
-	lumpFile.Write16(textures.size());
-	lumpFile.Write32(numSurfaces);
-	lumpFile.Write32(numTexCoords);
-	lumpFile.Write32(lightProbes.size());
-	lumpFile.Write32(map->NumGLSubsectors);
+	zout << (uint32_t)version;
+	zout << (uint16_t)textureWidth;
+	zout << (uint16_t)textures.size();
+	zout << (uint32_t)numSurfaces;
+	zout << (uint32_t)numTexCoords;
+	zout << (uint32_t)lightProbes.size();
+	zout << (uint32_t)map->NumGLSubsectors;
 
 	// Write light probes
 	for (const LightProbeSample& probe : lightProbes)
 	{
-		lumpFile.WriteFloat(probe.Position.x);
-		lumpFile.WriteFloat(probe.Position.y);
-		lumpFile.WriteFloat(probe.Position.z);
-		lumpFile.WriteFloat(probe.Color.x);
-		lumpFile.WriteFloat(probe.Color.y);
-		lumpFile.WriteFloat(probe.Color.z);
+		zout << probe.Position.x << probe.Position.y << probe.Position.z;
+		zout << probe.Color.x << probe.Color.y << probe.Color.z;
 	}
 
 	// Write surfaces
 	int coordOffsets = 0;
 	for (size_t i = 0; i < surfaces.size(); i++)
 	{
-		if (surfaces[i]->lightmapNum == -1)
+		if (surfaces[i].lightmapNum == -1)
 			continue;
 
-		lumpFile.Write32(surfaces[i]->type);
-		lumpFile.Write32(surfaces[i]->typeIndex);
-		lumpFile.Write32(surfaces[i]->controlSector ? (uint32_t)(surfaces[i]->controlSector - &map->Sectors[0]) : 0xffffffff);
-		lumpFile.Write32(surfaces[i]->lightmapNum);
-		lumpFile.Write32(coordOffsets);
-		coordOffsets += surfaces[i]->numVerts;
+		zout << (uint32_t)surfaces[i].type;
+		zout << (uint32_t)surfaces[i].typeIndex;
+		zout << (surfaces[i].controlSector ? (uint32_t)(surfaces[i].controlSector - &map->Sectors[0]) : 0xffffffff);
+		zout << (uint32_t)surfaces[i].lightmapNum;
+		zout << (uint32_t)coordOffsets;
+		coordOffsets += surfaces[i].numVerts;
 	}
 
 	// Write texture coordinates
 	for (size_t i = 0; i < surfaces.size(); i++)
 	{
-		if (surfaces[i]->lightmapNum == -1)
+		if (surfaces[i].lightmapNum == -1)
 			continue;
 
-		int count = surfaces[i]->numVerts;
-		if (surfaces[i]->type == ST_FLOOR)
+		int count = surfaces[i].numVerts;
+		const vec2* coords = GetLightmapCoords(&surfaces[i]);
+		if (surfaces[i].type == ST_FLOOR)
 		{
 			for (int j = count - 1; j >= 0; j--)
 			{
-				lumpFile.WriteFloat(surfaces[i]->lightmapCoords[j].x);
-				lumpFile.WriteFloat(surfaces[i]->lightmapCoords[j].y);
+				zout << coords[j].x << coords[j].y;
 			}
 		}
-		else if (surfaces[i]->type == ST_CEILING)
+		else if (surfaces[i].type == ST_CEILING)
 		{
 			for (int j = 0; j < count; j++)
 			{
-				lumpFile.WriteFloat(surfaces[i]->lightmapCoords[j].x);
-				lumpFile.WriteFloat(surfaces[i]->lightmapCoords[j].y);
+				zout << coords[j].x << coords[j].y;
 			}
 		}
 		else
 		{
 			// zdray uses triangle strip internally, lump/gzd uses triangle fan
 
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[0].x);
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[0].y);
-
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[2].x);
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[2].y);
-
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[3].x);
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[3].y);
-
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[1].x);
-			lumpFile.WriteFloat(surfaces[i]->lightmapCoords[1].y);
+			zout << coords[0].x << coords[0].y;
+			zout << coords[2].x << coords[2].y;
+			zout << coords[3].x << coords[3].y;
+			zout << coords[1].x << coords[1].y;
 		}
 	}
 
 	// Write lightmap textures
-	for (size_t i = 0; i < textures.size(); i++)
+	if (!compressPages)
 	{
-		unsigned int count = (textureWidth * textureHeight) * 3;
-		uint16_t* pixels = textures[i]->Pixels();
-		for (unsigned int j = 0; j < count; j++)
+		for (size_t i = 0; i < textures.size(); i++)
 		{
-			lumpFile.Write16(pixels[j]);
+			zout.Write16(textures[i]->Pixels(), (size_t)textureWidth * textureHeight * 3);
 		}
 	}
-
-	// Compress and store in lump
-	ZLibOut zout(wadFile);
-	wadFile.StartWritingLump("LIGHTMAP");
-	zout.Write(buffer.data(), lumpFile.BufferAt() - lumpFile.Buffer());
-}
-
-void LevelMesh::Export(std::string filename)
-{
-	// This is so ugly! I had nothing to do with it! ;)
-	std::string mtlfilename = filename;
-	for (int i = 0; i < 3; i++) mtlfilename.pop_back();
-	mtlfilename += "mtl";
-
-	TArray<vec3> outvertices;
-	TArray<vec2> outuv;
-	TArray<vec3> outnormal;
-	TArray<int> outface;
-
-	outvertices.Resize(MeshVertices.Size());
-	outuv.Resize(MeshVertices.Size());
-	outnormal.Resize(MeshVertices.Size());
-
-	for (unsigned int surfidx = 0; surfidx < MeshElements.Size() / 3; surfidx++)
+	else
 	{
-		Surface* surface = surfaces[MeshSurfaces[surfidx]].get();
-		for (int i = 0; i < 3; i++)
-		{
-			int elementidx = surfidx * 3 + i;
-			int vertexidx = MeshElements[elementidx];
-			int uvindex = MeshUVIndex[vertexidx];
-
-			outvertices[vertexidx] = MeshVertices[vertexidx];
-			outuv[vertexidx] = surface->lightmapCoords[uvindex];
-			outnormal[vertexidx] = surface->plane.Normal();
-			outface.Push(vertexidx);
+		std::vector<uint8_t> blocks;
+		std::vector<uint16_t> decoded((size_t)textureWidth * textureHeight * 3);
+		std::vector<float> expected(decoded.size()), actual(decoded.size());
+		double errorSum = 0.0;
+		float maxError = 0.0f;
 
-			//surface->lightmapNum;
+		for (size_t i = 0; i < textures.size(); i++)
+		{
+			const uint16_t* pixels = textures[i]->Pixels();
+			BC6HEncoder::Encode(pixels, textureWidth, textureHeight, BC6HQuality, blocks);
+			zout.Write(blocks.data(), (int)blocks.size());
+
+			// Decode the page again to report how much was lost
+			BC6HEncoder::Decode(blocks.data(), textureWidth, textureHeight, decoded.data());
+			halfToFloatArray(pixels, expected.data(), expected.size());
+			halfToFloatArray(decoded.data(), actual.data(), actual.size());
+			for (size_t j = 0; j < decoded.size(); j++)
+			{
+				float error = std::abs(actual[j] - std::max(expected[j], 0.0f));
+				errorSum += (double)error * error;
+				maxError = std::max(maxError, error);
+			}
 		}
-	}
-
-	std::string buffer;
-	buffer.reserve(16 * 1024 * 1024);
-
-	buffer += "# zdray exported mesh\r\n";
-
-	buffer += "mtllib ";
-	buffer += mtlfilename;
-	buffer += "\r\n";
 
-	buffer += "usemtl Textured\r\n";
-
-	float scale = 0.01f;
-
-	for (unsigned int i = 0; i < outvertices.Size(); i++)
-	{
-		buffer += "v ";
-		buffer += std::to_string(-outvertices[i].x * scale);
-		buffer += " ";
-		buffer += std::to_string(outvertices[i].z * scale);
-		buffer += " ";
-		buffer += std::to_string(outvertices[i].y * scale);
-		buffer += "\r\n";
-	}
-
-	for (unsigned int i = 0; i < outnormal.Size(); i++)
-	{
-		buffer += "vn ";
-		buffer += std::to_string(-outnormal[i].x);
-		buffer += " ";
-		buffer += std::to_string(outnormal[i].z);
-		buffer += " ";
-		buffer += std::to_string(outnormal[i].y);
-		buffer += "\r\n";
-	}
-
-	for (unsigned int i = 0; i < outuv.Size(); i++)
-	{
-		buffer += "vt ";
-		buffer += std::to_string(outuv[i].x);
-		buffer += " ";
-		buffer += std::to_string(1.0f - outuv[i].y);
-		buffer += "\r\n";
-	}
-
-	for (unsigned int i = 0; i < outface.Size(); i += 3)
-	{
-		std::string e0 = std::to_string(outface[i] + 1);
-		std::string e1 = std::to_string(outface[i + 1] + 1);
-		std::string e2 = std::to_string(outface[i + 2] + 1);
-		buffer += "f ";
-		buffer += e0;
-		buffer += "/";
-		buffer += e0;
-		buffer += "/";
-		buffer += e0;
-		buffer += " ";
-		buffer += e1;
-		buffer += "/";
-		buffer += e1;
-		buffer += "/";
-		buffer += e1;
-		buffer += " ";
-		buffer += e2;
-		buffer += "/";
-		buffer += e2;
-		buffer += "/";
-		buffer += e2;
-		buffer += "\r\n";
+		size_t count = std::max(decoded.size() * textures.size(), (size_t)1);
+		printf("BC6H pages: %d, RMS error %.5f, max error %.5f\n", (int)textures.size(), std::sqrt(errorSum / count), maxError);
 	}
 
-	FILE* file = fopen(filename.c_str(), "wb");
-	if (file)
-	{
-		fwrite(buffer.data(), buffer.size(), 1, file);
-		fclose(file);
-	}
-
-	std::string mtl = R"(newmtl Textured
-   Ka 1.000 1.000 1.000
-   Kd 1.000 1.000 1.000
-   Ks 0.000 0.000 0.000
-   map_Ka lightmap0.png
-   map_Kd lightmap0.png
-)";
-
-	file = fopen(mtlfilename.c_str(), "wb");
-	if (file)
-	{
-		fwrite(mtl.data(), mtl.size(), 1, file);
-		fclose(file);
-	}
+	zout.Finish();
+}
 
-	int index = 0;
-	for (const auto& texture : textures)
-	{
-		int w = texture->Width();
-		int h = texture->Height();
-		uint16_t* p = texture->Pixels();
-#if 1
-		std::vector<uint8_t> buf(w * h * 4);
-		uint8_t* buffer = buf.data();
-		for (int i = 0; i < w * h; i++)
-		{
-			buffer[i * 4] = (uint8_t)(int)clamp(halfToFloat(p[i * 3]) * 255.0f, 0.0f, 255.0f);
-			buffer[i * 4 + 1] = (uint8_t)(int)clamp(halfToFloat(p[i * 3 + 1]) * 255.0f, 0.0f, 255.0f);
-			buffer[i * 4 + 2] = (uint8_t)(int)clamp(halfToFloat(p[i * 3 + 2]) * 255.0f, 0.0f, 255.0f);
-			buffer[i * 4 + 3] = 0xff;
-		}
-		PNGWriter::save("lightmap" + std::to_string(index++) + ".png", w, h, 4, buffer);
-#else
-		std::vector<uint16_t> buf(w * h * 4);
-		uint16_t* buffer = buf.data();
-		for (int i = 0; i < w * h; i++)
-		{
-			buffer[i * 4] = (uint16_t)(int)clamp(halfToFloat(p[i * 3]) * 65535.0f, 0.0f, 65535.0f);
-			buffer[i * 4 + 1] = (uint16_t)(int)clamp(halfToFloat(p[i * 3 + 1]) * 65535.0f, 0.0f, 65535.0f);
-			buffer[i * 4 + 2] = (uint16_t)(int)clamp(halfToFloat(p[i * 3 + 2]) * 65535.0f, 0.0f, 65535.0f);
-			buffer[i * 4 + 3] = 0xffff;
-		}
-		PNGWriter::save("lightmap" + std::to_string(index++) + ".png", w, h, 8, buffer);
-#endif
-	}
+void LevelMesh::Export(std::string filename)
+{
+	MeshExporter::Export(*this, filename);
 }
@@ -31,10 +31,12 @@
 #include <memory>
 #include <string>
 #include <cstring>
+#include <functional>
 
 #include "framework/tarray.h"
 #include "framework/halffloat.h"
 #include "lightmaptexture.h"
+#include "samplebuffer.h"
 
 struct MapSubsectorEx;
 struct IntSector;
@@ -52,6 +54,8 @@ enum SurfaceType
 	ST_FLOOR
 };
 
+// Geometry and lightmap texels of a surface live in the LevelMesh arrays,
+// at the offsets stored here.
 struct Surface
 {
 	Plane plane;
@@ -63,18 +67,30 @@ struct Surface
 	vec3 textureCoords[2];
 	BBox bounds;
 	int numVerts;
-	std::vector<vec3> verts;
-	std::vector<vec2> lightmapCoords;
-	//std::vector<bool> coveragemask;
-	std::vector<vec3> samples;
-	std::vector<vec3> indirect;
+	int firstVert;			// MeshVertices, MeshTexCoords and MeshLightmapCoords
+	int firstSample;		// Samples, lightmapDims[0] * lightmapDims[1] texels
 	SurfaceType type;
 	int typeIndex;
 	IntSector *controlSector;
 	bool bSky;
-	std::vector<vec2> uvs;
-	std::string material;
+	int material;			// Materials
 	int sampleDimension;
+
+	// Flats merged into a lightmap chart form a list starting at the
+	// surface owning the chart. The others keep their own vertices and
+	// coordinates but have no samples of their own.
+	Surface* chartOwner;
+	Surface* nextChartMember;
+};
+
+// The per surface values read for every ray hit, packed apart from Surface
+// so tracing touches as little memory as possible.
+struct SurfaceTraceTable
+{
+	std::vector<vec3> Normals;
+	std::vector<float> SampleDistances;
+	std::vector<uint8_t> Sky;
+	std::vector<int> LightDefs;		// FLevel::SurfaceLights index or -1
 };
 
 class LightProbeSample
@@ -89,14 +105,20 @@ class LevelMesh
 public:
 	LevelMesh(FLevel &doomMap, int sampleDistance, int textureSize);
 
+	// Two pass bake with a texel size picked per chart, see AdaptSampleDimensions
+	void SetSampleDimension(int dimension);
+	void AdaptSampleDimensions(int minDimension, int maxDimension);
+
 	void CreateTextures();
+	void CreatePreviewTextures(const std::function<void()>& write);
 	void AddLightmapLump(FWadWriter& wadFile);
 	void Export(std::string filename);
 
 	FLevel* map = nullptr;
 
-	std::vector<std::unique_ptr<Surface>> surfaces;
+	std::vector<Surface> surfaces;
 	std::vector<LightProbeSample> lightProbes;
+	std::vector<std::string> Materials;
 
 	std::vector<std::unique_ptr<LightmapTexture>> textures;
 
@@ -108,18 +130,52 @@ public:
 	TArray<int> MeshUVIndex;
 	TArray<unsigned int> MeshElements;
 	TArray<int> MeshSurfaces;
+	std::vector<vec2> MeshTexCoords;
+	std::vector<vec2> MeshLightmapCoords;
+
+	LightmapSampleBuffer Samples;
+	SurfaceTraceTable TraceInfo;
+
+	vec3* GetVerts(const Surface* surface) const { return &MeshVertices[surface->firstVert]; }
+	vec2* GetLightmapCoords(Surface* surface) { return &MeshLightmapCoords[surface->firstVert]; }
+	void SetSample(const Surface* surface, int index, const vec3& color) { Samples.Set(surface->firstSample + index, color); }
 
 private:
+	// Surfaces made for one side or subsector, before they are added to the
+	// mesh. Vertex offsets and material indices are local to the list.
+	struct SurfaceList
+	{
+		std::vector<Surface> surfaces;
+		std::vector<vec3> verts;
+		std::vector<vec2> texCoords;
+		std::vector<const char*> materials;
+
+		Surface* Add(int numVerts);
+		int AddMaterial(const char* name) { materials.push_back(name); return (int)materials.size() - 1; }
+	};
+
 	void CreateSubsectorSurfaces(FLevel &doomMap);
-	void CreateCeilingSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor);
-	void CreateFloorSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor);
-	void CreateSideSurfaces(FLevel &doomMap, IntSideDef *side);
+	void CreateCeilingSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor, SurfaceList &output);
+	void CreateFloorSurface(FLevel &doomMap, MapSubsectorEx *sub, IntSector *sector, int typeIndex, bool is3DFloor, SurfaceList &output);
+	void CreateSideSurfaces(FLevel &doomMap, IntSideDef *side, SurfaceList &output);
+	void AppendSurfaces(std::vector<SurfaceList> &lists);
+	void BuildMeshArrays();
 	void CreateLightProbes(FLevel& doomMap);
 
+	void BuildLightmapLayout();
 	void BuildSurfaceParams(Surface* surface);
+	void MergeCharts(FLevel &doomMap);
+	static void GetChartSize(const Plane& plane, const BBox& bounds, int sampleDimension, int& width, int& height);
 	BBox GetBoundsFromSurface(const Surface* surface);
 	void FinishSurface(Surface* surface);
-	int AllocTextureRoom(int width, int height, int* x, int* y);
+	int AllocTextureRoom(int width, int height, int* x, int* y, bool* rotated);
+
+	float GetSampleContrast(Surface* surface);
+
+	void AllocSamples();
+	std::vector<Surface*> GetPackingOrder();
+	void BuildTraceTable(FLevel &doomMap);
 
+	int GetSurfaceTriangles(const Surface *s, unsigned int *elements) const;
 	static bool IsDegenerate(const vec3 &v0, const vec3 &v1, const vec3 &v2);
 };
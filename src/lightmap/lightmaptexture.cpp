@@ -10,32 +10,104 @@ LightmapTexture::LightmapTexture(int width, int height) : textureWidth(width), t
 #else
 	mPixels.resize(width * height * 3, 0);
 #endif
-	allocBlocks.resize(width);
+	skyline.push_back({ 0, 0, width });
 }
 
-bool LightmapTexture::MakeRoomForBlock(const int width, const int height, int* x, int* y)
+bool LightmapTexture::MakeRoomForBlock(const int width, const int height, bool allowRotation, int* x, int* y, bool* rotated)
 {
-	int startY = 0;
-	int startX = 0;
-	for (int i = 0; i < textureHeight; i++)
+	if (usedArea + width * height > textureWidth * textureHeight)
+		return false;
+
+	int index, top;
+	bool found = FindPosition(width, height, index, *x, *y, top);
+	*rotated = false;
+
+	if (allowRotation && width != height)
+	{
+		int rotIndex, rotX, rotY, rotTop;
+		if (FindPosition(height, width, rotIndex, rotX, rotY, rotTop) && (!found || rotTop < top))
+		{
+			found = true;
+			index = rotIndex;
+			*x = rotX;
+			*y = rotY;
+			*rotated = true;
+		}
+	}
+
+	if (!found)
+		return false;
+
+	if (*rotated)
+		AddSkylineLevel(index, *x, *y, height, width);
+	else
+		AddSkylineLevel(index, *x, *y, width, height);
+	usedArea += width * height;
+	return true;
+}
+
+bool LightmapTexture::FindPosition(int width, int height, int& bestIndex, int& bestX, int& bestY, int& bestTop) const
+{
+	bestIndex = -1;
+	bestTop = textureHeight + 1;
+
+	for (int i = 0; i < (int)skyline.size(); i++)
 	{
-		startX = std::max(startX, allocBlocks[i]);
-		int available = textureWidth - startX;
-		if (available < width)
+		int startX = skyline[i].x;
+		if (startX + width > textureWidth)
+			break;
+
+		// The block rests on the highest node it spans
+		int startY = 0;
+		int remaining = width;
+		for (int j = i; remaining > 0; j++)
+		{
+			startY = std::max(startY, skyline[j].y);
+			remaining -= skyline[j].width;
+		}
+
+		int top = startY + height;
+		if (top <= textureHeight && top < bestTop)
 		{
-			startY = i + 1;
-			startX = 0;
+			bestIndex = i;
+			bestX = startX;
+			bestY = startY;
+			bestTop = top;
 		}
-		else if (i - startY + 1 == height)
+	}
+
+	return bestIndex != -1;
+}
+
+void LightmapTexture::AddSkylineLevel(int index, int x, int y, int width, int height)
+{
+	skyline.insert(skyline.begin() + index, { x, y + height, width });
+
+	// Cut away the parts of the following nodes now covered by the block
+	for (size_t i = index + 1; i < skyline.size(); i++)
+	{
+		int end = skyline[i - 1].x + skyline[i - 1].width;
+		if (skyline[i].x >= end)
+			break;
+
+		int shrink = end - skyline[i].x;
+		skyline[i].x += shrink;
+		skyline[i].width -= shrink;
+		if (skyline[i].width > 0)
+			break;
+
+		skyline.erase(skyline.begin() + i);
+		i--;
+	}
+
+	// Join neighbours at the same height
+	for (size_t i = 0; i + 1 < skyline.size(); i++)
+	{
+		if (skyline[i].y == skyline[i + 1].y)
 		{
-			for (int yy = 0; yy < height; yy++)
-			{
-				allocBlocks[startY + yy] = startX + width;
-			}
-			*x = startX;
-			*y = startY;
-			return true;
+			skyline[i].width += skyline[i + 1].width;
+			skyline.erase(skyline.begin() + i + 1);
+			i--;
 		}
 	}
-	return false;
 }
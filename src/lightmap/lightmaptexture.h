@@ -1,4 +1,3 @@
-
 #pragma once
 
 #include <cstdint>
@@ -9,15 +8,29 @@ class LightmapTexture
 public:
 	LightmapTexture(int width, int height);
 
-	bool MakeRoomForBlock(const int width, const int height, int* x, int* y);
+	// Places a block with the skyline bottom-left rule: the position that
+	// leaves the top of the block lowest wins. With allowRotation the block
+	// may also be placed as height x width, which is reported in rotated.
+	bool MakeRoomForBlock(const int width, const int height, bool allowRotation, int* x, int* y, bool* rotated);
 
 	int Width() const { return textureWidth; }
 	int Height() const { return textureHeight; }
+	int UsedArea() const { return usedArea; }
 	uint16_t* Pixels() { return mPixels.data(); }
 
 private:
+	// A horizontal span of the skyline. Everything below y is allocated.
+	struct SkylineNode
+	{
+		int x, y, width;
+	};
+
+	bool FindPosition(int width, int height, int& bestIndex, int& bestX, int& bestY, int& bestTop) const;
+	void AddSkylineLevel(int index, int x, int y, int width, int height);
+
 	int textureWidth;
 	int textureHeight;
 	std::vector<uint16_t> mPixels;
-	std::vector<int> allocBlocks;
+	std::vector<SkylineNode> skyline;
+	int usedArea = 0;
 };
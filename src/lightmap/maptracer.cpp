@@ -0,0 +1,330 @@
+
+#include "maptracer.h"
+#include "levelmesh.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+	// Blocks are grown by this much when deciding what touches them, so a
+	// hit right on the edge between two blocks is found from either side
+	const float BlockMargin = 0.01f;
+
+	float Cross2(float ax, float ay, float bx, float by)
+	{
+		return ax * by - ay * bx;
+	}
+}
+
+MapTracer::MapTracer(const LevelMesh* mesh)
+{
+	// Only surfaces that made it into the triangle mesh can be hit
+	std::vector<bool> hasTriangles(mesh->surfaces.size());
+	for (unsigned int i = 0; i < mesh->MeshSurfaces.Size(); i++)
+		hasTriangles[mesh->MeshSurfaces[i]] = true;
+
+	for (size_t i = 0; i < mesh->surfaces.size(); i++)
+	{
+		if (!hasTriangles[i])
+			continue;
+
+		const Surface* surface = &mesh->surfaces[i];
+		const vec3* verts = mesh->GetVerts(surface);
+		if (surface->type == ST_FLOOR || surface->type == ST_CEILING)
+			AddFlat(verts, surface->numVerts, (int)i);
+		else
+			AddWall(verts, (int)i);
+	}
+
+	BuildBlocks();
+
+	size_t bytes = Walls.size() * sizeof(Wall) + Flats.size() * sizeof(Flat) + FlatVerts.size() * sizeof(vec2) + (BlockStart.size() + BlockItems.size()) * sizeof(int);
+	printf("Map tracer: %d walls, %d flats, %dx%d blocks (%.1f MB)\n", (int)Walls.size(), (int)Flats.size(), BlocksWide, BlocksHigh, bytes / (1024.0 * 1024.0));
+}
+
+// Side surfaces are quads with verts 0 and 2 at one end of the line and 1
+// and 3 at the other, the first two at the bottom.
+void MapTracer::AddWall(const vec3* verts, int surface)
+{
+	Wall wall;
+	wall.v1 = vec2(verts[0].x, verts[0].y);
+	wall.v2 = vec2(verts[1].x, verts[1].y);
+	wall.bottom1 = std::min(verts[0].z, verts[2].z);
+	wall.top1 = std::max(verts[0].z, verts[2].z);
+	wall.bottom2 = std::min(verts[1].z, verts[3].z);
+	wall.top2 = std::max(verts[1].z, verts[3].z);
+	wall.surface = surface;
+	Walls.push_back(wall);
+}
+
+void MapTracer::AddFlat(const vec3* verts, int numVerts, int surface)
+{
+	// Newell's method, which gives the winding in the xy plane as well
+	vec3 normal(0.0f, 0.0f, 0.0f);
+	for (int i = 0; i < numVerts; i++)
+	{
+		const vec3& a = verts[i];
+		const vec3& b = verts[(i + 1) % numVerts];
+		normal.x += (a.y - b.y) * (a.z + b.z);
+		normal.y += (a.z - b.z) * (a.x + b.x);
+		normal.z += (a.x - b.x) * (a.y + b.y);
+	}
+	if (normal.z == 0.0f)
+		return;
+
+	Flat flat;
+	flat.normal = normalize(normal);
+	flat.point = verts[0];
+	flat.firstVert = (int)FlatVerts.size();
+	flat.numVerts = numVerts;
+	flat.surface = surface;
+	Flats.push_back(flat);
+
+	for (int i = 0; i < numVerts; i++)
+		FlatVerts.push_back(vec2(verts[i].x, verts[i].y));
+}
+
+void MapTracer::BuildBlocks()
+{
+	if (Walls.empty() && Flats.empty())
+		return;
+
+	vec2 bmin(FLT_MAX, FLT_MAX);
+	vec2 bmax(-FLT_MAX, -FLT_MAX);
+	auto addPoint = [&](const vec2& p) {
+		bmin.x = std::min(bmin.x, p.x);
+		bmin.y = std::min(bmin.y, p.y);
+		bmax.x = std::max(bmax.x, p.x);
+		bmax.y = std::max(bmax.y, p.y);
+	};
+	for (const Wall& wall : Walls)
+	{
+		addPoint(wall.v1);
+		addPoint(wall.v2);
+	}
+	for (const vec2& v : FlatVerts)
+		addPoint(v);
+
+	Origin = vec2(std::floor(bmin.x) - 1.0f, std::floor(bmin.y) - 1.0f);
+	BlocksWide = (int)((bmax.x + 1.0f - Origin.x) / BLOCK_SIZE) + 1;
+	BlocksHigh = (int)((bmax.y + 1.0f - Origin.y) / BLOCK_SIZE) + 1;
+
+	auto blockRange = [&](float minx, float miny, float maxx, float maxy, int& x1, int& y1, int& x2, int& y2) {
+		x1 = std::max((int)((minx - BlockMargin - Origin.x) / BLOCK_SIZE), 0);
+		y1 = std::max((int)((miny - BlockMargin - Origin.y) / BLOCK_SIZE), 0);
+		x2 = std::min((int)((maxx + BlockMargin - Origin.x) / BLOCK_SIZE), BlocksWide - 1);
+		y2 = std::min((int)((maxy + BlockMargin - Origin.y) / BLOCK_SIZE), BlocksHigh - 1);
+	};
+
+	// Calls fn for every block an item touches. Walls are tested against
+	// each block in their bounding box, flats just use their bounding box.
+	auto forEachBlock = [&](auto fn) {
+		for (size_t i = 0; i < Walls.size(); i++)
+		{
+			const Wall& wall = Walls[i];
+			int x1, y1, x2, y2;
+			blockRange(std::min(wall.v1.x, wall.v2.x), std::min(wall.v1.y, wall.v2.y), std::max(wall.v1.x, wall.v2.x), std::max(wall.v1.y, wall.v2.y), x1, y1, x2, y2);
+			for (int y = y1; y <= y2; y++)
+			{
+				for (int x = x1; x <= x2; x++)
+				{
+					if (BlockOverlapsWall(x, y, wall))
+						fn(x + y * BlocksWide, (int)i);
+				}
+			}
+		}
+
+		for (size_t i = 0; i < Flats.size(); i++)
+		{
+			const Flat& flat = Flats[i];
+			vec2 fmin(FLT_MAX, FLT_MAX);
+			vec2 fmax(-FLT_MAX, -FLT_MAX);
+			for (int j = 0; j < flat.numVerts; j++)
+			{
+				const vec2& v = FlatVerts[flat.firstVert + j];
+				fmin.x = std::min(fmin.x, v.x);
+				fmin.y = std::min(fmin.y, v.y);
+				fmax.x = std::max(fmax.x, v.x);
+				fmax.y = std::max(fmax.y, v.y);
+			}
+
+			int x1, y1, x2, y2;
+			blockRange(fmin.x, fmin.y, fmax.x, fmax.y, x1, y1, x2, y2);
+			for (int y = y1; y <= y2; y++)
+			{
+				for (int x = x1; x <= x2; x++)
+					fn(x + y * BlocksWide, ~(int)i);
+			}
+		}
+	};
+
+	int numBlocks = BlocksWide * BlocksHigh;
+	BlockStart.assign(numBlocks + 1, 0);
+	forEachBlock([&](int block, int) { BlockStart[block + 1]++; });
+	for (int i = 0; i < numBlocks; i++)
+		BlockStart[i + 1] += BlockStart[i];
+
+	std::vector<int> fill(BlockStart.begin(), BlockStart.end() - 1);
+	BlockItems.resize(BlockStart[numBlocks]);
+	forEachBlock([&](int block, int item) { BlockItems[fill[block]++] = item; });
+}
+
+bool MapTracer::BlockOverlapsWall(int x, int y, const Wall& wall) const
+{
+	float x1 = Origin.x + x * BLOCK_SIZE - BlockMargin;
+	float y1 = Origin.y + y * BLOCK_SIZE - BlockMargin;
+	float x2 = x1 + BLOCK_SIZE + BlockMargin * 2.0f;
+	float y2 = y1 + BLOCK_SIZE + BlockMargin * 2.0f;
+
+	// The bounding boxes overlap already, so the wall misses the block only
+	// if all its corners are on the same side of the line
+	float dx = wall.v2.x - wall.v1.x;
+	float dy = wall.v2.y - wall.v1.y;
+	float s1 = Cross2(dx, dy, x1 - wall.v1.x, y1 - wall.v1.y);
+	float s2 = Cross2(dx, dy, x2 - wall.v1.x, y1 - wall.v1.y);
+	float s3 = Cross2(dx, dy, x1 - wall.v1.x, y2 - wall.v1.y);
+	float s4 = Cross2(dx, dy, x2 - wall.v1.x, y2 - wall.v1.y);
+	return !((s1 > 0.0f && s2 > 0.0f && s3 > 0.0f && s4 > 0.0f) || (s1 < 0.0f && s2 < 0.0f && s3 < 0.0f && s4 < 0.0f));
+}
+
+MapTraceHit MapTracer::Trace(const vec3& start, const vec3& end) const
+{
+	MapTraceHit hit;
+	if (BlocksWide == 0)
+		return hit;
+
+	vec3 dir = end - start;
+
+	// Clip the 2D path to the grid
+	float tmin = 0.0f;
+	float tmax = 1.0f;
+	float gridMin[2] = { Origin.x, Origin.y };
+	float gridMax[2] = { Origin.x + BlocksWide * (float)BLOCK_SIZE, Origin.y + BlocksHigh * (float)BLOCK_SIZE };
+	float s[2] = { start.x, start.y };
+	float d[2] = { dir.x, dir.y };
+	for (int axis = 0; axis < 2; axis++)
+	{
+		if (d[axis] == 0.0f)
+		{
+			if (s[axis] < gridMin[axis] || s[axis] > gridMax[axis])
+				return hit;
+		}
+		else
+		{
+			float t0 = (gridMin[axis] - s[axis]) / d[axis];
+			float t1 = (gridMax[axis] - s[axis]) / d[axis];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+	}
+	if (tmin > tmax)
+		return hit;
+
+	// Walk the blocks along the path (Amanatides and Woo)
+	float entryX = start.x + dir.x * tmin - Origin.x;
+	float entryY = start.y + dir.y * tmin - Origin.y;
+	int x = std::min(std::max((int)(entryX / BLOCK_SIZE), 0), BlocksWide - 1);
+	int y = std::min(std::max((int)(entryY / BLOCK_SIZE), 0), BlocksHigh - 1);
+
+	int stepX = dir.x > 0.0f ? 1 : -1;
+	int stepY = dir.y > 0.0f ? 1 : -1;
+	float tDeltaX = dir.x != 0.0f ? BLOCK_SIZE / std::abs(dir.x) : FLT_MAX;
+	float tDeltaY = dir.y != 0.0f ? BLOCK_SIZE / std::abs(dir.y) : FLT_MAX;
+	float tMaxX = dir.x != 0.0f ? (Origin.x + (x + (dir.x > 0.0f ? 1 : 0)) * (float)BLOCK_SIZE - start.x) / dir.x : FLT_MAX;
+	float tMaxY = dir.y != 0.0f ? (Origin.y + (y + (dir.y > 0.0f ? 1 : 0)) * (float)BLOCK_SIZE - start.y) / dir.y : FLT_MAX;
+
+	while (true)
+	{
+		int block = x + y * BlocksWide;
+		for (int i = BlockStart[block], end = BlockStart[block + 1]; i < end; i++)
+		{
+			int item = BlockItems[i];
+			if (item >= 0)
+				TraceWall(Walls[item], start, dir, hit);
+			else
+				TraceFlat(Flats[~item], start, dir, hit);
+		}
+
+		// Anything in the blocks further on is hit later than this
+		float blockExit = std::min(std::min(tMaxX, tMaxY), tmax);
+		if (hit.fraction <= blockExit || blockExit >= tmax)
+			break;
+
+		if (tMaxX < tMaxY)
+		{
+			x += stepX;
+			if (x < 0 || x >= BlocksWide)
+				break;
+			tMaxX += tDeltaX;
+		}
+		else
+		{
+			y += stepY;
+			if (y < 0 || y >= BlocksHigh)
+				break;
+			tMaxY += tDeltaY;
+		}
+	}
+
+	return hit;
+}
+
+void MapTracer::TraceWall(const Wall& wall, const vec3& start, const vec3& dir, MapTraceHit& hit) const
+{
+	float ex = wall.v2.x - wall.v1.x;
+	float ey = wall.v2.y - wall.v1.y;
+	float denom = Cross2(dir.x, dir.y, ex, ey);
+	if (denom == 0.0f)
+		return;
+
+	// Where the 2D path crosses the line, along the ray (t) and the wall (s)
+	float wx = wall.v1.x - start.x;
+	float wy = wall.v1.y - start.y;
+	float t = Cross2(wx, wy, ex, ey) / denom;
+	if (t <= FLT_EPSILON || t >= hit.fraction)
+		return;
+	float s = Cross2(wx, wy, dir.x, dir.y) / denom;
+	if (s < 0.0f || s > 1.0f)
+		return;
+
+	float z = start.z + dir.z * t;
+	float bottom = wall.bottom1 + (wall.bottom2 - wall.bottom1) * s;
+	float top = wall.top1 + (wall.top2 - wall.top1) * s;
+	if (z < bottom || z > top)
+		return;
+
+	hit.fraction = t;
+	hit.surface = wall.surface;
+}
+
+void MapTracer::TraceFlat(const Flat& flat, const vec3& start, const vec3& dir, MapTraceHit& hit) const
+{
+	float denom = dot(flat.normal, dir);
+	if (denom == 0.0f)
+		return;
+
+	float t = dot(flat.normal, flat.point - start) / denom;
+	if (t <= FLT_EPSILON || t >= hit.fraction)
+		return;
+
+	// Subsectors are convex, so the point is inside if it is on the inner
+	// side of every edge
+	float px = start.x + dir.x * t;
+	float py = start.y + dir.y * t;
+	float winding = flat.normal.z > 0.0f ? 1.0f : -1.0f;
+	const vec2* verts = &FlatVerts[flat.firstVert];
+	for (int i = 0; i < flat.numVerts; i++)
+	{
+		const vec2& a = verts[i];
+		const vec2& b = verts[i + 1 < flat.numVerts ? i + 1 : 0];
+		if (Cross2(b.x - a.x, b.y - a.y, px - a.x, py - a.y) * winding < 0.0f)
+			return;
+	}
+
+	hit.fraction = t;
+	hit.surface = flat.surface;
+}
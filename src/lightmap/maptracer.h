@@ -0,0 +1,74 @@
+
+#pragma once
+
+#include "math/mathlib.h"
+#include <vector>
+
+class LevelMesh;
+
+enum ETraceBackend
+{
+	TRACE_BVH,		// Triangle BVH over the level mesh
+	TRACE_Map,		// MapTracer
+	TRACE_Check		// Both, reporting traces where they disagree
+};
+
+struct MapTraceHit
+{
+	float fraction = 1.0f;
+	int surface = -1;
+};
+
+// Traces rays through the level as the 2.5D geometry it is rather than as
+// triangles. Walls are 2D segments with a height range at each end and
+// flats are convex subsector polygons on a plane, so both are hit
+// analytically. 3D floors need no special handling since their sides and
+// planes are ordinary surfaces of the mesh. A blockmap-like grid is walked
+// along the ray's 2D path, stopping at the first block that holds a hit.
+class MapTracer
+{
+public:
+	MapTracer(const LevelMesh* mesh);
+
+	MapTraceHit Trace(const vec3& start, const vec3& end) const;
+
+private:
+	struct Wall
+	{
+		vec2 v1, v2;
+		float bottom1, top1, bottom2, top2;
+		int surface;
+	};
+
+	struct Flat
+	{
+		vec3 normal;		// Points up if the polygon is counterclockwise
+		vec3 point;			// Any point on the plane
+		int firstVert;
+		int numVerts;
+		int surface;
+	};
+
+	void AddWall(const vec3* verts, int surface);
+	void AddFlat(const vec3* verts, int numVerts, int surface);
+	void BuildBlocks();
+
+	bool BlockOverlapsWall(int x, int y, const Wall& wall) const;
+	void TraceWall(const Wall& wall, const vec3& start, const vec3& dir, MapTraceHit& hit) const;
+	void TraceFlat(const Flat& flat, const vec3& start, const vec3& dir, MapTraceHit& hit) const;
+
+	enum { BLOCK_SIZE = 128 };
+
+	std::vector<Wall> Walls;
+	std::vector<Flat> Flats;
+	std::vector<vec2> FlatVerts;
+
+	vec2 Origin;
+	int BlocksWide = 0;
+	int BlocksHigh = 0;
+
+	// Walls and flats touching each block, as ranges into BlockItems.
+	// Walls come first in a block and flats are stored as ~index.
+	std::vector<int> BlockStart;
+	std::vector<int> BlockItems;
+};
@@ -0,0 +1,469 @@
+
+#include "math/mathlib.h"
+#include "framework/parallel.h"
+#include "meshexport.h"
+#include "levelmesh.h"
+#include "pngwriter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <stdio.h>
+#include <string.h>
+
+namespace
+{
+	// Formats count items as text on all threads, a chunk at a time, and
+	// writes the chunks out in order. Only a few chunks per thread are held
+	// in memory at once.
+	template<typename F>
+	void WriteChunked(FILE* file, size_t count, F format)
+	{
+		const size_t chunkItems = 16384;
+		size_t numChunks = (count + chunkItems - 1) / chunkItems;
+		std::vector<std::string> window(GetNumThreads() * 4);
+
+		for (size_t first = 0; first < numChunks; first += window.size())
+		{
+			size_t n = std::min(window.size(), numChunks - first);
+			ParallelFor(n, [&](size_t i) {
+				size_t begin = (first + i) * chunkItems;
+				window[i].clear();
+				format(begin, std::min(begin + chunkItems, count), window[i]);
+			});
+			for (size_t i = 0; i < n; i++)
+				fwrite(window[i].data(), window[i].size(), 1, file);
+		}
+	}
+
+	char* FormatInt(char* p, unsigned long long value)
+	{
+		char digits[20];
+		int count = 0;
+		do
+		{
+			digits[count++] = '0' + (char)(value % 10);
+			value /= 10;
+		} while (value != 0);
+		while (count > 0)
+			*p++ = digits[--count];
+		return p;
+	}
+
+	// Same output as printf's %f. A float times 1e6 is exact in a double and
+	// llrint rounds half to even, just like printf does.
+	char* FormatFloat(char* p, float value)
+	{
+		double scaled = std::fabs((double)value * 1e6);
+		if (!(scaled < 9.0e18))
+			return p + snprintf(p, 64, "%f", value);
+
+		if (std::signbit(value))
+			*p++ = '-';
+		long long n = std::llrint(scaled);
+		p = FormatInt(p, n / 1000000);
+		*p++ = '.';
+		int fraction = (int)(n % 1000000);
+		for (int i = 5; i >= 0; i--)
+		{
+			p[i] = '0' + (char)(fraction % 10);
+			fraction /= 10;
+		}
+		return p + 6;
+	}
+
+	void FormatVec(std::string& out, const char* prefix, const float* values, int count)
+	{
+		char line[256];
+		char* p = line;
+		while (*prefix)
+			*p++ = *prefix++;
+		for (int i = 0; i < count; i++)
+		{
+			*p++ = ' ';
+			p = FormatFloat(p, values[i]);
+		}
+		*p++ = '\r';
+		*p++ = '\n';
+		out.append(line, p - line);
+	}
+
+	void Appendf(std::string& out, const char* format, ...)
+	{
+		char buffer[512];
+		va_list ap;
+		va_start(ap, format);
+		int len = vsnprintf(buffer, sizeof(buffer), format, ap);
+		va_end(ap);
+		out.append(buffer, std::min(len, (int)sizeof(buffer) - 1));
+	}
+
+	void SplitPath(const std::string& filename, std::string& dir, std::string& stem)
+	{
+		size_t slash = filename.find_last_of("/\\");
+		size_t start = slash == std::string::npos ? 0 : slash + 1;
+		size_t dot = filename.find_last_of('.');
+		if (dot == std::string::npos || dot < start)
+			dot = filename.size();
+		dir = filename.substr(0, start);
+		stem = filename.substr(start, dot - start);
+	}
+
+	bool IsGLB(const std::string& filename)
+	{
+		return filename.size() >= 4 && stricmp(filename.c_str() + filename.size() - 4, ".glb") == 0;
+	}
+}
+
+void MeshExporter::Export(const LevelMesh& mesh, const std::string& filename)
+{
+	MeshExporter exporter(mesh);
+	exporter.EncodePages();
+	if (IsGLB(filename))
+		exporter.WriteGLB(filename);
+	else
+		exporter.WriteOBJ(filename);
+}
+
+MeshExporter::MeshExporter(const LevelMesh& mesh) : Mesh(mesh)
+{
+	const float scale = 0.01f;
+
+	size_t numVertices = Mesh.MeshVertices.Size();
+	size_t numFaces = Mesh.MeshElements.Size() / 3;
+	Positions.resize(numVertices * 3);
+	Normals.resize(numVertices * 3);
+	UVs.resize(numVertices * 2);
+
+	size_t numGroups = Mesh.textures.size() + 1;
+	std::vector<int> faceGroup(numFaces);
+	std::vector<size_t> groupCount(numGroups);
+
+	for (size_t face = 0; face < numFaces; face++)
+	{
+		const Surface* surface = &Mesh.surfaces[Mesh.MeshSurfaces[face]];
+		const vec3& normal = surface->plane.Normal();
+		for (int i = 0; i < 3; i++)
+		{
+			int vertexidx = Mesh.MeshElements[face * 3 + i];
+			const vec3& pos = Mesh.MeshVertices[vertexidx];
+			const vec2& uv = Mesh.MeshLightmapCoords[vertexidx];
+
+			Positions[vertexidx * 3] = -pos.x * scale;
+			Positions[vertexidx * 3 + 1] = pos.z * scale;
+			Positions[vertexidx * 3 + 2] = pos.y * scale;
+			Normals[vertexidx * 3] = -normal.x;
+			Normals[vertexidx * 3 + 1] = normal.z;
+			Normals[vertexidx * 3 + 2] = normal.y;
+			UVs[vertexidx * 2] = uv.x;
+			UVs[vertexidx * 2 + 1] = uv.y;
+		}
+
+		faceGroup[face] = surface->lightmapNum + 1;
+		groupCount[faceGroup[face]]++;
+	}
+
+	GroupStart.resize(numGroups + 1);
+	GroupStart[0] = 0;
+	for (size_t i = 0; i < numGroups; i++)
+		GroupStart[i + 1] = GroupStart[i] + groupCount[i] * 3;
+
+	std::vector<size_t> pos(GroupStart.begin(), GroupStart.end() - 1);
+	Indices.resize(numFaces * 3);
+	for (size_t face = 0; face < numFaces; face++)
+	{
+		size_t& dest = pos[faceGroup[face]];
+		for (int i = 0; i < 3; i++)
+			Indices[dest++] = Mesh.MeshElements[face * 3 + i];
+	}
+}
+
+void MeshExporter::EncodePages()
+{
+	PagePNGs.resize(Mesh.textures.size());
+	ParallelFor(PagePNGs.size(), [&](size_t index) {
+		LightmapTexture* texture = Mesh.textures[index].get();
+		int w = texture->Width();
+		int h = texture->Height();
+		const uint16_t* p = texture->Pixels();
+
+		std::vector<float> row(w * 3);
+		std::vector<uint8_t> buffer(w * h * 4);
+		for (int y = 0; y < h; y++)
+		{
+			halfToFloatArray(p + y * w * 3, row.data(), w * 3);
+			uint8_t* dest = &buffer[y * w * 4];
+			for (int x = 0; x < w; x++)
+			{
+				dest[x * 4] = (uint8_t)(int)clamp(row[x * 3] * 255.0f, 0.0f, 255.0f);
+				dest[x * 4 + 1] = (uint8_t)(int)clamp(row[x * 3 + 1] * 255.0f, 0.0f, 255.0f);
+				dest[x * 4 + 2] = (uint8_t)(int)clamp(row[x * 3 + 2] * 255.0f, 0.0f, 255.0f);
+				dest[x * 4 + 3] = 0xff;
+			}
+		}
+		PNGWriter::save(PagePNGs[index], w, h, 4, buffer.data());
+	});
+}
+
+void MeshExporter::WriteOBJ(const std::string& filename)
+{
+	std::string dir, stem;
+	SplitPath(filename, dir, stem);
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		printf("Could not open %s for writing\n", filename.c_str());
+		return;
+	}
+
+	std::string header = "# zdray exported mesh\r\nmtllib " + stem + ".mtl\r\n";
+	fwrite(header.data(), header.size(), 1, file);
+
+	size_t numVertices = Positions.size() / 3;
+	WriteChunked(file, numVertices, [&](size_t begin, size_t end, std::string& out) {
+		for (size_t i = begin; i < end; i++)
+			FormatVec(out, "v", &Positions[i * 3], 3);
+	});
+	WriteChunked(file, numVertices, [&](size_t begin, size_t end, std::string& out) {
+		for (size_t i = begin; i < end; i++)
+			FormatVec(out, "vn", &Normals[i * 3], 3);
+	});
+	WriteChunked(file, numVertices, [&](size_t begin, size_t end, std::string& out) {
+		for (size_t i = begin; i < end; i++)
+		{
+			float uv[2] = { UVs[i * 2], 1.0f - UVs[i * 2 + 1] };
+			FormatVec(out, "vt", uv, 2);
+		}
+	});
+
+	for (size_t group = 0; group + 1 < GroupStart.size(); group++)
+	{
+		size_t start = GroupStart[group];
+		size_t numFaces = (GroupStart[group + 1] - start) / 3;
+		if (numFaces == 0)
+			continue;
+
+		if (group > 0)
+		{
+			std::string usemtl = "usemtl lightmap" + std::to_string(group - 1) + "\r\n";
+			fwrite(usemtl.data(), usemtl.size(), 1, file);
+		}
+
+		WriteChunked(file, numFaces, [&](size_t begin, size_t end, std::string& out) {
+			char line[128];
+			for (size_t i = begin; i < end; i++)
+			{
+				char* p = line;
+				*p++ = 'f';
+				for (int j = 0; j < 3; j++)
+				{
+					// Position, UV and normal share the index, so format it once
+					char index[24];
+					size_t len = FormatInt(index, Indices[start + i * 3 + j] + 1ull) - index;
+					*p++ = ' ';
+					for (int k = 0; k < 3; k++)
+					{
+						if (k > 0)
+							*p++ = '/';
+						memcpy(p, index, len);
+						p += len;
+					}
+				}
+				*p++ = '\r';
+				*p++ = '\n';
+				out.append(line, p - line);
+			}
+		});
+	}
+
+	bool failed = ferror(file) != 0;
+	fclose(file);
+
+	std::string mtl;
+	for (size_t i = 0; i < PagePNGs.size(); i++)
+	{
+		std::string png = stem + "_lightmap" + std::to_string(i) + ".png";
+		mtl += "newmtl lightmap" + std::to_string(i) + "\n";
+		mtl += "   Ka 1.000 1.000 1.000\n";
+		mtl += "   Kd 1.000 1.000 1.000\n";
+		mtl += "   Ks 0.000 0.000 0.000\n";
+		mtl += "   map_Ka " + png + "\n";
+		mtl += "   map_Kd " + png + "\n";
+
+		file = fopen((dir + png).c_str(), "wb");
+		if (file)
+		{
+			fwrite(PagePNGs[i].data(), PagePNGs[i].size(), 1, file);
+			failed = failed || ferror(file) != 0;
+			fclose(file);
+		}
+		else
+		{
+			failed = true;
+		}
+	}
+
+	file = fopen((dir + stem + ".mtl").c_str(), "wb");
+	if (file)
+	{
+		fwrite(mtl.data(), mtl.size(), 1, file);
+		fclose(file);
+	}
+	else
+	{
+		failed = true;
+	}
+
+	if (failed)
+		printf("Could not write all of %s\n", filename.c_str());
+	else
+		printf("Exported mesh to %s\n", filename.c_str());
+}
+
+void MeshExporter::WriteGLB(const std::string& filename)
+{
+	enum
+	{
+		GL_FLOAT = 5126,
+		GL_UNSIGNED_INT = 5125,
+		GL_ARRAY_BUFFER = 34962,
+		GL_ELEMENT_ARRAY_BUFFER = 34963
+	};
+
+	// glTF does not allow zero-length buffers or buffer views
+	if (Indices.empty())
+	{
+		printf("Mesh is empty, not writing %s\n", filename.c_str());
+		return;
+	}
+
+	// The binary chunk holds the vertex arrays, the indices and the PNGs,
+	// each starting on a four byte boundary.
+	struct View
+	{
+		const void* Data;
+		size_t Size;
+		size_t Offset;
+	};
+	std::vector<View> views;
+	size_t binSize = 0;
+	auto addView = [&](const void* data, size_t size) {
+		views.push_back({ data, size, binSize });
+		binSize += (size + 3) & ~(size_t)3;
+	};
+	addView(Positions.data(), Positions.size() * sizeof(float));
+	addView(Normals.data(), Normals.size() * sizeof(float));
+	addView(UVs.data(), UVs.size() * sizeof(float));
+	addView(Indices.data(), Indices.size() * sizeof(uint32_t));
+	for (const std::vector<uint8_t>& png : PagePNGs)
+		addView(png.data(), png.size());
+
+	float bmin[3] = { 0.0f, 0.0f, 0.0f }, bmax[3] = { 0.0f, 0.0f, 0.0f };
+	size_t numVertices = Positions.size() / 3;
+	for (size_t i = 0; i < numVertices; i++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			float v = Positions[i * 3 + c];
+			bmin[c] = i == 0 ? v : std::min(bmin[c], v);
+			bmax[c] = i == 0 ? v : std::max(bmax[c], v);
+		}
+	}
+
+	std::string json = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"zdray\"},\"extensionsUsed\":[\"KHR_materials_unlit\"]";
+	Appendf(json, ",\"buffers\":[{\"byteLength\":%zu}]", binSize);
+
+	json += ",\"bufferViews\":[";
+	for (size_t i = 0; i < views.size(); i++)
+	{
+		Appendf(json, "%s{\"buffer\":0,\"byteOffset\":%zu,\"byteLength\":%zu", i > 0 ? "," : "", views[i].Offset, views[i].Size);
+		if (i < 3)
+			Appendf(json, ",\"target\":%d", GL_ARRAY_BUFFER);
+		else if (i == 3)
+			Appendf(json, ",\"target\":%d", GL_ELEMENT_ARRAY_BUFFER);
+		json += "}";
+	}
+	json += "]";
+
+	json += ",\"accessors\":[";
+	Appendf(json, "{\"bufferView\":0,\"componentType\":%d,\"count\":%zu,\"type\":\"VEC3\",\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]}",
+		GL_FLOAT, numVertices, bmin[0], bmin[1], bmin[2], bmax[0], bmax[1], bmax[2]);
+	Appendf(json, ",{\"bufferView\":1,\"componentType\":%d,\"count\":%zu,\"type\":\"VEC3\"}", GL_FLOAT, numVertices);
+	Appendf(json, ",{\"bufferView\":2,\"componentType\":%d,\"count\":%zu,\"type\":\"VEC2\"}", GL_FLOAT, numVertices);
+
+	std::string primitives;
+	int accessor = 3;
+	for (size_t group = 0; group + 1 < GroupStart.size(); group++)
+	{
+		size_t count = GroupStart[group + 1] - GroupStart[group];
+		if (count == 0)
+			continue;
+
+		Appendf(json, ",{\"bufferView\":3,\"byteOffset\":%zu,\"componentType\":%d,\"count\":%zu,\"type\":\"SCALAR\"}",
+			GroupStart[group] * sizeof(uint32_t), GL_UNSIGNED_INT, count);
+
+		Appendf(primitives, "%s{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2},\"indices\":%d", primitives.empty() ? "" : ",", accessor++);
+		if (group > 0)
+			Appendf(primitives, ",\"material\":%d", (int)group - 1);
+		primitives += "}";
+	}
+	json += "]";
+
+	if (!PagePNGs.empty())
+	{
+		std::string materials, textures, images;
+		for (size_t i = 0; i < PagePNGs.size(); i++)
+		{
+			const char* sep = i > 0 ? "," : "";
+			Appendf(materials, "%s{\"name\":\"lightmap%d\",\"pbrMetallicRoughness\":{\"baseColorTexture\":{\"index\":%d},\"metallicFactor\":0},\"extensions\":{\"KHR_materials_unlit\":{}}}", sep, (int)i, (int)i);
+			Appendf(textures, "%s{\"sampler\":0,\"source\":%d}", sep, (int)i);
+			Appendf(images, "%s{\"bufferView\":%d,\"mimeType\":\"image/png\"}", sep, (int)i + 4);
+		}
+		json += ",\"materials\":[" + materials + "]";
+		json += ",\"textures\":[" + textures + "]";
+		json += ",\"images\":[" + images + "]";
+		json += ",\"samplers\":[{\"magFilter\":9729,\"minFilter\":9729,\"wrapS\":33071,\"wrapT\":33071}]";
+	}
+
+	json += ",\"meshes\":[{\"primitives\":[" + primitives + "]}],\"nodes\":[{\"mesh\":0}],\"scenes\":[{\"nodes\":[0]}],\"scene\":0";
+	json += "}";
+
+	while (json.size() % 4 != 0)
+		json += ' ';
+
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (!file)
+	{
+		printf("Could not open %s for writing\n", filename.c_str());
+		return;
+	}
+
+	uint32_t header[5] =
+	{
+		0x46546C67,		// "glTF"
+		2,
+		(uint32_t)(12 + 8 + json.size() + 8 + binSize),
+		(uint32_t)json.size(),
+		0x4E4F534A		// "JSON"
+	};
+	fwrite(header, sizeof(header), 1, file);
+	fwrite(json.data(), json.size(), 1, file);
+
+	uint32_t binHeader[2] = { (uint32_t)binSize, 0x004E4942 };	// "BIN"
+	fwrite(binHeader, sizeof(binHeader), 1, file);
+	for (const View& view : views)
+	{
+		static const uint8_t padding[3] = { 0, 0, 0 };
+		if (view.Size > 0)
+			fwrite(view.Data, view.Size, 1, file);
+		fwrite(padding, ((view.Size + 3) & ~(size_t)3) - view.Size, 1, file);
+	}
+
+	bool failed = ferror(file) != 0;
+	fclose(file);
+
+	if (failed)
+		printf("Could not write all of %s\n", filename.c_str());
+	else
+		printf("Exported mesh to %s\n", filename.c_str());
+}
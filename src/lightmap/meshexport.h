@@ -0,0 +1,38 @@
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class LevelMesh;
+
+// Writes the baked level mesh and its lightmap pages for inspection in a
+// 3D viewer. A .glb filename writes binary glTF with the pages embedded,
+// anything else writes OBJ with an MTL file and a PNG per page next to it.
+class MeshExporter
+{
+public:
+	static void Export(const LevelMesh& mesh, const std::string& filename);
+
+private:
+	MeshExporter(const LevelMesh& mesh);
+
+	void WriteOBJ(const std::string& filename);
+	void WriteGLB(const std::string& filename);
+	void EncodePages();
+
+	const LevelMesh& Mesh;
+
+	// Vertex data in the exported coordinate system (y up, right handed)
+	std::vector<float> Positions;
+	std::vector<float> Normals;
+	std::vector<float> UVs;
+
+	// Triangles sorted by lightmap page. Group 0 holds the triangles without
+	// a page and group N + 1 the ones on page N.
+	std::vector<uint32_t> Indices;
+	std::vector<size_t> GroupStart;
+
+	std::vector<std::vector<uint8_t>> PagePNGs;
+};
@@ -36,6 +36,26 @@ void PNGWriter::save(const std::string& filename, int width, int height, int byt
 	}
 }
 
+void PNGWriter::save(std::vector<uint8_t>& output, int width, int height, int bytes_per_pixel, void* pixels)
+{
+	PNGImage image;
+	image.width = width;
+	image.height = height;
+	image.bytes_per_pixel = bytes_per_pixel;
+	image.pixel_ratio = 1.0f;
+	image.data = pixels;
+
+	output.clear();
+
+	PNGWriter writer;
+	writer.memory = &output;
+	writer.image = &image;
+	writer.write_magic();
+	writer.write_headers();
+	writer.write_data();
+	writer.write_chunk("IEND", nullptr, 0);
+}
+
 void PNGWriter::write_magic()
 {
 	unsigned char png_magic[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
@@ -171,7 +191,17 @@ void PNGWriter::write_chunk(const char name[4], const void *data, int size)
 
 void PNGWriter::write(const void *data, int size)
 {
-	fwrite(data, size, 1, file);
+	if (memory)
+	{
+		size_t pos = memory->size();
+		memory->resize(pos + size);
+		if (size > 0)
+			memcpy(memory->data() + pos, data, size);
+	}
+	else
+	{
+		fwrite(data, size, 1, file);
+	}
 }
 
 size_t PNGWriter::compressdata(DataBuffer *out, const DataBuffer *data, bool raw)
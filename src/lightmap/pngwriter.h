@@ -1,12 +1,15 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <vector>
 
 class PNGWriter
 {
 public:
 	static void save(const std::string& filename, int width, int height, int bytes_per_pixel, void* pixels);
+	static void save(std::vector<uint8_t>& output, int width, int height, int bytes_per_pixel, void* pixels);
 
 	struct DataBuffer
 	{
@@ -27,7 +30,8 @@ private:
 	};
 
 	const PNGImage* image;
-	FILE* file;
+	FILE* file = nullptr;
+	std::vector<uint8_t>* memory = nullptr;
 
 	class PNGCRC32
 	{
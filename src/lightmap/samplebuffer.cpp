@@ -0,0 +1,136 @@
+
+#include "samplebuffer.h"
+#include "framework/halffloat.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	const int MantissaBits = 9;
+	const int ExponentBias = 15;
+	const float MaxRGB9E5 = 65408.0f;	// 511/512 * 2^16
+
+	float ClampRGB9E5(float value)
+	{
+		return value > 0.0f ? std::min(value, MaxRGB9E5) : 0.0f;	// also catches NaN
+	}
+
+	// Follows the encoding given in EXT_texture_shared_exponent
+	uint32_t EncodeRGB9E5(const vec3& color)
+	{
+		float r = ClampRGB9E5(color.x);
+		float g = ClampRGB9E5(color.y);
+		float b = ClampRGB9E5(color.z);
+		float maxrgb = std::max(std::max(r, g), b);
+
+		int e;
+		std::frexp(maxrgb, &e);
+		int exponent = std::max(-ExponentBias - 1, e - 1) + 1 + ExponentBias;
+		float scale = std::ldexp(1.0f, MantissaBits + ExponentBias - exponent);
+		if ((int)std::floor(maxrgb * scale + 0.5f) == 1 << MantissaBits)
+		{
+			exponent++;
+			scale *= 0.5f;
+		}
+
+		uint32_t rm = (uint32_t)std::floor(r * scale + 0.5f);
+		uint32_t gm = (uint32_t)std::floor(g * scale + 0.5f);
+		uint32_t bm = (uint32_t)std::floor(b * scale + 0.5f);
+		return rm | (gm << 9) | (bm << 18) | ((uint32_t)exponent << 27);
+	}
+
+	vec3 DecodeRGB9E5(uint32_t value)
+	{
+		float scale = std::ldexp(1.0f, (int)(value >> 27) - ExponentBias - MantissaBits);
+		return vec3((value & 0x1ff) * scale, ((value >> 9) & 0x1ff) * scale, ((value >> 18) & 0x1ff) * scale);
+	}
+}
+
+void LightmapSampleBuffer::Allocate(size_t count, ESampleFormat format)
+{
+	Clear();
+
+	Format = format;
+	switch (format)
+	{
+	default:
+	case SAMPLES_Float: TexelBytes = 12; break;
+	case SAMPLES_Half: TexelBytes = 6; break;
+	case SAMPLES_RGB9E5: TexelBytes = 4; break;
+	}
+
+	Count = count;
+	Blocks.resize((count + BLOCK_SIZE - 1) >> BLOCK_SHIFT);
+	for (size_t i = 0; i < Blocks.size(); i++)
+	{
+		size_t texels = std::min<size_t>(BLOCK_SIZE, count - (i << BLOCK_SHIFT));
+		Blocks[i].reset(new uint8_t[texels * TexelBytes]());
+	}
+}
+
+void LightmapSampleBuffer::Clear()
+{
+	Blocks.clear();
+	Blocks.shrink_to_fit();
+	Count = 0;
+	FirstLive = 0;
+}
+
+void LightmapSampleBuffer::Set(size_t index, const vec3& color)
+{
+	uint8_t* texel = Blocks[index >> BLOCK_SHIFT].get() + (index & (BLOCK_SIZE - 1)) * TexelBytes;
+	switch (Format)
+	{
+	case SAMPLES_Float:
+		memcpy(texel, &color.x, 12);
+		break;
+	case SAMPLES_Half:
+		// Same conversion the pages use, so storing halfs loses nothing
+		floatToHalfArray(&color.x, (uint16_t*)texel, 3, -65000.0f, 65000.0f);
+		break;
+	case SAMPLES_RGB9E5:
+	{
+		uint32_t value = EncodeRGB9E5(color);
+		memcpy(texel, &value, 4);
+		break;
+	}
+	}
+}
+
+void LightmapSampleBuffer::Read(size_t first, size_t count, vec3* output) const
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t index = first + i;
+		const uint8_t* texel = Blocks[index >> BLOCK_SHIFT].get() + (index & (BLOCK_SIZE - 1)) * TexelBytes;
+		switch (Format)
+		{
+		case SAMPLES_Float:
+			memcpy(&output[i].x, texel, 12);
+			break;
+		case SAMPLES_Half:
+			halfToFloatArray((const uint16_t*)texel, &output[i].x, 3);
+			break;
+		case SAMPLES_RGB9E5:
+		{
+			uint32_t value;
+			memcpy(&value, texel, 4);
+			output[i] = DecodeRGB9E5(value);
+			break;
+		}
+		}
+	}
+}
+
+void LightmapSampleBuffer::Release(size_t index)
+{
+	size_t end = std::min(index >> BLOCK_SHIFT, Blocks.size());
+	for (; FirstLive < end; FirstLive++)
+		Blocks[FirstLive].reset();
+}
+
+size_t LightmapSampleBuffer::BytesAllocated() const
+{
+	return Count * TexelBytes;
+}
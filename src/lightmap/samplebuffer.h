@@ -0,0 +1,45 @@
+
+#pragma once
+
+#include "math/mathlib.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+enum ESampleFormat
+{
+	SAMPLES_Float,		// 12 bytes per texel, exact
+	SAMPLES_Half,		// 6 bytes per texel, the precision pages are stored at
+	SAMPLES_RGB9E5		// 4 bytes per texel, 9 bit mantissas with a shared exponent
+};
+
+// Holds the traced texels of every surface until they are copied into the
+// lightmap pages. Tracers accumulate a texel in float and store it once it
+// is complete. Texels live in fixed size blocks so the ones already copied
+// can be released while later surfaces are still waiting.
+class LightmapSampleBuffer
+{
+public:
+	void Allocate(size_t count, ESampleFormat format);
+	void Clear();
+
+	// Safe to call from several threads as long as the indices differ
+	void Set(size_t index, const vec3& color);
+	void Read(size_t first, size_t count, vec3* output) const;
+
+	// Frees the blocks holding only texels below index
+	void Release(size_t index);
+
+	size_t Size() const { return Count; }
+	size_t BytesAllocated() const;
+
+private:
+	enum { BLOCK_SHIFT = 16, BLOCK_SIZE = 1 << BLOCK_SHIFT };
+
+	ESampleFormat Format = SAMPLES_Float;
+	int TexelBytes = 12;
+	size_t Count = 0;
+	size_t FirstLive = 0;
+	std::vector<std::unique_ptr<uint8_t[]>> Blocks;
+};
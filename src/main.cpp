@@ -53,15 +53,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <string>
 #include <thread>
 
 #include "framework/zdray.h"
 #include "wad/wad.h"
 #include "level/level.h"
+#include "wad/pk3.h"
+#include "lightmap/bc6h.h"
+#include "lightmap/samplebuffer.h"
+#include "lightmap/maptracer.h"
+#include "framework/progress.h"
 #include "commandline/getopt.h"
 
 // MACROS ------------------------------------------------------------------
 
+// With --update, the wad is compacted once more than 1/COMPACT_FRACTION of it
+// is unused.
+#define COMPACT_FRACTION	4
+
 #ifndef M_PI
 #define M_PI            3.14159265358979323846
 #endif
@@ -75,6 +85,9 @@
 // PRIVATE FUNCTION PROTOTYPES ---------------------------------------------
 
 static void ParseArgs(int argc, char **argv);
+static int ProcessWad(FWadReader &inwad, FWadWriter &outwad);
+static char *MakeTempName(const char *name);
+static std::string MakeExportName(const char *name, const char *map);
 static void ShowUsage();
 static void ShowVersion();
 static bool CheckInOutNames();
@@ -99,10 +112,14 @@ bool			 ConformNodes = false;
 bool			 NoPrune = false;
 EBlockmapMode	 BlockmapMode = EBM_Rebuild;
 ERejectMode		 RejectMode = ERM_DontTouch;
+bool			 ExactReject = false;
+bool			 UpdateInPlace = false;
 bool			 WriteComments = false;
 int				 MaxSegs = 64;
 int				 SplitCost = 8;
 int				 AAPreference = 16;
+int				 NodeCandidates = 1;
+ENodeMetric		 NodeMetric = ENM_Segs;
 bool			 CheckPolyobjs = true;
 bool			 ShowWarnings = false;
 bool			 NoTiming = false;
@@ -111,12 +128,25 @@ bool			 CompressGLNodes = true;// false;
 bool			 ForceCompression = true;// false;
 bool			 GLOnly = true;// false;
 bool			 V5GLNodes = false;
+int				 CompressLevel = 9;
 bool			 HaveSSE1, HaveSSE2;
 int				 SSELevel;
 int				 NumThreads = 0;
 int				 LMDims = 1024;
 bool			 CPURaytrace = false;
 bool			 VKDebug = false;
+EBC6HQuality	 BC6HQuality = BC6H_None;
+EProgressMode	 ProgressMode = PROGRESS_TTY;
+bool			 LightmapRotation = false;
+ESampleFormat	 SampleFormat = SAMPLES_Float;
+ETraceBackend	 TraceBackend = TRACE_BVH;
+bool			 AdaptiveSamples = false;
+int				 AdaptiveSamplesMin = 8;
+int				 AdaptiveSamplesMax = 64;
+bool			 ProgressiveBake = false;
+double			 ProgressiveTime = 0.0;
+const char		*ExportName = nullptr;
+const char		*PreviewName = nullptr;
 
 // PRIVATE DATA DEFINITIONS ------------------------------------------------
 
@@ -137,6 +167,7 @@ static option long_opts[] =
 	{"zero-reject",		no_argument,		0,	'R'},
 	{"full-reject",		no_argument,		0,	'e'},
 	{"no-reject",		no_argument,		0,	'E'},
+	{"exact-reject",	no_argument,		0,	1006},
 	{"partition",		required_argument,	0,	'p'},
 	{"split-cost",		required_argument,	0,	's'},
 	{"diagonal-cost",	required_argument,	0,	'd'},
@@ -148,17 +179,30 @@ static option long_opts[] =
 	{"extended",		no_argument,		0,	'X'},
 	{"gl-only",			no_argument,		0,	'x'},
 	{"gl-v5",			no_argument,		0,	'5'},
+	{"compress-level",	required_argument,	0,	1007},
 	{"no-sse",			no_argument,		0,  1002},
 	{"no-sse2",			no_argument,		0,  1003},
+	{"candidates",		required_argument,	0,  1004},
+	{"candidate-metric",required_argument,	0,  1005},
 	{"comments",		no_argument,		0,	'c'},
 	{"threads",			required_argument,	0,	'j'},
 	{"size",			required_argument,	0,	'S'},
 	{"cpu-raytrace",	no_argument,		0,	'C'},
 	{"vkdebug",			no_argument,		0,	'D'},
+	{"update",			no_argument,		0,	'u'},
+	{"bc6h",			optional_argument,	0,	1008},
+	{"export",			required_argument,	0,	1009},
+	{"progress",		required_argument,	0,	1010},
+	{"rotate-lightmaps",no_argument,		0,	1011},
+	{"sample-format",	required_argument,	0,	1012},
+	{"cpu-tracer",		required_argument,	0,	1013},
+	{"adaptive-samples",optional_argument,	0,	1014},
+	{"progressive",		optional_argument,	0,	1015},
+	{"preview",			required_argument,	0,	1016},
 	{0,0,0,0}
 };
 
-static const char short_opts[] = "wVgGvbNrReEm:o:f:p:s:d:PqtzZXx5cj:S:CD";
+static const char short_opts[] = "wVgGvbNrReEm:o:f:p:s:d:PqtzZXx5cj:S:CDu";
 
 // CODE --------------------------------------------------------------------
 
@@ -185,6 +229,11 @@ int main(int argc, char **argv)
 		InName = argv[optind];
 	}
 
+	if (UpdateInPlace)
+	{
+		OutName = InName;
+	}
+
 #ifndef DISABLE_SSE
 	CheckSSE();
 #endif
@@ -193,81 +242,52 @@ int main(int argc, char **argv)
 	{
 		START_COUNTER(t1a, t1b, t1c)
 
-		if (CheckInOutNames())
+		if (IsPk3(InName))
 		{
-			// When the input and output files are the same, output will go to
-			// a temporary file. After everything is done, the input file is
-			// deleted and the output file is renamed to match the input file.
-
-			char *out = new char[strlen(OutName) + 3], *dot;
-
-			if (out == nullptr)
-			{
-				throw std::runtime_error("Could not create temporary file name.");
-			}
-
-			strcpy(out, OutName);
-			dot = strrchr(out, '.');
-			if (dot && (dot[1] == 'w' || dot[1] == 'W')
-				&& (dot[2] == 'a' || dot[2] == 'A')
-				&& (dot[3] == 'd' || dot[3] == 'D')
-				&& dot[4] == 0)
-			{
-				// *.wad becomes *.daw
-				dot[1] = 'd';
-				dot[3] = 'w';
-			}
-			else
+			if (CheckInOutNames())
 			{
-				// * becomes *.x
-				strcat(out, ".x");
+				OutName = MakeTempName(OutName);
+				fixSame = true;
 			}
-			OutName = out;
-			fixSame = true;
+			ProcessPk3(InName, OutName, ProcessWad);
 		}
-
+		else
 		{
 			FWadReader inwad(InName);
-			FWadWriter outwad(OutName, inwad.IsIWAD());
+			bool append = false;
 
-			int lump = 0;
-			int max = inwad.NumLumps();
-
-			while (lump < max)
+			if (UpdateInPlace)
 			{
-				if (inwad.IsMap(lump) && (!Map || stricmp(inwad.LumpName(lump), Map) == 0))
-				{
-					START_COUNTER(t2a, t2b, t2c)
-					FProcessor builder(inwad, lump);
-					builder.BuildNodes();
-					builder.BuildLightmaps();
-					builder.Write(outwad);
-					END_COUNTER(t2a, t2b, t2c, "   %.3f seconds.\n")
-
-					lump = inwad.LumpAfterMap(lump);
-				}
-				else if (inwad.IsGLNodes(lump))
-				{
-					// Ignore GL nodes from the input for any maps we process.
-					if (BuildNodes && (Map == nullptr || stricmp(inwad.LumpName(lump) + 3, Map) == 0))
-					{
-						lump = inwad.SkipGLNodes(lump);
-					}
-					else
-					{
-						outwad.CopyLump(inwad, lump);
-						++lump;
-					}
-				}
-				else
+				// Only rewrite the whole file once enough of it is dead space.
+				size_t unused = inwad.UnusedBytes();
+				append = unused <= inwad.FileBytes() / COMPACT_FRACTION;
+				if (!append)
 				{
-					//printf ("copy %s\n", inwad.LumpName (lump));
-					outwad.CopyLump(inwad, lump);
-					++lump;
+					printf("Compacting %s (%zu unused bytes)\n", InName, unused);
 				}
 			}
 
-			outwad.Close();
+			if (!append && CheckInOutNames())
+			{
+				// When the input and output files are the same, output will go to
+				// a temporary file. After everything is done, the input file is
+				// deleted and the output file is renamed to match the input file.
+				OutName = MakeTempName(OutName);
+				fixSame = true;
+			}
+
+			if (append)
+			{
+				FWadWriter outwad(inwad, InName);
+				ProcessWad(inwad, outwad);
+				outwad.Close();
+			}
+			else
+			{
+				FWadWriter outwad(OutName, inwad.IsIWAD());
+				ProcessWad(inwad, outwad);
+				outwad.Close();
+			}
 		}
 
 		if (fixSame)
@@ -308,6 +328,126 @@ int main(int argc, char **argv)
 	return 0;
 }
 
+//==========================================================================
+//
+// ProcessWad
+//
+// Builds every selected map and copies everything else. Returns the
+// number of maps built.
+//
+//==========================================================================
+
+static int ProcessWad(FWadReader &inwad, FWadWriter &outwad)
+{
+	int built = 0;
+	int lump = 0;
+	int max = inwad.NumLumps();
+
+	while (lump < max)
+	{
+		if (inwad.IsMap(lump) && (!Map || stricmp(inwad.LumpName(lump), Map) == 0))
+		{
+			START_COUNTER(t2a, t2b, t2c)
+			FProcessor builder(inwad, lump);
+			builder.BuildNodes();
+			std::function<void()> preview;
+			if (PreviewName)
+			{
+				preview = [&]() {
+					builder.WritePreview(MakeExportName(PreviewName, inwad.LumpName(lump)));
+					if (ExportName)
+					{
+						builder.ExportMesh(MakeExportName(ExportName, inwad.LumpName(lump)));
+					}
+				};
+			}
+			builder.BuildLightmaps(preview);
+			builder.Write(outwad);
+			if (ExportName)
+			{
+				builder.ExportMesh(MakeExportName(ExportName, inwad.LumpName(lump)));
+			}
+			END_COUNTER(t2a, t2b, t2c, "   %.3f seconds.\n")
+
+			lump = inwad.LumpAfterMap(lump);
+			built++;
+		}
+		else if (inwad.IsGLNodes(lump))
+		{
+			// Ignore GL nodes from the input for any maps we process.
+			if (BuildNodes && (Map == nullptr || stricmp(inwad.LumpName(lump) + 3, Map) == 0))
+			{
+				lump = inwad.SkipGLNodes(lump);
+			}
+			else
+			{
+				outwad.CopyLump(inwad, lump);
+				++lump;
+			}
+		}
+		else
+		{
+			//printf ("copy %s\n", inwad.LumpName (lump));
+			outwad.CopyLump(inwad, lump);
+			++lump;
+		}
+	}
+	return built;
+}
+
+//==========================================================================
+//
+// MakeTempName
+//
+// *.wad becomes *.daw, anything else gets .x appended.
+//
+//==========================================================================
+
+static char *MakeTempName(const char *name)
+{
+	char *out = new char[strlen(name) + 3], *dot;
+
+	strcpy(out, name);
+	dot = strrchr(out, '.');
+	if (dot && (dot[1] == 'w' || dot[1] == 'W')
+		&& (dot[2] == 'a' || dot[2] == 'A')
+		&& (dot[3] == 'd' || dot[3] == 'D')
+		&& dot[4] == 0)
+	{
+		// *.wad becomes *.daw
+		dot[1] = 'd';
+		dot[3] = 'w';
+	}
+	else
+	{
+		// * becomes *.x
+		strcat(out, ".x");
+	}
+	return out;
+}
+
+//==========================================================================
+//
+// MakeExportName
+//
+// level.obj becomes level_MAP01.obj, so each map gets its own files.
+//
+//==========================================================================
+
+static std::string MakeExportName(const char *name, const char *map)
+{
+	std::string out = name;
+	size_t slash = out.find_last_of("/\\");
+	size_t dot = out.find_last_of('.');
+
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+	{
+		dot = out.size();
+	}
+	out.insert(dot, std::string("_") + map);
+	return out;
+}
+
 //==========================================================================
 //
 // ParseArgs
@@ -430,6 +570,32 @@ static void ParseArgs(int argc, char **argv)
 		case 1003:		// Disable only SSE2 ClassifyLine routine
 			HaveSSE2 = false;
 			break;
+		case 1004:		// Build several node trees and keep the best
+			NodeCandidates = atoi(optarg);
+			if (NodeCandidates < 1)
+			{
+				NodeCandidates = 1;
+			}
+			break;
+		case 1005:
+			if (stricmp(optarg, "segs") == 0)
+			{
+				NodeMetric = ENM_Segs;
+			}
+			else if (stricmp(optarg, "size") == 0)
+			{
+				NodeMetric = ENM_Size;
+			}
+			else if (stricmp(optarg, "depth") == 0)
+			{
+				NodeMetric = ENM_Depth;
+			}
+			else
+			{
+				printf("Unknown candidate metric '%s'. Use segs, size or depth.\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'j':
 			NumThreads = atoi(optarg);
 			break;
@@ -445,6 +611,135 @@ static void ParseArgs(int argc, char **argv)
 		case 'D':
 			VKDebug = true;
 			break;
+		case 'u':
+			UpdateInPlace = true;
+			break;
+		case 1006:		// Rebuild the reject with portal clipping
+			RejectMode = ERM_Rebuild;
+			ExactReject = true;
+			break;
+		case 1007:		// zlib level for compressed lumps
+			CompressLevel = atoi(optarg);
+			if (CompressLevel < 0)
+			{
+				CompressLevel = 0;
+			}
+			else if (CompressLevel > 9)
+			{
+				CompressLevel = 9;
+			}
+			break;
+		case 1008:		// BC6H compressed lightmap pages
+			if (optarg == nullptr || stricmp(optarg, "normal") == 0)
+			{
+				BC6HQuality = BC6H_Normal;
+			}
+			else if (stricmp(optarg, "fast") == 0)
+			{
+				BC6HQuality = BC6H_Fast;
+			}
+			else if (stricmp(optarg, "high") == 0)
+			{
+				BC6HQuality = BC6H_High;
+			}
+			else
+			{
+				printf("Unknown BC6H quality '%s'. Use fast, normal or high.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 1009:		// Export the lit mesh of each map
+			ExportName = optarg;
+			break;
+		case 1010:		// How long running phases report progress
+			if (stricmp(optarg, "tty") == 0)
+			{
+				ProgressMode = PROGRESS_TTY;
+			}
+			else if (stricmp(optarg, "json") == 0)
+			{
+				ProgressMode = PROGRESS_JSON;
+			}
+			else if (stricmp(optarg, "none") == 0)
+			{
+				ProgressMode = PROGRESS_None;
+			}
+			else
+			{
+				printf("Unknown progress mode '%s'. Use tty, json or none.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 1011:		// Let the atlas packer turn blocks on their side
+			LightmapRotation = true;
+			break;
+		case 1012:		// How traced texels are held until pages are built
+			if (stricmp(optarg, "float") == 0)
+			{
+				SampleFormat = SAMPLES_Float;
+			}
+			else if (stricmp(optarg, "half") == 0)
+			{
+				SampleFormat = SAMPLES_Half;
+			}
+			else if (stricmp(optarg, "rgb9e5") == 0)
+			{
+				SampleFormat = SAMPLES_RGB9E5;
+			}
+			else
+			{
+				printf("Unknown sample format '%s'. Use float, half or rgb9e5.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 1013:		// How the CPU ray tracer finds hits
+			if (stricmp(optarg, "bvh") == 0)
+			{
+				TraceBackend = TRACE_BVH;
+			}
+			else if (stricmp(optarg, "map") == 0)
+			{
+				TraceBackend = TRACE_Map;
+			}
+			else if (stricmp(optarg, "check") == 0)
+			{
+				TraceBackend = TRACE_Check;
+			}
+			else
+			{
+				printf("Unknown CPU tracer '%s'. Use bvh, map or check.\n", optarg);
+				exit(1);
+			}
+			break;
+		case 1014:		// Pick texel sizes per surface from a coarse bake
+			AdaptiveSamples = true;
+			if (optarg != nullptr)
+			{
+				if (sscanf(optarg, "%d,%d", &AdaptiveSamplesMin, &AdaptiveSamplesMax) != 2 || AdaptiveSamplesMin <= 0 || AdaptiveSamplesMax < AdaptiveSamplesMin)
+				{
+					printf("Invalid adaptive sample range '%s'. Use MIN,MAX, for example 8,64.\n", optarg);
+					exit(1);
+				}
+				AdaptiveSamplesMin = Math::RoundPowerOfTwo(AdaptiveSamplesMin);
+				AdaptiveSamplesMax = Math::RoundPowerOfTwo(AdaptiveSamplesMax);
+			}
+			break;
+		case 1015:		// Bake in passes of increasing quality
+			ProgressiveBake = true;
+			if (optarg != nullptr)
+			{
+				char *end;
+				ProgressiveTime = strtod(optarg, &end);
+				if (end == optarg || *end != '\0' || !(ProgressiveTime >= 0.0))
+				{
+					printf("Invalid progressive time limit '%s'. Use a number of seconds, for example 30.\n", optarg);
+					exit(1);
+				}
+			}
+			break;
+		case 1016:		// Write each progressive pass of a map as its own wad
+			PreviewName = optarg;
+			break;
 		case 1000:
 			ShowUsage();
 			exit(0);
@@ -464,9 +759,10 @@ static void ParseArgs(int argc, char **argv)
 static void ShowUsage()
 {
 	printf(
-		"Usage: zdray [options] sourcefile.wad\n"
+		"Usage: zdray [options] sourcefile.wad|sourcefile.pk3\n"
 		"  -m, --map=MAP            Only affect the specified map\n"
 		"  -o, --output=FILE        Write output to FILE instead of tmp.wad\n"
+		"  -u, --update             Update sourcefile in place, appending only rebuilt maps\n"
 		"  -c, --comments           Write UDMF index comments\n"
 		"  -q, --no-prune           Keep unused sidedefs and sectors\n"
 		"  -N, --no-nodes           Do not rebuild nodes\n"
@@ -477,18 +773,31 @@ static void ShowUsage()
 		"  -X, --extended           Create extended nodes (including GL nodes, if built)\n"
 		"  -z, --compress           Compress the nodes (including GL nodes, if built)\n"
 		"  -Z, --compress-normal    Compress normal nodes but not GL nodes\n"
+		"      --compress-level=NNN zlib level for compressed lumps, 0-9 (default %d)\n"
 		"  -b, --empty-blockmap     Create an empty blockmap\n"
 		"  -r, --empty-reject       Create an empty reject table\n"
 		"  -R, --zero-reject        Create a reject table of all zeroes\n"
-		//"  -e, --full-reject        Rebuild reject table (unsupported)\n"
+		"  -e, --full-reject        Rebuild reject table\n"
+		"      --exact-reject       Rebuild reject table with exact sight checks (slower)\n"
 		"  -E, --no-reject          Leave reject table untouched\n"
 		"  -p, --partition=NNN      Maximum segs to consider at each node (default %d)\n"
 		"  -s, --split-cost=NNN     Cost for splitting segs (default %d)\n"
 		"  -d, --diagonal-cost=NNN  Cost for avoiding diagonal splitters (default %d)\n"
 		"  -P, --no-polyobjs        Do not check for polyobject subsector splits\n"
-		"  -j, --threads=NNN        Number of threads used for raytracing (default %d)\n"
+		"      --candidates=NNN     Build NNN node trees with varied costs and keep the best (max 12)\n"
+		"      --candidate-metric=M Pick the best tree by segs, size or depth (default segs)\n"
+		"  -j, --threads=NNN        Number of worker threads for all parallel stages (default %d)\n"
 		"  -S, --size=NNN           lightmap texture dimensions for width and height must be in powers of two (1, 2, 4, 8, 16, etc)\n"
 		"  -C, --cpu-raytrace       Use the CPU for ray tracing\n"
+		"      --cpu-tracer=TYPE    Trace triangles (bvh), map lines and planes (map) or both and report differences (check) (default bvh)\n"
+		"      --adaptive-samples[=MIN,MAX] Bake coarsely first, then give each surface a texel size of MIN to MAX map units from its lighting (default 8,64)\n"
+		"      --progressive[=SECS] Bake with doubling samples per pass, stopping after SECS seconds if given (uses the CPU)\n"
+		"      --preview=FILE       With --progressive, write each pass of a map to FILE, also rewriting --export files\n"
+		"      --rotate-lightmaps   Allow lightmap blocks to be rotated when packing pages\n"
+		"      --sample-format=FMT  Hold traced texels as float, half or rgb9e5 (default float)\n"
+		"      --bc6h[=QUALITY]     Store lightmap pages as BC6H, QUALITY is fast, normal or high (default normal)\n"
+		"      --export=FILE        Export each map's lit mesh as OBJ, or binary glTF if FILE ends in .glb\n"
+		"      --progress=MODE      Report progress as tty, json lines on stderr or none (default tty)\n"
 		"  -D, --vkdebug            Print messages from the vulkan validation layer\n"
 		"  -w, --warn               Show warning messages\n"
 #if HAVE_TIMING
@@ -499,6 +808,7 @@ static void ShowUsage()
 #ifndef _WIN32
 		"\n"
 #endif
+		, CompressLevel
 		, MaxSegs /* Partition size */
 		, SplitCost
 		, AAPreference
@@ -42,9 +42,12 @@
 FNodeBuilder::FNodeBuilder (FLevel &level,
 							TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
 							const char *name, bool makeGLnodes)
-	: Level(level), SegsStuffed(0), MapName(name)
+	: Level(level), SegsStuffed(0), MapName(name), Quiet(false)
 {
-	VertexMap = new FVertexMap (*this, Level.MinX, Level.MinY, Level.MaxX, Level.MaxY);
+	Costs.MaxSegs = MaxSegs;
+	Costs.SplitCost = SplitCost;
+	Costs.AAPreference = AAPreference;
+	VertexMap = new FVertexMap (*this, Level.NumVertices);
 	GLNodes = makeGLnodes;
 	FindUsedVertices (Level.Vertices, Level.NumVertices);
 	MakeSegsFromSides ();
@@ -53,6 +56,24 @@ FNodeBuilder::FNodeBuilder (FLevel &level,
 	BuildTree ();
 }
 
+FNodeBuilder::FNodeBuilder (FLevel &level,
+							TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
+							const char *name, bool makeGLnodes, const FCosts &costs, bool quiet)
+	: Level(level), Costs(costs), SegsStuffed(0), MapName(name), Quiet(quiet)
+{
+	VertexMap = new FVertexMap (*this, Level.NumVertices);
+	GLNodes = makeGLnodes;
+	FindUsedVertices (Level.Vertices, Level.NumVertices);
+	MakeSegsFromSides ();
+	FindPolyContainers (polyspots, anchors);
+	GroupSegPlanes ();
+}
+
+void FNodeBuilder::Build ()
+{
+	BuildTree ();
+}
+
 FNodeBuilder::~FNodeBuilder()
 {
 	if (VertexMap != 0)
@@ -65,12 +86,12 @@ void FNodeBuilder::BuildTree ()
 {
 	fixed_t bbox[4];
 
-	fprintf (stderr, "   BSP:   0.0%%\r");
+	if (!Quiet) fprintf (stderr, "   BSP:   0.0%%\r");
 	HackSeg = DWORD_MAX;
 	HackMate = DWORD_MAX;
 	CreateNode (0, Segs.Size(), bbox);
 	CreateSubsectorsForReal ();
-	fprintf (stderr, "   BSP: 100.0%%\n");
+	if (!Quiet) fprintf (stderr, "   BSP: 100.0%%\n");
 }
 
 uint32_t FNodeBuilder::CreateNode (uint32_t set, unsigned int count, fixed_t bbox[4])
@@ -82,7 +103,7 @@ uint32_t FNodeBuilder::CreateNode (uint32_t set, unsigned int count, fixed_t bbo
 	// When building GL nodes, count may not be an exact count of the number of segs
 	// in this set. That's okay, because we just use it to get a skip count, so an
 	// estimate is fine.
-	skip = int(count / MaxSegs);
+	skip = int(count / Costs.MaxSegs);
 
 	if ((selstat = SelectSplitter (set, node, splitseg, skip, true)) > 0 ||
 		(skip > 0 && (selstat = SelectSplitter (set, node, splitseg, 1, true)) > 0) ||
@@ -163,7 +184,7 @@ uint32_t FNodeBuilder::CreateSubsector (uint32_t set, fixed_t bbox[4])
 	}
 
 	SegsStuffed += count;
-	if ((SegsStuffed & ~63) != ((SegsStuffed - count) & ~63))
+	if (!Quiet && (SegsStuffed & ~63) != ((SegsStuffed - count) & ~63))
 	{
 		int percent = (int)(SegsStuffed * 1000.0 / Segs.Size());
 		fprintf (stderr, "   BSP: %3d.%d%%\r", percent/10, percent%10);
@@ -576,12 +597,12 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 					specialSegs[side]++;
 				}
 				// Add some weight to the score for unsplit lines
-				score += SplitCost;	
+				score += Costs.SplitCost;
 			}
 			else
 			{
 				// Minisegs don't count quite as much for nosplitting
-				score += SplitCost / 4;
+				score += Costs.SplitCost / 4;
 			}
 			break;
 
@@ -724,7 +745,7 @@ int FNodeBuilder::Heuristic (node_t &node, uint32_t set, bool honorNoSplit)
 		}
 		else
 		{
-			score += segsInSet/AAPreference;
+			score += segsInSet/Costs.AAPreference;
 		}
 	}
 
@@ -889,6 +910,7 @@ void FNodeBuilder::SplitSegs (uint32_t set, node_t &node, uint32_t splitseg, uin
 		}
 		set = next;
 	}
+	Events.Sort ();
 	FixSplitSharers ();
 	if (GLNodes)
 	{
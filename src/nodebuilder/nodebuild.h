@@ -14,38 +14,32 @@ struct FEventInfo
 
 struct FEvent
 {
-	FEvent *Parent, *Left, *Right;
 	double Distance;
 	FEventInfo Info;
+	unsigned int Order;
 };
 
-class FEventTree
+// Vertices on the current splitter, ordered by their distance along it. Events
+// are appended while the segs are split and sorted once before they are used,
+// so the storage is reused for every splitter without any per-event allocation.
+class FEventList
 {
 public:
-	FEventTree ();
-	~FEventTree ();
+	int GetMinimum () const { return Events.Size() > 0 ? 0 : -1; }
+	int GetSuccessor (int event) const { return event + 1 < (int)Events.Size() ? event + 1 : -1; }
+	int GetPredecessor (int event) const { return event > 0 ? event - 1 : -1; }
 
-	FEvent *GetMinimum ();
-	FEvent *GetSuccessor (FEvent *event) const { FEvent *node = Successor(event); return node == &Nil ? nullptr : node; }
-	FEvent *GetPredecessor (FEvent *event) const { FEvent *node = Predecessor(event); return node == &Nil ? nullptr : node; }
+	FEvent &operator[] (int event) const { return Events[event]; }
 
-	FEvent *GetNewNode ();
-	void Insert (FEvent *event);
-	FEvent *FindEvent (double distance) const;
-	void DeleteAll ();
+	void Add (double distance, const FEventInfo &info);
+	void Sort ();
+	int FindEvent (double distance) const;
+	void DeleteAll () { Events.Clear (); }
 
-	void PrintTree () const { PrintTree (Root); }
+	void PrintTree () const;
 
 private:
-	FEvent Nil;
-	FEvent *Root;
-	FEvent *Spare;
-
-	void DeletionTraverser (FEvent *event);
-	FEvent *Successor (FEvent *event) const;
-	FEvent *Predecessor (FEvent *event) const;
-
-	void PrintTree (const FEvent *event) const;
+	TArray<FEvent> Events;
 };
 
 struct FSimpleVert
@@ -119,35 +113,40 @@ class FNodeBuilder
 		bool Forward;
 	};
 
-	// Like a blockmap, but for vertices instead of lines
+	// Hashes vertices by their position so that coincident vertices can be
+	// found without scanning. Memory use depends only on the vertex count.
 	class FVertexMap
 	{
 	public:
-		FVertexMap (FNodeBuilder &builder, fixed_t minx, fixed_t miny, fixed_t maxx, fixed_t maxy);
+		FVertexMap (FNodeBuilder &builder, int expectedVerts);
 		~FVertexMap ();
 
 		int SelectVertexExact (FPrivVert &vert);
 		int SelectVertexClose (FPrivVert &vert);
 
 	private:
-		FNodeBuilder &MyBuilder;
-		TArray<int> *VertexGrid;
+		struct FCell
+		{
+			uint64_t Key;
+			int First;		// Most recently inserted vertex in this cell, -1 if the slot is empty
+		};
 
-		fixed_t MinX, MinY, MaxX, MaxY;
-		int BlocksWide, BlocksTall;
+		FNodeBuilder &MyBuilder;
+		TArray<FCell> Cells;		// Open addressing table; the size is always a power of 2
+		TArray<int> NextInCell;		// Chains the vertices sharing a cell, indexed by vertex
+		unsigned int UsedCells;
 
-		enum { BLOCK_SHIFT = 8 + FRACBITS };
-		enum { BLOCK_SIZE = 1 << BLOCK_SHIFT };
+		// Cells must be larger than VERTEX_EPSILON, so any vertex close enough to
+		// be merged is in the same cell as the new one or in one of its 8 neighbors.
+		enum { CELL_SHIFT = 3 };
 
-		int InsertVertex (FPrivVert &vert);
-		inline int GetBlock (fixed_t x, fixed_t y)
+		static uint64_t MakeKey (int cellx, int celly)
 		{
-			assert (x >= MinX);
-			assert (y >= MinY);
-			assert (x <= MaxX);
-			assert (y <= MaxY);
-			return (unsigned(x - MinX) >> BLOCK_SHIFT) + (unsigned(y - MinY) >> BLOCK_SHIFT) * BlocksWide;
+			return (uint64_t(uint32_t(cellx)) << 32) | uint32_t(celly);
 		}
+		unsigned int FindCell (uint64_t key) const;
+		void GrowCells ();
+		int InsertVertex (FPrivVert &vert);
 	};
 
 	friend class FVertexMap;
@@ -160,11 +159,28 @@ public:
 		fixed_t x, y;
 	};
 
+	// Split heuristics used when choosing partition lines
+	struct FCosts
+	{
+		int MaxSegs;
+		int SplitCost;
+		int AAPreference;
+	};
+
+	// Builds the tree immediately using the global MaxSegs, SplitCost and AAPreference.
 	FNodeBuilder (FLevel &level,
 		TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
 		const char *name, bool makeGLnodes);
+
+	// Only prepares the segs. The tree is not built until Build is called, which
+	// does not touch the level and may therefore run on another thread.
+	FNodeBuilder (FLevel &level,
+		TArray<FPolyStart> &polyspots, TArray<FPolyStart> &anchors,
+		const char *name, bool makeGLnodes, const FCosts &costs, bool quiet);
 	~FNodeBuilder ();
 
+	void Build ();
+
 	void GetVertices (WideVertex *&verts, int &count);
 	void GetNodes (MapNodeEx *&nodes, int &nodeCount,
 		MapSegEx *&segs, int &segCount,
@@ -174,6 +190,14 @@ public:
 		MapSegGLEx *&segs, int &segCount,
 		MapSubsectorEx *&ssecs, int &subCount);
 
+	// Reads the size of the built tree without extracting it, which would
+	// need the level to hold this builder's vertices. Minisegs are only
+	// counted for GL nodes, and segs added to close GL subsectors are not.
+	int NumVertices () const { return Vertices.Size(); }
+	int NumSubsectors () const { return Subsectors.Size(); }
+	int CountSegs (bool minisegs) const;
+	const TArray<node_t> &GetNodeTree () const { return Nodes; }
+
 	//  < 0 : in front of line
 	// == 0 : on line
 	//  > 0 : behind line
@@ -195,17 +219,19 @@ private:
 
 	TArray<int> Touched;	// Loops a splitter touches on a vertex
 	TArray<int> Colinear;	// Loops with edges colinear to a splitter
-	FEventTree Events;		// Vertices intersected by the current splitter
+	FEventList Events;		// Vertices intersected by the current splitter
 	TArray<FSplitSharer> SplitSharers;	// Segs collinear with the current splitter
 
 	uint32_t HackSeg;			// Seg to force to back of splitter
 	uint32_t HackMate;			// Seg to use in front of hack seg
 	FLevel &Level;
 	bool GLNodes;
+	FCosts Costs;
 
 	// Progress meter stuff
 	int SegsStuffed;
 	const char *MapName;
+	bool Quiet;
 
 	void FindUsedVertices (WideVertex *vertices, int max);
 	void BuildTree ();
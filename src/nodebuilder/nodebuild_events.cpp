@@ -19,189 +19,78 @@
 */
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
 #include "framework/zdray.h"
 #include "nodebuilder/nodebuild.h"
 
-FEventTree::FEventTree ()
-: Root (&Nil), Spare (nullptr)
+void FEventList::Add (double distance, const FEventInfo &info)
 {
-	memset (&Nil, 0, sizeof(Nil));
-}
-
-FEventTree::~FEventTree ()
-{
-	FEvent *probe;
+	FEvent event;
 
-	DeleteAll ();
-	probe = Spare;
-	while (probe != nullptr)
-	{
-		FEvent *next = probe->Left;
-		delete probe;
-		probe = next;
-	}
+	event.Distance = distance;
+	event.Info = info;
+	event.Order = Events.Size();
+	Events.Push (event);
 }
 
-void FEventTree::DeleteAll ()
+// Sorts the events by distance. When several events share a distance, only
+// the one that was added first is kept.
+void FEventList::Sort ()
 {
-	DeletionTraverser (Root);
-	Root = &Nil;
-}
+	unsigned int count = Events.Size();
 
-void FEventTree::DeletionTraverser (FEvent *node)
-{
-	if (node != &Nil && node != nullptr)
+	if (count < 2)
 	{
-		DeletionTraverser (node->Left);
-		DeletionTraverser (node->Right);
-		node->Left = Spare;
-		Spare = node;
+		return;
 	}
-}
-
-FEvent *FEventTree::GetNewNode ()
-{
-	FEvent *node;
 
-	if (Spare != nullptr)
+	FEvent *events = &Events[0];
+	std::sort (events, events + count, [](const FEvent &a, const FEvent &b)
 	{
-		node = Spare;
-		Spare = node->Left;
-	}
-	else
-	{
-		node = new FEvent;
-	}
-	return node;
-}
+		return a.Distance < b.Distance || (a.Distance == b.Distance && a.Order < b.Order);
+	});
 
-void FEventTree::Insert (FEvent *z)
-{
-	FEvent *y = &Nil;
-	FEvent *x = Root;
-
-	while (x != &Nil)
+	unsigned int unique = 1;
+	for (unsigned int i = 1; i < count; ++i)
 	{
-		y = x;
-		if (z->Distance < x->Distance)
+		if (events[i].Distance != events[unique-1].Distance)
 		{
-			x = x->Left;
+			events[unique++] = events[i];
 		}
-		else
-		{
-			x = x->Right;
-		}
-	}
-	z->Parent = y;
-	if (y == &Nil)
-	{
-		Root = z;
 	}
-	else if (z->Distance < y->Distance)
-	{
-		y->Left = z;
-	}
-	else
-	{
-		y->Right = z;
-	}
-	z->Left = &Nil;
-	z->Right = &Nil;
+	Events.Resize (unique);
 }
 
-FEvent *FEventTree::Successor (FEvent *event) const
+int FEventList::FindEvent (double key) const
 {
-	if (event->Right != &Nil)
-	{
-		event = event->Right;
-		while (event->Left != &Nil)
-		{
-			event = event->Left;
-		}
-		return event;
-	}
-	else
-	{
-		FEvent *y = event->Parent;
-		while (y != &Nil && event == y->Right)
-		{
-			event = y;
-			y = y->Parent;
-		}
-		return y;
-	}
-}
+	int lo = 0, hi = (int)Events.Size() - 1;
 
-FEvent *FEventTree::Predecessor (FEvent *event) const
-{
-	if (event->Left != &Nil)
+	while (lo <= hi)
 	{
-		event = event->Left;
-		while (event->Right != &Nil)
-		{
-			event = event->Right;
-		}
-		return event;
-	}
-	else
-	{
-		FEvent *y = event->Parent;
-		while (y != &Nil && event == y->Left)
-		{
-			event = y;
-			y = y->Parent;
-		}
-		return y;
-	}
-}
-
-FEvent *FEventTree::FindEvent (double key) const
-{
-	FEvent *node = Root;
+		int mid = (lo + hi) >> 1;
+		double dist = Events[mid].Distance;
 
-	while (node != &Nil)
-	{
-		if (node->Distance == key)
+		if (dist == key)
 		{
-			return node;
+			return mid;
 		}
-		else if (node->Distance > key)
+		else if (dist > key)
 		{
-			node = node->Left;
+			hi = mid - 1;
 		}
 		else
 		{
-			node = node->Right;
+			lo = mid + 1;
 		}
 	}
-	return nullptr;
-}
-
-FEvent *FEventTree::GetMinimum ()
-{
-	FEvent *node = Root;
-
-	if (node == &Nil)
-	{
-		return nullptr;
-	}
-	while (node->Left != &Nil)
-	{
-		node = node->Left;
-	}
-	return node;
+	return -1;
 }
 
-void FEventTree::PrintTree (const FEvent *event) const
+void FEventList::PrintTree () const
 {
-	if (event->Left != &Nil)
-	{
-		PrintTree (event->Left);
-	}
-	printf (" Distance %g, vertex %d, seg %u\n",
-		sqrt(event->Distance/4294967296.0), event->Info.Vertex, (unsigned)event->Info.FrontSeg);
-	if (event->Right != &Nil)
+	for (unsigned int i = 0; i < Events.Size(); ++i)
 	{
-		PrintTree (event->Right);
+		printf (" Distance %g, vertex %d, seg %u\n",
+			sqrt(Events[i].Distance/4294967296.0), Events[i].Info.Vertex, (unsigned)Events[i].Info.FrontSeg);
 	}
 }
@@ -389,6 +389,24 @@ void FNodeBuilder::GetVertices (WideVertex *&verts, int &count)
 	}
 }
 
+int FNodeBuilder::CountSegs (bool minisegs) const
+{
+	int count = 0;
+	for (unsigned int i = 0; i < Subsectors.Size(); ++i)
+	{
+		uint32_t first = Subsectors[i].firstline;
+		uint32_t max = first + Subsectors[i].numlines;
+		for (uint32_t j = first; j < max; ++j)
+		{
+			if (minisegs || Segs[SegList[j].SegNum].linedef != -1)
+			{
+				++count;
+			}
+		}
+	}
+	return count;
+}
+
 void FNodeBuilder::GetNodes (MapNodeEx *&outNodes, int &nodeCount,
 	MapSegEx *&outSegs, int &segCount,
 	MapSubsectorEx *&outSubs, int &subCount)
@@ -42,16 +42,10 @@ double FNodeBuilder::AddIntersection (const node_t &node, int vertex)
 	FPrivVert *v = &Vertices[vertex];
 	double dist = (double(v->x) - node.x)*(node.dx) + (double(v->y) - node.y)*(node.dy);
 
-	FEvent *event = Events.FindEvent (dist);
-
-	if (event == nullptr)
-	{
-		event = Events.GetNewNode ();
-		event->Distance = dist;
-		event->Info = defaultInfo;
-		event->Info.Vertex = vertex;
-		Events.Insert (event);
-	}
+	// Duplicate distances are weeded out when the events are sorted.
+	FEventInfo info = defaultInfo;
+	info.Vertex = vertex;
+	Events.Add (dist, info);
 
 	return dist;
 }
@@ -69,10 +63,10 @@ void FNodeBuilder::FixSplitSharers ()
 	{
 		uint32_t seg = SplitSharers[i].Seg;
 		int v2 = Segs[seg].v2;
-		FEvent *event = Events.FindEvent (SplitSharers[i].Distance);
-		FEvent *next;
+		int event = Events.FindEvent (SplitSharers[i].Distance);
+		int next;
 
-		if (event == nullptr)
+		if (event < 0)
 		{ // Should not happen
 			continue;
 		}
@@ -84,12 +78,12 @@ void FNodeBuilder::FixSplitSharers ()
 			Segs[seg].v2,
 			Vertices[Segs[seg].v2].x>>16,
 			Vertices[Segs[seg].v2].y>>16,
-			SplitSharers[i].Distance, event->Distance));
+			SplitSharers[i].Distance, Events[event].Distance));
 
 		if (SplitSharers[i].Forward)
 		{
 			event = Events.GetSuccessor (event);
-			if (event == nullptr)
+			if (event < 0)
 			{
 				continue;
 			}
@@ -98,14 +92,14 @@ void FNodeBuilder::FixSplitSharers ()
 		else
 		{
 			event = Events.GetPredecessor (event);
-			if (event == nullptr)
+			if (event < 0)
 			{
 				continue;
 			}
 			next = Events.GetPredecessor (event);
 		}
 
-		while (event != nullptr && next != nullptr && event->Info.Vertex != v2)
+		while (event >= 0 && next >= 0 && Events[event].Info.Vertex != v2)
 		{
 			D(printf("Forced split of seg %d(%d[%d,%d]->%d[%d,%d]) at %d(%d,%d):%g\n", seg,
 				Segs[seg].v1,
@@ -114,12 +108,12 @@ void FNodeBuilder::FixSplitSharers ()
 				Segs[seg].v2,
 				Vertices[Segs[seg].v2].x>>16,
 				Vertices[Segs[seg].v2].y>>16,
-				event->Info.Vertex,
-				Vertices[event->Info.Vertex].x>>16,
-				Vertices[event->Info.Vertex].y>>16,
-				event->Distance));
+				Events[event].Info.Vertex,
+				Vertices[Events[event].Info.Vertex].x>>16,
+				Vertices[Events[event].Info.Vertex].y>>16,
+				Events[event].Distance));
 
-			uint32_t newseg = SplitSeg (seg, event->Info.Vertex, 1);
+			uint32_t newseg = SplitSeg (seg, Events[event].Info.Vertex, 1);
 
 			Segs[newseg].next = Segs[seg].next;
 			Segs[seg].next = newseg;
@@ -127,7 +121,7 @@ void FNodeBuilder::FixSplitSharers ()
 			uint32_t partner = Segs[seg].partner;
 			if (partner != DWORD_MAX)
 			{
-				int endpartner = SplitSeg (partner, event->Info.Vertex, 1);
+				int endpartner = SplitSeg (partner, Events[event].Info.Vertex, 1);
 
 				Segs[endpartner].next = Segs[partner].next;
 				Segs[partner].next = endpartner;
@@ -161,12 +155,14 @@ void FNodeBuilder::FixSplitSharers ()
 
 void FNodeBuilder::AddMinisegs (const node_t &node, uint32_t splitseg, uint32_t &fset, uint32_t &bset)
 {
-	FEvent *event = Events.GetMinimum (), *prev = nullptr;
+	int event = Events.GetMinimum (), prev = -1;
 
-	while (event != nullptr)
+	while (event >= 0)
 	{
-		if (prev != nullptr)
+		if (prev >= 0)
 		{
+			const FEventInfo &previnfo = Events[prev].Info;
+			const FEventInfo &eventinfo = Events[event].Info;
 			uint32_t fseg1, bseg1, fseg2, bseg2;
 			uint32_t fnseg, bnseg;
 
@@ -175,18 +171,18 @@ void FNodeBuilder::AddMinisegs (const node_t &node, uint32_t splitseg, uint32_t
 			// are unclosed, but at least we won't be needlessly creating subsectors in void space.
 			// Unclosed subsectors can be closed trivially once the BSP tree is complete.
 
-			if ((fseg1 = CheckLoopStart (node.dx, node.dy, prev->Info.Vertex, event->Info.Vertex)) != DWORD_MAX &&
-				(bseg1 = CheckLoopStart (-node.dx, -node.dy, event->Info.Vertex, prev->Info.Vertex)) != DWORD_MAX &&
-				(fseg2 = CheckLoopEnd (node.dx, node.dy, event->Info.Vertex)) != DWORD_MAX &&
-				(bseg2 = CheckLoopEnd (-node.dx, -node.dy, prev->Info.Vertex)) != DWORD_MAX)
+			if ((fseg1 = CheckLoopStart (node.dx, node.dy, previnfo.Vertex, eventinfo.Vertex)) != DWORD_MAX &&
+				(bseg1 = CheckLoopStart (-node.dx, -node.dy, eventinfo.Vertex, previnfo.Vertex)) != DWORD_MAX &&
+				(fseg2 = CheckLoopEnd (node.dx, node.dy, eventinfo.Vertex)) != DWORD_MAX &&
+				(bseg2 = CheckLoopEnd (-node.dx, -node.dy, previnfo.Vertex)) != DWORD_MAX)
 			{
 				// Add miniseg on the front side
-				fnseg = AddMiniseg (prev->Info.Vertex, event->Info.Vertex, DWORD_MAX, fseg1, splitseg);
+				fnseg = AddMiniseg (previnfo.Vertex, eventinfo.Vertex, DWORD_MAX, fseg1, splitseg);
 				Segs[fnseg].next = fset;
 				fset = fnseg;
 
 				// Add miniseg on the back side
-				bnseg = AddMiniseg (event->Info.Vertex, prev->Info.Vertex, fnseg, bseg1, splitseg);
+				bnseg = AddMiniseg (eventinfo.Vertex, previnfo.Vertex, fnseg, bseg1, splitseg);
 				Segs[bnseg].next = bset;
 				bset = bnseg;
 
@@ -207,17 +203,17 @@ void FNodeBuilder::AddMinisegs (const node_t &node, uint32_t splitseg, uint32_t
 				{
 					Warn ("Sectors %d at (%d,%d) and %d at (%d,%d) don't match.\n",
 						Segs[fseg1].frontsector,
-						Vertices[prev->Info.Vertex].x>>FRACBITS, Vertices[prev->Info.Vertex].y>>FRACBITS,
+						Vertices[previnfo.Vertex].x>>FRACBITS, Vertices[previnfo.Vertex].y>>FRACBITS,
 						Segs[bseg1].frontsector,
-						Vertices[event->Info.Vertex].x>>FRACBITS, Vertices[event->Info.Vertex].y>>FRACBITS
+						Vertices[eventinfo.Vertex].x>>FRACBITS, Vertices[eventinfo.Vertex].y>>FRACBITS
 						);
 				}
 
 				D(Printf ("**Minisegs** %d/%d added %d(%d,%d)->%d(%d,%d)\n", fnseg, bnseg,
-					prev->Info.Vertex,
-					Vertices[prev->Info.Vertex].x>>16, Vertices[prev->Info.Vertex].y>>16,
-					event->Info.Vertex,
-					Vertices[event->Info.Vertex].x>>16, Vertices[event->Info.Vertex].y>>16));
+					previnfo.Vertex,
+					Vertices[previnfo.Vertex].x>>16, Vertices[previnfo.Vertex].y>>16,
+					eventinfo.Vertex,
+					Vertices[eventinfo.Vertex].x>>16, Vertices[eventinfo.Vertex].y>>16));
 			}
 		}
 		prev = event;
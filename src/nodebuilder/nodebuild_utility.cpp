@@ -455,35 +455,68 @@ void FNodeBuilder::AddSegToBBox (fixed_t bbox[4], const FPrivSeg *seg)
 	if (v2->y > bbox[BOXTOP])		bbox[BOXTOP] = v2->y;
 }
 
-FNodeBuilder::FVertexMap::FVertexMap (FNodeBuilder &builder,
-	fixed_t minx, fixed_t miny, fixed_t maxx, fixed_t maxy)
-	: MyBuilder(builder)
+FNodeBuilder::FVertexMap::FVertexMap (FNodeBuilder &builder, int expectedVerts)
+	: MyBuilder(builder), UsedCells(0)
 {
-	MinX = minx;
-	MinY = miny;
-	BlocksWide = int(((double(maxx) - minx + 1) + (BLOCK_SIZE - 1)) / BLOCK_SIZE);
-	BlocksTall = int(((double(maxy) - miny + 1) + (BLOCK_SIZE - 1)) / BLOCK_SIZE);
-	MaxX = MinX + BlocksWide * BLOCK_SIZE - 1;
-	MaxY = MinY + BlocksTall * BLOCK_SIZE - 1;
-	VertexGrid = new TArray<int>[BlocksWide * BlocksTall];
+	// Splits typically add about as many vertices as the map started with.
+	unsigned int size = 1024;
+	while (size < unsigned(expectedVerts) * 4)
+	{
+		size <<= 1;
+	}
+	FCell empty = { 0, -1 };
+	Cells.Resize (size);
+	for (unsigned int i = 0; i < size; ++i)
+	{
+		Cells[i] = empty;
+	}
 }
 
 FNodeBuilder::FVertexMap::~FVertexMap ()
 {
-	delete[] VertexGrid;
+}
+
+unsigned int FNodeBuilder::FVertexMap::FindCell (uint64_t key) const
+{
+	unsigned int mask = Cells.Size() - 1;
+	unsigned int slot = unsigned((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+
+	while (Cells[slot].First >= 0 && Cells[slot].Key != key)
+	{
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+void FNodeBuilder::FVertexMap::GrowCells ()
+{
+	TArray<FCell> oldcells (Cells);
+	FCell empty = { 0, -1 };
+
+	Cells.Resize (oldcells.Size() * 2);
+	for (unsigned int i = 0; i < Cells.Size(); ++i)
+	{
+		Cells[i] = empty;
+	}
+	for (unsigned int i = 0; i < oldcells.Size(); ++i)
+	{
+		if (oldcells[i].First >= 0)
+		{
+			Cells[FindCell (oldcells[i].Key)] = oldcells[i];
+		}
+	}
 }
 
 int FNodeBuilder::FVertexMap::SelectVertexExact (FNodeBuilder::FPrivVert &vert)
 {
-	TArray<int> &block = VertexGrid[GetBlock (vert.x, vert.y)];
+	const FCell &cell = Cells[FindCell (MakeKey (vert.x >> CELL_SHIFT, vert.y >> CELL_SHIFT))];
 	FPrivVert *vertices = &MyBuilder.Vertices[0];
-	unsigned int i;
 
-	for (i = 0; i < block.Size(); ++i)
+	for (int i = cell.First; i >= 0; i = NextInCell[i])
 	{
-		if (vertices[block[i]].x == vert.x && vertices[block[i]].y == vert.y)
+		if (vertices[i].x == vert.x && vertices[i].y == vert.y)
 		{
-			return block[i];
+			return i;
 		}
 	}
 
@@ -493,22 +526,41 @@ int FNodeBuilder::FVertexMap::SelectVertexExact (FNodeBuilder::FPrivVert &vert)
 
 int FNodeBuilder::FVertexMap::SelectVertexClose (FNodeBuilder::FPrivVert &vert)
 {
-	TArray<int> &block = VertexGrid[GetBlock (vert.x, vert.y)];
 	FPrivVert *vertices = &MyBuilder.Vertices[0];
-	unsigned int i;
-
-	for (i = 0; i < block.Size(); ++i)
+	int cellx = vert.x >> CELL_SHIFT;
+	int celly = vert.y >> CELL_SHIFT;
+	int best = -1;
+
+	// Probe the vertex's own cell and its 8 neighbors. If several vertices are
+	// close enough, the oldest one wins so that the result does not depend on
+	// the order vertices are stored in the cells.
+	for (int y = celly - 1; y <= celly + 1; ++y)
 	{
+		for (int x = cellx - 1; x <= cellx + 1; ++x)
+		{
+			const FCell &cell = Cells[FindCell (MakeKey (x, y))];
+
+			for (int i = cell.First; i >= 0; i = NextInCell[i])
+			{
 #if VERTEX_EPSILON <= 1
-		if (vertices[block[i]].x == vert.x && vertices[block[i]].y == vert.y)
+				if (vertices[i].x == vert.x && vertices[i].y == vert.y)
 #else
-		if (abs(vertices[block[i]].x - vert.x) < VERTEX_EPSILON &&
-			abs(vertices[block[i]].y - vert.y) < VERTEX_EPSILON)
+				if (abs(vertices[i].x - vert.x) < VERTEX_EPSILON &&
+					abs(vertices[i].y - vert.y) < VERTEX_EPSILON)
 #endif
-		{
-			return block[i];
+				{
+					if (best < 0 || i < best)
+					{
+						best = i;
+					}
+				}
+			}
 		}
 	}
+	if (best >= 0)
+	{
+		return best;
+	}
 
 	// Not present: add it!
 	return InsertVertex (vert);
@@ -522,35 +574,19 @@ int FNodeBuilder::FVertexMap::InsertVertex (FNodeBuilder::FPrivVert &vert)
 	vert.segs2 = DWORD_MAX;
 	vertnum = (int)MyBuilder.Vertices.Push (vert);
 
-	// If a vertex is near a block boundary, then it will be inserted on
-	// both sides of the boundary so that SelectVertexClose can find
-	// it by checking in only one block.
-	fixed_t minx = MAX (MinX, vert.x - VERTEX_EPSILON);
-	fixed_t maxx = MIN (MaxX, vert.x + VERTEX_EPSILON);
-	fixed_t miny = MAX (MinY, vert.y - VERTEX_EPSILON);
-	fixed_t maxy = MIN (MaxY, vert.y + VERTEX_EPSILON);
-
-	int blk[4] =
+	if ((UsedCells + 1) * 2 > Cells.Size())
 	{
-		GetBlock (minx, miny),
-		GetBlock (maxx, miny),
-		GetBlock (minx, maxy),
-		GetBlock (maxx, maxy)
-	};
-	unsigned int blkcount[4] =
-	{
-		VertexGrid[blk[0]].Size(),
-		VertexGrid[blk[1]].Size(),
-		VertexGrid[blk[2]].Size(),
-		VertexGrid[blk[3]].Size()
-	};
-	for (int i = 0; i < 4; ++i)
+		GrowCells ();
+	}
+
+	FCell &cell = Cells[FindCell (MakeKey (vert.x >> CELL_SHIFT, vert.y >> CELL_SHIFT))];
+	if (cell.First < 0)
 	{
-		if (VertexGrid[blk[i]].Size() == blkcount[i])
-		{
-			VertexGrid[blk[i]].Push (vertnum);
-		}
+		cell.Key = MakeKey (vert.x >> CELL_SHIFT, vert.y >> CELL_SHIFT);
+		UsedCells++;
 	}
+	NextInCell.Push (cell.First);
+	cell.First = vertnum;
 
 	return vertnum;
 }
@@ -70,14 +70,14 @@ bool sc_FileScripts = false;
 
 // PRIVATE DATA DEFINITIONS ------------------------------------------------
 
-static char *ScriptBuffer;
-static char *ScriptPtr;
-static char *ScriptEndPtr;
+static const char *ScriptBuffer;
+static const char *ScriptPtr;
+static const char *ScriptEndPtr;
 static char StringBuffer[MAX_STRING_SIZE];
 static bool ScriptOpen = false;
 static int ScriptSize;
 static bool AlreadyGot = false;
-static char *SavedScriptPtr;
+static const char *SavedScriptPtr;
 static int SavedScriptLine;
 static bool CMode;
 
@@ -91,7 +91,7 @@ static bool CMode;
 //
 //==========================================================================
 
-void SC_OpenMem (const char *name, char *buffer, int len)
+void SC_OpenMem (const char *name, const char *buffer, int len)
 {
 	SC_Close ();
 	ScriptSize = len;
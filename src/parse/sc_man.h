@@ -3,7 +3,7 @@
 
 void SC_Open (const char *name);
 void SC_OpenFile (const char *name);
-void SC_OpenMem (const char *name, char *buffer, int size);
+void SC_OpenMem (const char *name, const char *buffer, int size);
 void SC_OpenLumpNum (int lump, const char *name);
 void SC_Close ();
 void SC_SetCMode (bool cmode);
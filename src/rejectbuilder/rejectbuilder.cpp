@@ -0,0 +1,512 @@
+/*
+    Routines for building a Doom map's REJECT lump.
+
+    Sight between sectors is found by flowing through the portals between
+    GL subsectors. The fast mode only floods through portals that can face
+    each other, which is cheap and never hides a sector that can really be
+    seen. The exact mode then narrows the flood down by clipping every
+    portal against the view through all portals before it, after trying
+    plain sight lines through the blockmap to settle most pairs early.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <algorithm>
+
+#include "framework/zdray.h"
+#include "framework/templates.h"
+#include "framework/parallel.h"
+#include "rejectbuilder/rejectbuilder.h"
+
+static const double SIDE_EPSILON = 1/64.;
+
+// Number of subsectors per sector that are used as sight line end points.
+static const int RAY_SAMPLES = 4;
+
+FRejectBuilder::FRejectBuilder (FLevel &level, const WideVertex *vertices, const MapSegGLEx *segs,
+	const MapSubsectorEx *subsectors, int numSubsectors, bool exact)
+	: Level (level), Exact (exact)
+{
+	NumSectors = Level.NumSectors();
+	RowBytes = (NumSectors + 7) / 8;
+
+	// The blockmap stores 16-bit offsets and line numbers, so it can only be
+	// used for sight lines when neither of them has overflowed.
+	UseBlockmap = Level.Blockmap != nullptr && Level.BlockmapSize > 4 &&
+		Level.BlockmapSize <= 65536 && Level.NumLines() <= 65535;
+
+	unsigned int numSegs = 0;
+	for (int i = 0; i < numSubsectors; ++i)
+	{
+		numSegs = std::max (numSegs, subsectors[i].firstline + subsectors[i].numlines);
+	}
+	std::vector<int> segSubsector (numSegs, -1);
+	for (int i = 0; i < numSubsectors; ++i)
+	{
+		for (uint32_t j = 0; j < subsectors[i].numlines; ++j)
+		{
+			segSubsector[subsectors[i].firstline + j] = i;
+		}
+	}
+
+	SectorSubsectors.resize (NumSectors);
+	Subsectors.Resize (numSubsectors);
+	for (int i = 0; i < numSubsectors; ++i)
+	{
+		FSubsector &sub = Subsectors[i];
+		sub.Sector = -1;
+		sub.FirstPortal = Portals.Size();
+		sub.Center.x = sub.Center.y = 0;
+
+		for (uint32_t j = 0; j < subsectors[i].numlines; ++j)
+		{
+			const MapSegGLEx &seg = segs[subsectors[i].firstline + j];
+			FPoint start = { vertices[seg.v1].x / 65536., vertices[seg.v1].y / 65536. };
+			FPoint end = { vertices[seg.v2].x / 65536., vertices[seg.v2].y / 65536. };
+
+			sub.Center.x += start.x;
+			sub.Center.y += start.y;
+
+			if (sub.Sector < 0 && seg.linedef != NO_INDEX)
+			{
+				uint32_t sidenum = Level.Lines[seg.linedef].sidenum[seg.side];
+				if (sidenum != NO_INDEX)
+				{
+					sub.Sector = Level.Sides[sidenum].sector;
+				}
+			}
+			if (seg.partner != DWORD_MAX && seg.partner < numSegs && segSubsector[seg.partner] >= 0)
+			{
+				FPortal portal;
+				portal.Seg.Start = start;
+				portal.Seg.End = end;
+				portal.Dest = segSubsector[seg.partner];
+				Portals.Push (portal);
+			}
+		}
+		if (subsectors[i].numlines > 0)
+		{
+			sub.Center.x /= subsectors[i].numlines;
+			sub.Center.y /= subsectors[i].numlines;
+		}
+		sub.NumPortals = Portals.Size() - sub.FirstPortal;
+
+		if (sub.Sector >= 0 && sub.Sector < NumSectors)
+		{
+			SectorSubsectors[sub.Sector].push_back (i);
+		}
+		else
+		{
+			sub.Sector = -1;
+		}
+	}
+
+	BuildRows ();
+}
+
+uint8_t *FRejectBuilder::GetReject ()
+{
+	int size = (NumSectors * NumSectors + 7) / 8;
+	uint8_t *reject = new uint8_t[size];
+
+	memset (reject, 0, size);
+
+	// A pair is visible if either sector found the other, so the table
+	// stays symmetric even where the clipping was not.
+	for (int i = 0; i < NumSectors; ++i)
+	{
+		const uint8_t *row = &Visible[i * RowBytes];
+		for (int j = 0; j < NumSectors; ++j)
+		{
+			const uint8_t *other = &Visible[j * RowBytes];
+			if (!(row[j >> 3] & (1 << (j & 7))) && !(other[i >> 3] & (1 << (i & 7))))
+			{
+				int pnum = i * NumSectors + j;
+				reject[pnum >> 3] |= 1 << (pnum & 7);
+			}
+		}
+	}
+	return reject;
+}
+
+void FRejectBuilder::BuildRows ()
+{
+	Visible.assign (RowBytes * NumSectors, 0);
+
+	// Each worker keeps its own scratch state and takes sectors from a
+	// shared counter.
+	int numWorkers = std::min(GetNumThreads(), NumSectors);
+	std::atomic<int> next(0);
+	ParallelFor(numWorkers, [&](size_t) {
+		FWork work;
+		work.Might.resize (NumSectors);
+		work.Proved.resize (NumSectors);
+		work.Visited.assign (Subsectors.Size(), 0);
+		work.MightSee.assign (Portals.Size(), 0);
+		work.OnStack.assign (Subsectors.Size(), 0);
+		work.Stamp = 0;
+
+		for (int i = next++; i < NumSectors; i = next++)
+		{
+			ProcessSector (work, i);
+		}
+	});
+}
+
+void FRejectBuilder::ProcessSector (FWork &work, int sector)
+{
+	const std::vector<int> &subs = SectorSubsectors[sector];
+
+	std::fill (work.Might.begin(), work.Might.end(), 0);
+	work.Might[sector] = 1;
+
+	for (int sub : subs)
+	{
+		for (unsigned int i = 0; i < Subsectors[sub].NumPortals; ++i)
+		{
+			FloodPortal (work, Subsectors[sub].FirstPortal + i);
+		}
+	}
+
+	const std::vector<uint8_t> *result = &work.Might;
+
+	if (Exact)
+	{
+		std::fill (work.Proved.begin(), work.Proved.end(), 0);
+		work.Proved[sector] = 1;
+		work.Unresolved = 0;
+		for (int i = 0; i < NumSectors; ++i)
+		{
+			if (work.Might[i] && !work.Proved[i])
+			{
+				work.Unresolved++;
+			}
+		}
+
+		// Neighbors can always see each other through the portal between them.
+		for (int sub : subs)
+		{
+			for (unsigned int i = 0; i < Subsectors[sub].NumPortals; ++i)
+			{
+				MarkProved (work, Subsectors[Portals[Subsectors[sub].FirstPortal + i].Dest].Sector);
+			}
+		}
+		if (UseBlockmap)
+		{
+			ProveWithRays (work, sector);
+		}
+		for (size_t s = 0; s < subs.size() && work.Unresolved > 0; ++s)
+		{
+			const FSubsector &sub = Subsectors[subs[s]];
+			for (unsigned int i = 0; i < sub.NumPortals && work.Unresolved > 0; ++i)
+			{
+				int pnum = sub.FirstPortal + i;
+
+				// Refresh MightSee for this source portal.
+				FloodPortal (work, pnum);
+
+				work.OnStack[subs[s]] = 1;
+				RecursiveFlow (work, Portals[pnum].Dest, Portals[pnum].Seg, nullptr);
+				work.OnStack[subs[s]] = 0;
+			}
+		}
+		result = &work.Proved;
+	}
+
+	uint8_t *row = &Visible[sector * RowBytes];
+	for (int i = 0; i < NumSectors; ++i)
+	{
+		if ((*result)[i])
+		{
+			row[i >> 3] |= 1 << (i & 7);
+		}
+	}
+}
+
+// Floods outward from a portal through every portal that might be visible
+// through it. This only checks each portal against the source, so the
+// result is a superset of what can really be seen.
+void FRejectBuilder::FloodPortal (FWork &work, int portal)
+{
+	const FPortal &source = Portals[portal];
+	unsigned int stamp = ++work.Stamp;
+
+	work.Stack.clear();
+	work.Stack.push_back (source.Dest);
+	work.Visited[source.Dest] = stamp;
+	if (Subsectors[source.Dest].Sector >= 0)
+	{
+		work.Might[Subsectors[source.Dest].Sector] = 1;
+	}
+
+	while (!work.Stack.empty())
+	{
+		const FSubsector &sub = Subsectors[work.Stack.back()];
+		work.Stack.pop_back();
+
+		for (unsigned int i = 0; i < sub.NumPortals; ++i)
+		{
+			int pnum = sub.FirstPortal + i;
+			const FPortal &target = Portals[pnum];
+
+			if (!PortalCanSee (source.Seg, target.Seg))
+			{
+				continue;
+			}
+			work.MightSee[pnum] = stamp;
+			if (work.Visited[target.Dest] != stamp)
+			{
+				work.Visited[target.Dest] = stamp;
+				if (Subsectors[target.Dest].Sector >= 0)
+				{
+					work.Might[Subsectors[target.Dest].Sector] = 1;
+				}
+				work.Stack.push_back (target.Dest);
+			}
+		}
+	}
+}
+
+// Tries a few straight sight lines between each candidate sector and the
+// source sector. Any line that does not cross a one-sided wall settles
+// the pair without having to flow through the portals.
+void FRejectBuilder::ProveWithRays (FWork &work, int sector)
+{
+	const std::vector<int> &from = SectorSubsectors[sector];
+	int numFrom = std::min ((int)from.size(), RAY_SAMPLES);
+
+	for (int other = 0; other < NumSectors && work.Unresolved > 0; ++other)
+	{
+		if (!work.Might[other] || work.Proved[other])
+		{
+			continue;
+		}
+
+		const std::vector<int> &to = SectorSubsectors[other];
+		int numTo = std::min ((int)to.size(), RAY_SAMPLES);
+		bool found = false;
+
+		for (int i = 0; i < numFrom && !found; ++i)
+		{
+			const FPoint &a = Subsectors[from[i * from.size() / numFrom]].Center;
+			for (int j = 0; j < numTo && !found; ++j)
+			{
+				found = ClearSight (a, Subsectors[to[j * to.size() / numTo]].Center);
+			}
+		}
+		if (found)
+		{
+			MarkProved (work, other);
+		}
+	}
+}
+
+// Follows the portals that can be seen from source through pass, clipping
+// each one to the region visible through both, and the source to the part
+// that can see it.
+void FRejectBuilder::RecursiveFlow (FWork &work, int subsector, const FWinding &source, const FWinding *pass)
+{
+	const FSubsector &sub = Subsectors[subsector];
+
+	MarkProved (work, sub.Sector);
+	work.OnStack[subsector] = 1;
+
+	for (unsigned int i = 0; i < sub.NumPortals && work.Unresolved > 0; ++i)
+	{
+		int pnum = sub.FirstPortal + i;
+		const FPortal &portal = Portals[pnum];
+
+		// A straight line cannot enter a convex subsector twice.
+		if (work.MightSee[pnum] != work.Stamp || work.OnStack[portal.Dest])
+		{
+			continue;
+		}
+
+		FWinding target = portal.Seg;
+		FWinding newsource = source;
+
+		// Everything in the first subsector can be seen through the source.
+		if (pass != nullptr)
+		{
+			if (!ClipToSeparators (source, *pass, target) ||
+				!ClipToSeparators (target, *pass, newsource))
+			{
+				continue;
+			}
+		}
+		RecursiveFlow (work, portal.Dest, newsource, &target);
+	}
+
+	work.OnStack[subsector] = 0;
+}
+
+void FRejectBuilder::MarkProved (FWork &work, int sector)
+{
+	if (sector >= 0 && !work.Proved[sector])
+	{
+		work.Proved[sector] = 1;
+		if (work.Might[sector])
+		{
+			work.Unresolved--;
+		}
+	}
+}
+
+// Walks the blockmap cells along a-b and checks the one-sided lines in them.
+// Two-sided lines never block for good, since their sectors can move.
+bool FRejectBuilder::ClearSight (const FPoint &a, const FPoint &b) const
+{
+	const uint16_t *bmap = Level.Blockmap;
+	double originx = (short)bmap[0];
+	double originy = (short)bmap[1];
+	int width = bmap[2];
+	int height = bmap[3];
+
+	double x1 = (a.x - originx) / BLOCKSIZE, y1 = (a.y - originy) / BLOCKSIZE;
+	double x2 = (b.x - originx) / BLOCKSIZE, y2 = (b.y - originy) / BLOCKSIZE;
+	double dx = x2 - x1, dy = y2 - y1;
+	int bx = (int)floor (x1), by = (int)floor (y1);
+	int steps = abs ((int)floor (x2) - bx) + abs ((int)floor (y2) - by);
+	int stepx = dx > 0 ? 1 : -1;
+	int stepy = dy > 0 ? 1 : -1;
+	double tdeltax = dx != 0 ? fabs (1 / dx) : HUGE_VAL;
+	double tdeltay = dy != 0 ? fabs (1 / dy) : HUGE_VAL;
+	double tmaxx = dx > 0 ? (bx + 1 - x1) / dx : dx < 0 ? (x1 - bx) / -dx : HUGE_VAL;
+	double tmaxy = dy > 0 ? (by + 1 - y1) / dy : dy < 0 ? (y1 - by) / -dy : HUGE_VAL;
+
+	for (int i = 0; ; ++i)
+	{
+		if (bx >= 0 && by >= 0 && bx < width && by < height)
+		{
+			// Skip the leading 0 of every block list.
+			for (const uint16_t *list = bmap + bmap[4 + bx + by * width] + 1; *list != 0xffff; ++list)
+			{
+				const IntLineDef &line = Level.Lines[*list];
+				if (line.sidenum[1] != NO_INDEX)
+				{
+					continue;
+				}
+				FPoint l1 = { Level.Vertices[line.v1].x / 65536., Level.Vertices[line.v1].y / 65536. };
+				FPoint l2 = { Level.Vertices[line.v2].x / 65536., Level.Vertices[line.v2].y / 65536. };
+
+				// Touching a wall counts as blocked.
+				if (PointSide (a, b, l1) * PointSide (a, b, l2) <= 0 &&
+					PointSide (l1, l2, a) * PointSide (l1, l2, b) <= 0)
+				{
+					return false;
+				}
+			}
+		}
+		if (i >= steps)
+		{
+			break;
+		}
+		if (tmaxx < tmaxy)
+		{
+			tmaxx += tdeltax;
+			bx += stepx;
+		}
+		else
+		{
+			tmaxy += tdeltay;
+			by += stepy;
+		}
+	}
+	return true;
+}
+
+// Returns the distance of p from the line through start and end. It is
+// positive on the left side.
+double FRejectBuilder::PointSide (const FPoint &start, const FPoint &end, const FPoint &p)
+{
+	double dx = end.x - start.x;
+	double dy = end.y - start.y;
+	double len = sqrt (dx*dx + dy*dy);
+
+	if (len == 0)
+	{
+		return 0;
+	}
+	return (dx * (p.y - start.y) - dy * (p.x - start.x)) / len;
+}
+
+// Part of the target must be in front of the source, and part of the
+// source must be behind the target, or no sight line can cross both.
+bool FRejectBuilder::PortalCanSee (const FWinding &source, const FWinding &target)
+{
+	if (std::max (PointSide (source.Start, source.End, target.Start),
+				  PointSide (source.Start, source.End, target.End)) <= SIDE_EPSILON)
+	{
+		return false;
+	}
+	if (std::min (PointSide (target.Start, target.End, source.Start),
+				  PointSide (target.Start, target.End, source.End)) >= -SIDE_EPSILON)
+	{
+		return false;
+	}
+	return true;
+}
+
+// Clips target to the region that can be seen from source through pass.
+// That region is bounded by the lines from an end of the source to an end
+// of the pass that have the source and the pass on opposite sides.
+// Returns false if nothing of the target is left.
+bool FRejectBuilder::ClipToSeparators (const FWinding &source, const FWinding &pass, FWinding &target)
+{
+	const FPoint src[2] = { source.Start, source.End };
+	const FPoint pas[2] = { pass.Start, pass.End };
+
+	for (int i = 0; i < 2; ++i)
+	{
+		for (int j = 0; j < 2; ++j)
+		{
+			const FPoint &s = src[i];
+			const FPoint &p = pas[j];
+
+			if (fabs (s.x - p.x) < SIDE_EPSILON && fabs (s.y - p.y) < SIDE_EPSILON)
+			{
+				continue;
+			}
+
+			double sside = PointSide (s, p, src[i^1]);
+			double pside = PointSide (s, p, pas[j^1]);
+			double sign;
+
+			if (pside > SIDE_EPSILON && sside <= SIDE_EPSILON)
+			{
+				sign = 1;
+			}
+			else if (pside < -SIDE_EPSILON && sside >= -SIDE_EPSILON)
+			{
+				sign = -1;
+			}
+			else
+			{
+				continue;
+			}
+
+			// Keep the part of the target on the same side as the pass.
+			double d1 = PointSide (s, p, target.Start) * sign;
+			double d2 = PointSide (s, p, target.End) * sign;
+
+			if (d1 < -SIDE_EPSILON && d2 < -SIDE_EPSILON)
+			{
+				return false;
+			}
+			if (d1 < -SIDE_EPSILON)
+			{
+				double frac = d1 / (d1 - d2);
+				target.Start.x += (target.End.x - target.Start.x) * frac;
+				target.Start.y += (target.End.y - target.Start.y) * frac;
+			}
+			else if (d2 < -SIDE_EPSILON)
+			{
+				double frac = d2 / (d2 - d1);
+				target.End.x += (target.Start.x - target.End.x) * frac;
+				target.End.y += (target.Start.y - target.End.y) * frac;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include "level/doomdata.h"
+#include "framework/tarray.h"
+#include <vector>
+
+class FRejectBuilder
+{
+public:
+	// The GL subsectors are used because they are closed, convex polygons.
+	// Their two-sided segs are the portals sight can pass through.
+	FRejectBuilder (FLevel &level, const WideVertex *vertices, const MapSegGLEx *segs,
+		const MapSubsectorEx *subsectors, int numSubsectors, bool exact);
+	uint8_t *GetReject ();
+
+private:
+	struct FPoint
+	{
+		double x, y;
+	};
+
+	struct FWinding
+	{
+		FPoint Start, End;
+	};
+
+	// A two-sided seg, seen from the subsector it belongs to. That subsector
+	// is on the right side of Start->End, and Dest is on the left side.
+	struct FPortal
+	{
+		FWinding Seg;
+		int Dest;
+	};
+
+	struct FSubsector
+	{
+		int Sector;
+		unsigned int FirstPortal, NumPortals;
+		FPoint Center;
+	};
+
+	// Per-thread scratch space
+	struct FWork
+	{
+		std::vector<uint8_t> Might;			// Sectors that pass the portal flood
+		std::vector<uint8_t> Proved;		// Sectors with a proven line of sight
+		std::vector<unsigned int> Visited;	// Per subsector stamp for the flood
+		std::vector<unsigned int> MightSee;	// Per portal stamp for the flood
+		std::vector<uint8_t> OnStack;		// Subsectors on the current flow path
+		std::vector<int> Stack;
+		unsigned int Stamp;
+		int Unresolved;
+	};
+
+	FLevel &Level;
+	bool Exact;
+	bool UseBlockmap;
+	int NumSectors;
+	size_t RowBytes;
+	TArray<FSubsector> Subsectors;
+	TArray<FPortal> Portals;
+	std::vector<std::vector<int>> SectorSubsectors;
+	std::vector<uint8_t> Visible;	// One bit row per source sector
+
+	void BuildRows ();
+	void ProcessSector (FWork &work, int sector);
+	void FloodPortal (FWork &work, int portal);
+	void ProveWithRays (FWork &work, int sector);
+	void RecursiveFlow (FWork &work, int subsector, const FWinding &source, const FWinding *pass);
+	void MarkProved (FWork &work, int sector);
+	bool ClearSight (const FPoint &a, const FPoint &b) const;
+
+	static double PointSide (const FPoint &start, const FPoint &end, const FPoint &p);
+	static bool PortalCanSee (const FWinding &source, const FWinding &target);
+	static bool ClipToSeparators (const FWinding &source, const FWinding &pass, FWinding &target);
+};
@@ -0,0 +1,234 @@
+/*
+    Reading and writing map wads inside pk3 (zip) archives.
+
+    The maps are built one after another, because every map already keeps
+    the threads busy while it is built. Each map wad is extracted just
+    before it is built and freed afterwards, and the rebuilt ones are
+    compressed on all threads a batch at a time.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <functional>
+
+#include "framework/zdray.h"
+#include "framework/parallel.h"
+#include "wad/wad.h"
+#include "wad/pk3.h"
+#include <miniz/miniz.h>
+
+extern int CompressLevel;
+
+struct FPk3Entry
+{
+	mz_uint Index;
+	std::string Name;
+
+	void *Input = nullptr;
+	size_t InputSize = 0;
+
+	std::vector<uint8_t> Output;
+	size_t OutputSize = 0;
+	void *Compressed = nullptr;
+	size_t CompressedSize = 0;
+	mz_uint32 Crc = 0;
+	bool Changed = false;
+};
+
+static void ZipError (mz_zip_error error, const char *what)
+{
+	char msg[256];
+	snprintf (msg, sizeof(msg), "%s: %s", what, mz_zip_get_error_string (error));
+	throw std::runtime_error(msg);
+}
+
+static bool IsMapWad (const char *name)
+{
+	size_t len = strlen (name);
+	return len > 9 && strnicmp (name, "maps/", 5) == 0 && stricmp (name + len - 4, ".wad") == 0;
+}
+
+// Like ParallelFor, but the first exception thrown by work stops the
+// remaining items and is rethrown on the calling thread.
+static void RunThreads (int count, const std::function<void (int)> &work)
+{
+	std::exception_ptr failure;
+	std::atomic<bool> failed (false);
+	ParallelFor (count, [&](size_t i) {
+		if (failed)
+		{
+			return;
+		}
+		try
+		{
+			work ((int)i);
+		}
+		catch (...)
+		{
+			if (!failed.exchange (true))
+			{
+				failure = std::current_exception ();
+			}
+		}
+	});
+	if (failure)
+	{
+		std::rethrow_exception (failure);
+	}
+}
+
+bool IsPk3 (const char *filename)
+{
+	FILE *f = fopen (filename, "rb");
+	if (f == nullptr)
+	{
+		return false;
+	}
+	uint8_t magic[4];
+	bool zip = fread (magic, 1, 4, f) == 4 && magic[0] == 'P' && magic[1] == 'K' && magic[2] == 3 && magic[3] == 4;
+	fclose (f);
+	return zip;
+}
+
+void ProcessPk3 (const char *inname, const char *outname, WadProcessFunc process)
+{
+	mz_zip_archive inzip;
+	mz_zip_zero_struct (&inzip);
+	if (!mz_zip_reader_init_file (&inzip, inname, 0))
+	{
+		ZipError (mz_zip_get_last_error (&inzip), "Could not open input file");
+	}
+
+	std::vector<FPk3Entry> entries;
+	mz_uint numFiles = mz_zip_reader_get_num_files (&inzip);
+	for (mz_uint i = 0; i < numFiles; ++i)
+	{
+		mz_zip_archive_file_stat stat;
+		if (mz_zip_reader_file_stat (&inzip, i, &stat) && !stat.m_is_directory && IsMapWad (stat.m_filename))
+		{
+			FPk3Entry entry;
+			entry.Index = i;
+			entry.Name = stat.m_filename;
+			entries.push_back (std::move (entry));
+		}
+	}
+
+	try
+	{
+		// Rebuilt wads are compressed as raw deflate streams, the way they are
+		// stored in the zip. They are collected into batches of one per thread,
+		// so only a few uncompressed outputs are held at once.
+		int flags = tdefl_create_comp_flags_from_zip_params (CompressLevel, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+		size_t batchSize = (size_t)GetNumThreads ();
+		std::vector<FPk3Entry *> pending;
+		auto compressPending = [&]() {
+			RunThreads ((int)pending.size(), [&](int i) {
+				FPk3Entry &entry = *pending[i];
+				entry.OutputSize = entry.Output.size();
+				entry.Crc = (mz_uint32)mz_crc32 (MZ_CRC32_INIT, entry.Output.data(), entry.Output.size());
+				entry.Compressed = tdefl_compress_mem_to_heap (entry.Output.data(), entry.Output.size(), &entry.CompressedSize, flags);
+				if (entry.Compressed == nullptr)
+				{
+					throw std::runtime_error("Could not compress " + entry.Name);
+				}
+				entry.Output.clear ();
+				entry.Output.shrink_to_fit ();
+			});
+			pending.clear ();
+		};
+
+		// Each map is only extracted right before it is built.
+		for (auto &entry : entries)
+		{
+			printf ("%s:\n", entry.Name.c_str());
+			entry.Input = mz_zip_reader_extract_to_heap (&inzip, entry.Index, &entry.InputSize, 0);
+			if (entry.Input == nullptr)
+			{
+				ZipError (mz_zip_get_last_error (&inzip), entry.Name.c_str());
+			}
+			{
+				FWadReader inwad ((const uint8_t *)entry.Input, entry.InputSize);
+				FWadWriter outwad (entry.Output, inwad.IsIWAD());
+				entry.Changed = process (inwad, outwad) > 0;
+				outwad.Close ();
+			}
+			mz_free (entry.Input);
+			entry.Input = nullptr;
+
+			if (!entry.Changed)
+			{
+				entry.Output.clear ();
+				entry.Output.shrink_to_fit ();
+			}
+			else
+			{
+				pending.push_back (&entry);
+				if (pending.size() >= batchSize)
+				{
+					compressPending ();
+				}
+			}
+		}
+		compressPending ();
+
+		mz_zip_archive outzip;
+		mz_zip_zero_struct (&outzip);
+		if (!mz_zip_writer_init_file (&outzip, outname, 0))
+		{
+			ZipError (mz_zip_get_last_error (&outzip), "Could not open output file");
+		}
+
+		size_t next = 0;
+		for (mz_uint i = 0; i < numFiles; ++i)
+		{
+			mz_bool ok;
+			if (next < entries.size() && entries[next].Index == i && entries[next].Changed)
+			{
+				const FPk3Entry &entry = entries[next];
+				ok = mz_zip_writer_add_mem_ex (&outzip, entry.Name.c_str(), entry.Compressed, entry.CompressedSize, nullptr, 0,
+					MZ_ZIP_FLAG_COMPRESSED_DATA | (CompressLevel > 0 ? CompressLevel : 1), entry.OutputSize, entry.Crc);
+			}
+			else
+			{
+				// Copied without decompressing it.
+				ok = mz_zip_writer_add_from_zip_reader (&outzip, &inzip, i);
+			}
+			if (next < entries.size() && entries[next].Index == i)
+			{
+				next++;
+			}
+			if (!ok)
+			{
+				mz_zip_error error = mz_zip_get_last_error (&outzip);
+				mz_zip_writer_end (&outzip);
+				ZipError (error, "Failed to write");
+			}
+		}
+		if (!mz_zip_writer_finalize_archive (&outzip))
+		{
+			mz_zip_error error = mz_zip_get_last_error (&outzip);
+			mz_zip_writer_end (&outzip);
+			ZipError (error, "Failed to write");
+		}
+		mz_zip_writer_end (&outzip);
+	}
+	catch (...)
+	{
+		for (auto &entry : entries)
+		{
+			mz_free (entry.Input);
+			mz_free (entry.Compressed);
+		}
+		mz_zip_reader_end (&inzip);
+		throw;
+	}
+
+	for (auto &entry : entries)
+	{
+		mz_free (entry.Compressed);
+	}
+	mz_zip_reader_end (&inzip);
+}
@@ -0,0 +1,14 @@
+
+#pragma once
+
+class FWadReader;
+class FWadWriter;
+
+typedef int (*WadProcessFunc) (FWadReader &inwad, FWadWriter &outwad);
+
+bool IsPk3 (const char *filename);
+
+// Runs process on every map wad in the pk3 and writes a new pk3. process
+// returns how many maps it built; entries it did not change are copied
+// over without being recompressed.
+void ProcessPk3 (const char *inname, const char *outname, WadProcessFunc process);
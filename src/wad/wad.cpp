@@ -19,22 +19,64 @@
 */
 #include "wad.h"
 
-static const char MapLumpNames[12][9] =
-{
-	"THINGS",
-	"LINEDEFS",
-	"SIDEDEFS",
-	"VERTEXES",
-	"SEGS",
-	"SSECTORS",
-	"NODES",
-	"SECTORS",
-	"REJECT",
-	"BLOCKMAP",
-	"BEHAVIOR",
-	"SCRIPTS"
+#include <algorithm>
+#include <ctype.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+static uint64_t MakeLumpKey (const char *name)
+{
+	uint64_t key = 0;
+	for (int i = 0; i < 8 && name[i] != 0; ++i)
+	{
+		key |= uint64_t(uint8_t(toupper (name[i]))) << (i * 8);
+	}
+	return key;
+}
+
+static const uint64_t MapLumpKeys[12] =
+{
+	MakeLumpKey ("THINGS"),
+	MakeLumpKey ("LINEDEFS"),
+	MakeLumpKey ("SIDEDEFS"),
+	MakeLumpKey ("VERTEXES"),
+	MakeLumpKey ("SEGS"),
+	MakeLumpKey ("SSECTORS"),
+	MakeLumpKey ("NODES"),
+	MakeLumpKey ("SECTORS"),
+	MakeLumpKey ("REJECT"),
+	MakeLumpKey ("BLOCKMAP"),
+	MakeLumpKey ("BEHAVIOR"),
+	MakeLumpKey ("SCRIPTS")
 };
 
+static const uint64_t GLLumpKeys[5] =
+{
+	MakeLumpKey ("GL_VERT"),
+	MakeLumpKey ("GL_SEGS"),
+	MakeLumpKey ("GL_SSECT"),
+	MakeLumpKey ("GL_NODES"),
+	MakeLumpKey ("GL_PVS")
+};
+
+static const uint64_t GLPrefixKey = MakeLumpKey ("GL_");
+static const uint64_t TextMapKey = MakeLumpKey ("TEXTMAP");
+static const uint64_t EndMapKey = MakeLumpKey ("ENDMAP");
+
 static const bool MapLumpRequired[12] =
 {
 	true,	// THINGS
@@ -51,162 +93,386 @@ static const bool MapLumpRequired[12] =
 	false	// SCRIPTS
 };
 
-static const char GLLumpNames[5][9] =
-{
-	"GL_VERT",
-	"GL_SEGS",
-	"GL_SSECT",
-	"GL_NODES",
-	"GL_PVS"
-};
 
 FWadReader::FWadReader (const char *filename)
-	: Lumps (nullptr), File (nullptr)
+	: Lumps (nullptr), FileData (nullptr), FileSize (0), Mapped (true)
 {
-	File = fopen (filename, "rb");
-	if (File == nullptr)
+	MapFile (filename);
+	try
 	{
-		throw std::runtime_error("Could not open input file");
+		ReadDirectory ();
 	}
+	catch (...)
+	{
+		UnmapFile ();
+		throw;
+	}
+}
 
-	SafeRead (&Header, sizeof(Header));
+// Reads a wad that is already in memory, such as one extracted from a
+// pk3. The data must outlive the reader.
+FWadReader::FWadReader (const uint8_t *data, size_t size)
+	: Lumps (nullptr), FileData (data), FileSize (size), Mapped (false)
+{
+#ifdef _WIN32
+	FileHandle = MappingHandle = nullptr;
+#else
+	FileDesc = -1;
+#endif
+	ReadDirectory ();
+}
+
+void FWadReader::ReadDirectory ()
+{
+	if (FileSize < sizeof(Header))
+	{
+		throw std::runtime_error("Input file is not a wad");
+	}
+	memcpy (&Header, FileData, sizeof(Header));
 	if (Header.Magic[0] != 'P' && Header.Magic[0] != 'I' &&
 		Header.Magic[1] != 'W' &&
 		Header.Magic[2] != 'A' &&
 		Header.Magic[3] != 'D')
 	{
-		fclose (File);
-		File = nullptr;
 		throw std::runtime_error("Input file is not a wad");
 	}
 
 	Header.NumLumps = LittleLong(Header.NumLumps);
 	Header.Directory = LittleLong(Header.Directory);
 
-	if (fseek (File, Header.Directory, SEEK_SET))
+	if (Header.NumLumps < 0 || Header.Directory < 0 ||
+		(size_t)Header.Directory + (size_t)Header.NumLumps * sizeof(WadLump) > FileSize)
 	{
 		throw std::runtime_error("Could not read wad directory");
 	}
 
 	Lumps = new WadLump[Header.NumLumps];
-	SafeRead (Lumps, Header.NumLumps * sizeof(*Lumps));
+	memcpy (Lumps, FileData + Header.Directory, Header.NumLumps * sizeof(*Lumps));
 
 	for (int i = 0; i < Header.NumLumps; ++i)
 	{
 		Lumps[i].FilePos = LittleLong(Lumps[i].FilePos);
 		Lumps[i].Size = LittleLong(Lumps[i].Size);
 	}
+
+	BuildIndex ();
 }
 
 FWadReader::~FWadReader ()
 {
-	if (File)	fclose (File);
+	if (Mapped)	UnmapFile ();
 	if (Lumps)	delete[] Lumps;
 }
 
-bool FWadReader::IsIWAD () const
+#ifdef _WIN32
+
+void FWadReader::MapFile (const char *filename)
 {
-	return Header.Magic[0] == 'I';
+	FileHandle = MappingHandle = nullptr;
+
+	HANDLE file = CreateFileA (filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		throw std::runtime_error("Could not open input file");
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx (file, &size))
+	{
+		CloseHandle (file);
+		throw std::runtime_error("Could not open input file");
+	}
+	FileHandle = file;
+	FileSize = (size_t)size.QuadPart;
+	if (FileSize == 0)
+	{
+		return;
+	}
+	MappingHandle = CreateFileMappingA (file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (MappingHandle != nullptr)
+	{
+		FileData = (const uint8_t *)MapViewOfFile (MappingHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+	if (FileData == nullptr)
+	{
+		UnmapFile ();
+		throw std::runtime_error("Could not map input file");
+	}
 }
 
-int FWadReader::NumLumps () const
+void FWadReader::UnmapFile ()
 {
-	return Header.NumLumps;
+	if (FileData)		UnmapViewOfFile (FileData);
+	if (MappingHandle)	CloseHandle (MappingHandle);
+	if (FileHandle)		CloseHandle (FileHandle);
+	FileData = nullptr;
+	FileHandle = MappingHandle = nullptr;
 }
 
-int FWadReader::FindLump (const char *name, int index) const
+#else
+
+void FWadReader::MapFile (const char *filename)
 {
-	if (index < 0)
+	FileDesc = open (filename, O_RDONLY);
+	if (FileDesc < 0)
 	{
-		index = 0;
+		throw std::runtime_error("Could not open input file");
 	}
-	for (; index < Header.NumLumps; ++index)
+	struct stat st;
+	if (fstat (FileDesc, &st) != 0)
 	{
-		if (strnicmp (Lumps[index].Name, name, 8) == 0)
+		UnmapFile ();
+		throw std::runtime_error("Could not open input file");
+	}
+	FileSize = (size_t)st.st_size;
+	if (FileSize > 0)
+	{
+		void *data = mmap (nullptr, FileSize, PROT_READ, MAP_PRIVATE, FileDesc, 0);
+		if (data == MAP_FAILED)
 		{
-			return index;
+			UnmapFile ();
+			throw std::runtime_error("Could not map input file");
 		}
+		FileData = (const uint8_t *)data;
 	}
-	return -1;
 }
 
-int FWadReader::FindMapLump (const char *name, int map) const
+void FWadReader::UnmapFile ()
 {
-	int i, j, k;
-	++map;
+	if (FileData)
+	{
+		munmap ((void *)FileData, FileSize);
+		FileData = nullptr;
+	}
+	if (FileDesc >= 0)
+	{
+		close (FileDesc);
+		FileDesc = -1;
+	}
+}
 
-	for (i = 0; i < 12; ++i)
+#endif
+
+FLumpSpan FWadReader::GetLump (int index) const
+{
+	FLumpSpan span;
+
+	if ((unsigned)index >= (unsigned)Header.NumLumps)
 	{
-		if (strnicmp (MapLumpNames[i], name, 8) == 0)
-		{
-			break;
-		}
+		return span;
 	}
-	if (i == 12)
+	if (Lumps[index].Size == 0)
+	{ // Markers often carry a meaningless file position
+		return span;
+	}
+	if (Lumps[index].FilePos < 0 || Lumps[index].Size < 0 ||
+		(size_t)Lumps[index].FilePos + (size_t)Lumps[index].Size > FileSize)
 	{
-		return -1;
+		throw std::runtime_error("Failed to read");
+	}
+	span.Data = FileData + Lumps[index].FilePos;
+	span.Size = Lumps[index].Size;
+	return span;
+}
+
+FLumpSpan FWadReader::GetMapLump (const char *name, int map) const
+{
+	return GetLump (FindMapLump (name, map));
+}
+
+bool FWadReader::IsIWAD () const
+{
+	return Header.Magic[0] == 'I';
+}
+
+int FWadReader::NumLumps () const
+{
+	return Header.NumLumps;
+}
+
+size_t FWadReader::FileBytes () const
+{
+	return FileSize;
+}
+
+// Returns the number of bytes in the file not used by the header, the
+// directory or any lump. This is the space a full rewrite would reclaim.
+size_t FWadReader::UnusedBytes () const
+{
+	struct ByteRange
+	{
+		size_t Start, End;
+	};
+	TArray<ByteRange> ranges;
+
+	ranges.Push ({ 0, sizeof(Header) });
+	ranges.Push ({ size_t(Header.Directory), size_t(Header.Directory) + Header.NumLumps * sizeof(WadLump) });
+	for (int i = 0; i < Header.NumLumps; ++i)
+	{
+		if (Lumps[i].Size > 0)
+		{
+			ranges.Push ({ size_t(Lumps[i].FilePos), size_t(Lumps[i].FilePos) + Lumps[i].Size });
+		}
 	}
+	std::sort (&ranges[0], &ranges[0] + ranges.Size(),
+		[](const ByteRange &a, const ByteRange &b) { return a.Start < b.Start; });
 
-	for (j = k = 0; j < 12; ++j)
+	size_t used = 0, end = 0;
+	for (unsigned i = 0; i < ranges.Size(); ++i)
 	{
-		if (strnicmp (Lumps[map+k].Name, MapLumpNames[j], 8) == 0)
+		if (ranges[i].End > end)
 		{
-			if (i == j)
-			{
-				return map+k;
-			}
-			k++;
+			used += ranges[i].End - std::max (ranges[i].Start, end);
+			end = ranges[i].End;
 		}
 	}
-	return -1;
+	return FileSize > used ? FileSize - used : 0;
 }
 
-bool FWadReader::isUDMF (int index) const
+void FWadReader::BuildIndex ()
 {
-	index++;
+	int numLumps = Header.NumLumps;
 
-	if (strnicmp(Lumps[index].Name, "TEXTMAP", 8) == 0)
+	Keys.Resize (numLumps);
+	for (int i = 0; i < numLumps; ++i)
 	{
-		// UDMF map
-		return true;
+		Keys[i] = MakeLumpKey (Lumps[i].Name);
+	}
+
+	// Walk backwards so every name chain is in directory order.
+	NextByName.Resize (numLumps);
+	FirstByName.reserve (numLumps);
+	for (int i = numLumps - 1; i >= 0; --i)
+	{
+		auto it = FirstByName.find (Keys[i]);
+		if (it == FirstByName.end())
+		{
+			NextByName[i] = -1;
+			FirstByName.emplace (Keys[i], i);
+		}
+		else
+		{
+			NextByName[i] = it->second;
+			it->second = i;
+		}
+	}
+
+	MapAt.Resize (numLumps);
+	for (int i = 0; i < numLumps; ++i)
+	{
+		FMapRange range;
+		if (ScanMap (i, range))
+		{
+			MapAt[i] = Maps.Push (range);
+		}
+		else
+		{
+			MapAt[i] = -1;
+		}
 	}
-	return false;
 }
 
+uint64_t FWadReader::KeyAt (int lump) const
+{
+	return (unsigned)lump < Keys.Size() ? Keys[lump] : 0;
+}
 
-bool FWadReader::IsMap (int index) const
+// Checks if index is a map header and works out where its lumps are.
+bool FWadReader::ScanMap (int index, FMapRange &range) const
 {
 	int i, j;
 
-	if (isUDMF(index)) return true;
+	for (i = 0; i < 12; ++i)
+	{
+		range.Lumps[i] = -1;
+	}
 
-	index++;
+	if (KeyAt (index + 1) == TextMapKey)
+	{
+		// UDMF map
+		i = index + 2;
+		while (i < Header.NumLumps && Keys[i] != EndMapKey)
+		{
+			i++;
+		}
+		range.End = i + 1;	// one lump after ENDMAP
+		return true;
+	}
 
+	index++;
 	for (i = j = 0; i < 12; ++i)
 	{
-		if (strnicmp (Lumps[index+j].Name, MapLumpNames[i], 8) != 0)
+		if (KeyAt (index + j) != MapLumpKeys[i])
 		{
 			if (MapLumpRequired[i])
 			{
+				range.End = index + j;
 				return false;
 			}
 		}
 		else
 		{
+			range.Lumps[i] = index + j;
 			j++;
 		}
 	}
+	range.End = index + j;
 	return true;
 }
 
+int FWadReader::FindLump (const char *name, int index) const
+{
+	auto it = FirstByName.find (MakeLumpKey (name));
+	if (it == FirstByName.end())
+	{
+		return -1;
+	}
+	int lump = it->second;
+	while (lump >= 0 && lump < index)
+	{
+		lump = NextByName[lump];
+	}
+	return lump;
+}
+
+int FWadReader::FindMapLump (const char *name, int map) const
+{
+	uint64_t key = MakeLumpKey (name);
+	int i;
+
+	for (i = 0; i < 12; ++i)
+	{
+		if (MapLumpKeys[i] == key)
+		{
+			break;
+		}
+	}
+	if (i == 12 || !IsMap (map))
+	{
+		return -1;
+	}
+	return Maps[MapAt[map]].Lumps[i];
+}
+
+bool FWadReader::isUDMF (int index) const
+{
+	return KeyAt (index + 1) == TextMapKey;
+}
+
+
+bool FWadReader::IsMap (int index) const
+{
+	return (unsigned)index < MapAt.Size() && MapAt[index] >= 0;
+}
+
 int FWadReader::FindGLLump (const char *name, int glheader) const
 {
+	uint64_t key = MakeLumpKey (name);
 	int i, j, k;
 	++glheader;
 
 	for (i = 0; i < 5; ++i)
 	{
-		if (strnicmp (Lumps[glheader+i].Name, name, 8) == 0)
+		if (KeyAt (glheader + i) == key)
 		{
 			break;
 		}
@@ -218,7 +484,7 @@ int FWadReader::FindGLLump (const char *name, int glheader) const
 
 	for (j = k = 0; j < 5; ++j)
 	{
-		if (strnicmp (Lumps[glheader+k].Name, GLLumpNames[j], 8) == 0)
+		if (KeyAt (glheader + k) == GLLumpKeys[j])
 		{
 			if (i == j)
 			{
@@ -232,20 +498,18 @@ int FWadReader::FindGLLump (const char *name, int glheader) const
 
 bool FWadReader::IsGLNodes (int index) const
 {
-	if (index + 4 >= Header.NumLumps)
+	if (index < 0 || index + 4 >= Header.NumLumps)
 	{
 		return false;
 	}
-	if (Lumps[index].Name[0] != 'G' ||
-		Lumps[index].Name[1] != 'L' ||
-		Lumps[index].Name[2] != '_')
+	if ((Keys[index] & 0xFFFFFF) != GLPrefixKey)
 	{
 		return false;
 	}
 	index++;
 	for (int i = 0; i < 4; ++i)
 	{
-		if (strnicmp (Lumps[i+index].Name, GLLumpNames[i], 8) != 0)
+		if (Keys[i+index] != GLLumpKeys[i])
 		{
 			return false;
 		}
@@ -258,7 +522,7 @@ int FWadReader::SkipGLNodes (int index) const
 	index++;
 	for (int i = 0; i < 5 && index < Header.NumLumps; ++i, ++index)
 	{
-		if (strnicmp (Lumps[index].Name, GLLumpNames[i], 8) != 0)
+		if (Keys[index] != GLLumpKeys[i])
 		{
 			break;
 		}
@@ -283,7 +547,7 @@ int FWadReader::NextMap (int index) const
 	}
 	for (; index < Header.NumLumps; ++index)
 	{
-		if (IsMap (index))
+		if (MapAt[index] >= 0)
 		{
 			return index;
 		}
@@ -293,43 +557,15 @@ int FWadReader::NextMap (int index) const
 
 int FWadReader::LumpAfterMap (int i) const
 {
-	int j, k;
-
-	if (isUDMF(i))
+	if (IsMap (i))
 	{
-		// UDMF map
-		i += 2;
-		while (strnicmp(Lumps[i].Name, "ENDMAP", 8) != 0 && i < Header.NumLumps)
-		{
-			i++;
-		}
-		return i+1;	// one lump after ENDMAP
-	}
-
-	i++;
-	for (j = k = 0; j < 12; ++j)
-	{
-		if (strnicmp (Lumps[i+k].Name, MapLumpNames[j], 8) != 0)
-		{
-			if (MapLumpRequired[j])
-			{
-				break;
-			}
-		}
-		else
-		{
-			k++;
-		}
+		return Maps[MapAt[i]].End;
 	}
-	return i+k;
-}
 
-void FWadReader::SafeRead (void *buffer, size_t size)
-{
-	if (fread (buffer, 1, size, File) != size)
-	{
-		throw std::runtime_error("Failed to read");
-	}
+	// Not a map; report the end of whatever map lumps follow it anyway.
+	FMapRange range;
+	ScanMap (i, range);
+	return range.End;
 }
 
 const char *FWadReader::LumpName (int lump)
@@ -341,13 +577,19 @@ const char *FWadReader::LumpName (int lump)
 }
 
 FWadWriter::FWadWriter (const char *filename, bool iwad)
-	: File (nullptr)
-{
-	File = fopen (filename, "wb");
-	if (File == nullptr)
+	: File (-1), Offset (0), Buffer (nullptr), BufferUsed (0),
+	  CopySource (nullptr), AppendTo (nullptr), Memory (nullptr), CopyStart (0), CopyLength (0)
+{
+#ifdef _WIN32
+	File = _open (filename, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	File = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+	if (File < 0)
 	{
 		throw std::runtime_error("Could not open output file");
 	}
+	Buffer = new uint8_t[BUFFER_SIZE];
 
 	WadHeader head;
 
@@ -362,32 +604,105 @@ FWadWriter::FWadWriter (const char *filename, bool iwad)
 	head.Magic[1] = 'W';
 	head.Magic[2] = 'A';
 	head.Magic[3] = 'D';
+	head.NumLumps = head.Directory = 0;		// Filled in by Close()
 
 	SafeWrite (&head, sizeof(head));
 }
 
+// Builds the wad in output instead of a file.
+FWadWriter::FWadWriter (std::vector<uint8_t> &output, bool iwad)
+	: File (-1), Offset (0), Buffer (nullptr), BufferUsed (0),
+	  CopySource (nullptr), AppendTo (nullptr), Memory (&output), CopyStart (0), CopyLength (0)
+{
+	Buffer = new uint8_t[BUFFER_SIZE];
+	Memory->clear ();
+
+	WadHeader head;
+
+	head.Magic[0] = iwad ? 'I' : 'P';
+	head.Magic[1] = 'W';
+	head.Magic[2] = 'A';
+	head.Magic[3] = 'D';
+	head.NumLumps = head.Directory = 0;		// Filled in by Close()
+
+	SafeWrite (&head, sizeof(head));
+}
+
+FWadWriter::FWadWriter (FWadReader &wad, const char *filename)
+	: File (-1), Offset (0), Buffer (nullptr), BufferUsed (0),
+	  CopySource (nullptr), AppendTo (&wad), Memory (nullptr), CopyStart (0), CopyLength (0)
+{
+	if (wad.FileSize > 0x7fffffff)
+	{
+		throw std::runtime_error("The wad is too big to be updated in place");
+	}
+#ifdef _WIN32
+	File = _open (filename, _O_WRONLY | _O_BINARY);
+	if (File >= 0 && _lseeki64 (File, wad.FileSize, SEEK_SET) != (__int64)wad.FileSize)
+#else
+	File = open (filename, O_WRONLY);
+	if (File >= 0 && lseek (File, wad.FileSize, SEEK_SET) != (off_t)wad.FileSize)
+#endif
+	{
+		WriteFailed ();
+	}
+	if (File < 0)
+	{
+		throw std::runtime_error("Could not open output file");
+	}
+	Buffer = new uint8_t[BUFFER_SIZE];
+
+	// The old directory stays valid until Close() rewrites the header.
+	Offset = wad.FileSize;
+}
+
 FWadWriter::~FWadWriter ()
 {
-	if (File)
+	if (File >= 0 || Memory != nullptr)
 	{
 		Close ();
 	}
+	delete[] Buffer;
 }
 
 void FWadWriter::Close ()
 {
-	if (File)
+	if (Memory != nullptr)
+	{
+		int32_t head[2];
+
+		head[0] = LittleLong(Lumps.Size());
+		head[1] = LittleLong((int32_t)Offset);
+
+		SafeWrite (&Lumps[0], sizeof(WadLump)*Lumps.Size());
+		FlushBuffer ();
+		memcpy (Memory->data() + 4, head, 8);
+		Memory = nullptr;
+	}
+	else if (File >= 0)
 	{
 		int32_t head[2];
 
 		head[0] = LittleLong(Lumps.Size());
-		head[1] = LittleLong(ftell (File));
+		head[1] = LittleLong((int32_t)Offset);
 
 		SafeWrite (&Lumps[0], sizeof(WadLump)*Lumps.Size());
-		fseek (File, 4, SEEK_SET);
-		SafeWrite (head, 8);
-		fclose (File);
-		File = nullptr;
+		FlushBuffer ();
+#ifdef _WIN32
+		if (_lseeki64 (File, 4, SEEK_SET) != 4)
+#else
+		if (lseek (File, 4, SEEK_SET) != 4)
+#endif
+		{
+			WriteFailed ();
+		}
+		RawWrite (head, 8);
+#ifdef _WIN32
+		_close (File);
+#else
+		close (File);
+#endif
+		File = -1;
 	}
 }
 
@@ -396,7 +711,7 @@ void FWadWriter::CreateLabel (const char *name)
 	WadLump lump;
 
 	strncpy (lump.Name, name, 8);
-	lump.FilePos = LittleLong(ftell (File));
+	lump.FilePos = LittleLong((int32_t)Offset);
 	lump.Size = 0;
 	Lumps.Push (lump);
 }
@@ -406,7 +721,7 @@ void FWadWriter::WriteLump (const char *name, const void *data, int len)
 	WadLump lump;
 
 	strncpy (lump.Name, name, 8);
-	lump.FilePos = LittleLong(ftell (File));
+	lump.FilePos = LittleLong((int32_t)Offset);
 	lump.Size = LittleLong(len);
 	Lumps.Push (lump);
 
@@ -415,15 +730,45 @@ void FWadWriter::WriteLump (const char *name, const void *data, int len)
 
 void FWadWriter::CopyLump (FWadReader &wad, int lump)
 {
-	uint8_t *data;
-	int size;
+	if ((unsigned)lump >= (unsigned)wad.NumLumps ())
+	{
+		return;
+	}
+
+	FLumpSpan span = wad.GetLump (lump);
 
-	ReadLump<uint8_t> (wad, lump, data, size);
-	if (data != nullptr)
+	if (AppendTo == &wad)
 	{
-		WriteLump (wad.LumpName (lump), data, size);
-		delete[] data;
+		// The data is already in the file.
+		WadLump entry = wad.Lumps[lump];
+		entry.FilePos = LittleLong(entry.FilePos);
+		entry.Size = LittleLong(entry.Size);
+		Lumps.Push (entry);
+		return;
 	}
+
+	WadLump entry;
+
+	strncpy (entry.Name, wad.LumpName (lump), 8);
+	entry.FilePos = LittleLong((int32_t)Offset);
+	entry.Size = LittleLong((int32_t)span.Size);
+	Lumps.Push (entry);
+
+	if (span.Size == 0)
+	{
+		return;
+	}
+
+	// Extend the pending copy if this lump directly follows it in the source.
+	size_t start = span.Data - wad.FileData;
+	if (CopySource != &wad || CopyStart + CopyLength != start)
+	{
+		FlushCopy ();
+		CopySource = &wad;
+		CopyStart = start;
+	}
+	CopyLength += span.Size;
+	Offset += span.Size;
 }
 
 void FWadWriter::StartWritingLump (const char *name)
@@ -439,14 +784,145 @@ void FWadWriter::AddToLump (const void *data, int len)
 
 void FWadWriter::SafeWrite (const void *buffer, size_t size)
 {
-	if (fwrite (buffer, 1, size, File) != size)
+	FlushCopy ();
+	Offset += size;
+
+	if (BufferUsed + size > BUFFER_SIZE)
+	{
+		FlushBuffer ();
+		if (size >= BUFFER_SIZE)
+		{
+			RawWrite (buffer, size);
+			return;
+		}
+	}
+	memcpy (Buffer + BufferUsed, buffer, size);
+	BufferUsed += size;
+}
+
+void FWadWriter::FlushBuffer ()
+{
+	if (BufferUsed > 0)
+	{
+		RawWrite (Buffer, BufferUsed);
+		BufferUsed = 0;
+	}
+}
+
+void FWadWriter::FlushCopy ()
+{
+	if (CopySource == nullptr)
+	{
+		return;
+	}
+
+	const FWadReader *source = CopySource;
+	size_t start = CopyStart;
+	size_t length = CopyLength;
+	const uint8_t *src = source->FileData + start;
+	CopySource = nullptr;
+	CopyLength = 0;
+
+	if (length < MIN_KERNEL_COPY)
+	{
+		// Not worth the system calls; combine it with the surrounding writes.
+		if (BufferUsed + length > BUFFER_SIZE)
+		{
+			FlushBuffer ();
+		}
+		memcpy (Buffer + BufferUsed, src, length);
+		BufferUsed += length;
+		return;
+	}
+
+	FlushBuffer ();
+#ifndef _WIN32
+	if (source->FileDesc >= 0 && File >= 0)
+	{
+		size_t copied = KernelCopy (source->FileDesc, start, length);
+		src += copied;
+		length -= copied;
+	}
+#endif
+	if (length > 0)
+	{
+		RawWrite (src, length);
+	}
+}
+
+// Copies directly between the input and output files without the data
+// passing through user space. Returns how much was copied; the caller
+// writes whatever is left from the mapped input.
+size_t FWadWriter::KernelCopy (int srcfd, size_t start, size_t length)
+{
+#ifdef __linux__
+	off_t pos = (off_t)start;
+	size_t left = length;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	while (left > 0)
 	{
-		fclose (File);
-		File = nullptr;
-		throw std::runtime_error(
-			"Failed to write. Check that this directory is writable and\n"
-			"that you have enough free disk space.");
+		ssize_t done = copy_file_range (srcfd, &pos, File, nullptr, left, 0);
+		if (done <= 0)
+		{
+			break;
+		}
+		left -= done;
 	}
+#endif
+	// Older kernels and some file system combinations cannot do copy_file_range.
+	while (left > 0)
+	{
+		ssize_t done = sendfile (File, srcfd, &pos, left);
+		if (done <= 0)
+		{
+			break;
+		}
+		left -= done;
+	}
+	return length - left;
+#else
+	return 0;
+#endif
+}
+
+void FWadWriter::RawWrite (const void *buffer, size_t size)
+{
+	const uint8_t *data = (const uint8_t *)buffer;
+
+	if (Memory != nullptr)
+	{
+		Memory->insert (Memory->end(), data, data + size);
+		return;
+	}
+
+	while (size > 0)
+	{
+#ifdef _WIN32
+		int done = _write (File, data, (unsigned)std::min<size_t> (size, 1u << 30));
+#else
+		ssize_t done = write (File, data, size);
+#endif
+		if (done <= 0)
+		{
+			WriteFailed ();
+		}
+		data += done;
+		size -= done;
+	}
+}
+
+void FWadWriter::WriteFailed ()
+{
+#ifdef _WIN32
+	_close (File);
+#else
+	close (File);
+#endif
+	File = -1;
+	throw std::runtime_error(
+		"Failed to write. Check that this directory is writable and\n"
+		"that you have enough free disk space.");
 }
 
 FWadWriter &FWadWriter::operator << (uint8_t val)
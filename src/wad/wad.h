@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unordered_map>
+#include <vector>
 
 #include "framework/zdray.h"
 #include "framework/tarray.h"
@@ -21,10 +23,30 @@ struct WadLump
 	char	Name[8];
 };
 
+// A read-only view of a lump's bytes inside the mapped wad file. Lumps
+// are not aligned in a wad, so elements are copied out one at a time.
+struct FLumpSpan
+{
+	const uint8_t *Data = nullptr;
+	size_t Size = 0;
+
+	template<class T> int Count () const
+	{
+		return int(Size / sizeof(T));
+	}
+	template<class T> T Get (int index) const
+	{
+		T val;
+		memcpy (&val, Data + index * sizeof(T), sizeof(T));
+		return val;
+	}
+};
+
 class FWadReader
 {
 public:
 	FWadReader (const char *filename);
+	FWadReader (const uint8_t *data, size_t size);
 	~FWadReader ();
 
 	bool IsIWAD () const;
@@ -40,36 +62,68 @@ public:
 	int NextMap (int startindex) const;
 	int LumpAfterMap (int map) const;
 	int NumLumps () const;
+	size_t FileBytes () const;
+	size_t UnusedBytes () const;
 
-	void SafeRead (void *buffer, size_t size);
-
-// VC++ 6 does not support template member functions in non-template classes!
-	template<class T>
-	friend void ReadLump (FWadReader &wad, int index, T *&data, int &size);
+	// The span stays valid for as long as the reader exists.
+	FLumpSpan GetLump (int index) const;
+	FLumpSpan GetMapLump (const char *name, int map) const;
 
 private:
+	struct FMapRange
+	{
+		int End;			// First lump after the map
+		int Lumps[12];		// Index of each MapLumpNames entry, or -1
+	};
+
 	WadHeader Header;
 	WadLump *Lumps;
-	FILE *File;
+
+	// Directory index, built once when the file is opened. Names are
+	// upper-cased and packed into 64 bits so comparing them is one compare.
+	TArray<uint64_t> Keys;
+	std::unordered_map<uint64_t, int> FirstByName;
+	TArray<int> NextByName;		// Next lump with the same name, in directory order
+	TArray<int> MapAt;			// Index into Maps for map headers, else -1
+	TArray<FMapRange> Maps;
+
+	const uint8_t *FileData;
+	size_t FileSize;
+	bool Mapped;
+#ifdef _WIN32
+	void *FileHandle, *MappingHandle;
+#else
+	int FileDesc;	// Kept open so FWadWriter can copy lumps file-to-file
+#endif
+
+	void MapFile (const char *filename);
+	void UnmapFile ();
+
+	void ReadDirectory ();
+	void BuildIndex ();
+	uint64_t KeyAt (int lump) const;
+	bool ScanMap (int index, FMapRange &range) const;
+
+	friend class FWadWriter;
 };
 
 
+// Reads a lump into a new[]ed array, for data that must outlive the reader
+// or be modified.
 template<class T>
 void ReadLump (FWadReader &wad, int index, T *&data, int &size)
 {
-	if ((unsigned)index >= (unsigned)wad.Header.NumLumps)
+	FLumpSpan span = wad.GetLump (index);
+
+	if (span.Data == nullptr)
 	{
 		data = nullptr;
 		size = 0;
 		return;
 	}
-	if (fseek (wad.File, wad.Lumps[index].FilePos, SEEK_SET))
-	{
-		throw std::runtime_error("Failed to seek");
-	}
-	size = wad.Lumps[index].Size / sizeof(T);
+	size = span.Count<T> ();
 	data = new T[size];
-	wad.SafeRead (data, size*sizeof(T));
+	memcpy (data, span.Data, size*sizeof(T));
 }
 
 template<class T>
@@ -83,6 +137,11 @@ class FWadWriter
 {
 public:
 	FWadWriter (const char *filename, bool iwad);
+	// Updates the file wad was read from. New lumps are appended, lumps
+	// copied from wad keep their data where it is, and only the directory
+	// and header are rewritten.
+	FWadWriter (FWadReader &wad, const char *filename);
+	FWadWriter (std::vector<uint8_t> &output, bool iwad);
 	~FWadWriter ();
 
 	void CreateLabel (const char *name);
@@ -101,8 +160,30 @@ public:
 	FWadWriter &operator << (fixed_t);
 
 private:
+	enum
+	{
+		BUFFER_SIZE = 4 << 20,
+		MIN_KERNEL_COPY = 64 << 10	// Shorter copies go through the buffer
+	};
+
 	TArray<WadLump> Lumps;
-	FILE *File;
+	int File;
+	int64_t Offset;			// Logical end of the output, including pending data
+
+	uint8_t *Buffer;
+	size_t BufferUsed;
+
+	// Lumps copied unchanged from an input wad are collected into one
+	// contiguous source range and written when something else is output.
+	const FWadReader *CopySource;
+	const FWadReader *AppendTo;
+	std::vector<uint8_t> *Memory;
+	size_t CopyStart, CopyLength;
 
 	void SafeWrite (const void *buffer, size_t size);
+	void RawWrite (const void *buffer, size_t size);
+	void FlushBuffer ();
+	void FlushCopy ();
+	size_t KernelCopy (int srcfd, size_t start, size_t length);
+	void WriteFailed ();
 };